@@ -0,0 +1,165 @@
+/*
+	bitmap.c (16.10.26)
+	Compares clusters bitmap search kernels with bit by bit loops.
+
+	Free exFAT implementation.
+	Copyright (C) 2010-2023  Andrew Nayenko
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <exfat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* 1 TB volume with 4 KB clusters */
+#define DEFAULT_CLUSTERS (256u * 1024 * 1024)
+#define ROUNDS 5
+
+static volatile size_t sink;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* first zero bit, skipping full words, as the allocator did before */
+static size_t find_zero_bits(const bitmap_t* bitmap, size_t start, size_t end)
+{
+	size_t i, c;
+
+	for (i = BMAP_BLOCK(start); i < DIV_ROUND_UP(end, sizeof(bitmap_t) * 8);
+			i++)
+	{
+		if (bitmap[i] == (bitmap_t) ~((bitmap_t) 0))
+			continue;
+		for (c = MAX(i * sizeof(bitmap_t) * 8, start);
+				c < MIN((i + 1) * sizeof(bitmap_t) * 8, end); c++)
+			if (BMAP_GET(bitmap, c) == 0)
+				return c;
+	}
+	return end;
+}
+
+/* first one bit, as used clusters were searched before */
+static size_t find_one_bits(const bitmap_t* bitmap, size_t start, size_t end)
+{
+	size_t c;
+
+	for (c = start; c < end; c++)
+		if (BMAP_GET(bitmap, c))
+			break;
+	return c;
+}
+
+/* one bits count, as free clusters were counted before */
+static size_t count_bits(const bitmap_t* bitmap, size_t count)
+{
+	size_t ones = 0;
+	size_t c;
+
+	for (c = 0; c < count; c++)
+		if (BMAP_GET(bitmap, c))
+			ones++;
+	return ones;
+}
+
+static double run_find(size_t (*find)(const bitmap_t*, size_t, size_t),
+		const bitmap_t* bitmap, size_t count)
+{
+	double best = 1e9;
+	double t;
+	int i;
+
+	for (i = 0; i < ROUNDS; i++)
+	{
+		t = now();
+		sink = find(bitmap, 0, count);
+		best = MIN(best, now() - t);
+	}
+	return best * 1000;
+}
+
+static double run_count(size_t (*fn)(const bitmap_t*, size_t),
+		const bitmap_t* bitmap, size_t count)
+{
+	double best = 1e9;
+	double t;
+	int i;
+
+	for (i = 0; i < ROUNDS; i++)
+	{
+		t = now();
+		sink = fn(bitmap, count);
+		best = MIN(best, now() - t);
+	}
+	return best * 1000;
+}
+
+int main(int argc, char* argv[])
+{
+	size_t count = DEFAULT_CLUSTERS;
+	bitmap_t* bitmap;
+
+	if (argc > 2)
+	{
+		fprintf(stderr, "Usage: %s [clusters]\n", argv[0]);
+		return 1;
+	}
+	if (argc == 2)
+		count = strtoul(argv[1], NULL, 10);
+	if (count == 0)
+	{
+		fprintf(stderr, "Invalid clusters count.\n");
+		return 1;
+	}
+	bitmap = malloc(BMAP_SIZE(count));
+	if (bitmap == NULL)
+	{
+		fprintf(stderr, "Failed to allocate %zu bytes.\n", BMAP_SIZE(count));
+		return 1;
+	}
+	printf("%zu clusters (%zu KB bitmap), best of %d rounds, ms\n",
+			count, BMAP_SIZE(count) / 1024, ROUNDS);
+	printf("%-28s %12s %12s\n", "", "bit by bit", "word");
+
+	/* nearly full volume: the only free cluster is the last one */
+	memset(bitmap, 0xff, BMAP_SIZE(count));
+	BMAP_CLR(bitmap, count - 1);
+	printf("%-28s %12.2f %12.2f\n", "free cluster, nearly full",
+			run_find(find_zero_bits, bitmap, count),
+			run_find(exfat_bmap_find_zero, bitmap, count));
+
+	/* nearly empty volume: the only used cluster is the last one */
+	memset(bitmap, 0, BMAP_SIZE(count));
+	BMAP_SET(bitmap, count - 1);
+	printf("%-28s %12.2f %12.2f\n", "used cluster, nearly empty",
+			run_find(find_one_bits, bitmap, count),
+			run_find(exfat_bmap_find_one, bitmap, count));
+
+	/* every other cluster is used */
+	memset(bitmap, 0x55, BMAP_SIZE(count));
+	printf("%-28s %12.2f %12.2f\n", "count, half full",
+			run_count(count_bits, bitmap, count),
+			run_count(exfat_bmap_count, bitmap, count));
+
+	free(bitmap);
+	return 0;
+}
@@ -49,7 +49,7 @@ static int nodeck(struct exfat* ef, struct exfat_node* node)
 			rc = 1;
 			break;
 		}
-		if (BMAP_GET(ef->cmap.chunk, c - EXFAT_FIRST_DATA_CLUSTER) == 0)
+		if (exfat_test_cluster(ef, c) == 0)
 		{
 			char name[EXFAT_UTF8_NAME_BUFFER_MAX];
 
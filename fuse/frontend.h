@@ -0,0 +1,63 @@
+/*
+	frontend.h (16.10.26)
+	Definitions shared by FUSE frontends.
+
+	Free exFAT implementation.
+	Copyright (C) 2010-2023  Andrew Nayenko
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef FUSE_FRONTEND_H_INCLUDED
+#define FUSE_FRONTEND_H_INCLUDED
+
+#include <exfat.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <sys/statvfs.h>
+
+#ifndef DEBUG
+	#define exfat_debug(format, ...) do {} while (0)
+#endif
+
+extern struct exfat ef;
+
+/*
+   Operations that change the tree of nodes take this lock exclusively, all
+   others take it shared. Finer-grained locking is done by libexfat, see
+   exfat.h.
+*/
+void lock_tree(bool exclusive);
+void unlock_tree(void);
+
+int check_mode(mode_t mode);
+int check_owner(uid_t uid, gid_t gid);
+void get_statfs(struct statvfs* sfs);
+
+/* FUSE passes fallocate() flags as Linux defines them */
+#ifndef FALLOC_FL_KEEP_SIZE
+	#define FALLOC_FL_KEEP_SIZE 0x01
+#endif
+
+int preallocate(struct exfat_node* node, int mode, off_t offset,
+		off_t length);
+
+/*
+   Implemented by the frontend: either high-level (path-based) or low-level
+   (inode-based) one.
+*/
+int fuse_exfat_main(char* mount_options, char* mount_point, bool multithread);
+
+#endif /* ifndef FUSE_FRONTEND_H_INCLUDED */
@@ -0,0 +1,538 @@
+/*
+	highlevel.c (16.10.26)
+	FUSE high-level (path-based) API frontend. Requires FUSE 2.6 or later.
+
+	Free exFAT implementation.
+	Copyright (C) 2010-2023  Andrew Nayenko
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "frontend.h"
+#include <fuse.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+
+#if !defined(FUSE_VERSION) || (FUSE_VERSION < 26)
+	#error FUSE 2.6 or later is required
+#endif
+
+static struct exfat_node* get_node(const struct fuse_file_info* fi)
+{
+	return (struct exfat_node*) (size_t) fi->fh;
+}
+
+static void set_node(struct fuse_file_info* fi, struct exfat_node* node)
+{
+	fi->fh = (uint64_t) (size_t) node;
+	fi->keep_cache = 1;
+}
+
+static int fuse_exfat_getattr(const char* path, struct stat* stbuf
+#if FUSE_USE_VERSION >= 30
+		, UNUSED struct fuse_file_info* fi
+#endif
+		)
+{
+	struct exfat_node* node;
+	int rc;
+
+	exfat_debug("[%s] %s", __func__, path);
+
+	lock_tree(false);
+	rc = exfat_lookup(&ef, &node, path);
+	if (rc != 0)
+	{
+		unlock_tree();
+		return rc;
+	}
+
+	exfat_stat(&ef, node, stbuf);
+	exfat_put_node(&ef, node);
+	unlock_tree();
+	return 0;
+}
+
+static int fuse_exfat_truncate(const char* path, off_t size
+#if FUSE_USE_VERSION >= 30
+		, UNUSED struct fuse_file_info* fi
+#endif
+		)
+{
+	struct exfat_node* node;
+	int rc;
+
+	exfat_debug("[%s] %s, %"PRId64, __func__, path, size);
+
+	lock_tree(false);
+	rc = exfat_lookup(&ef, &node, path);
+	if (rc != 0)
+	{
+		unlock_tree();
+		return rc;
+	}
+
+	rc = exfat_truncate(&ef, node, size, true);
+	if (rc != 0)
+	{
+		exfat_flush_node(&ef, node);	/* ignore return code */
+		exfat_put_node(&ef, node);
+		unlock_tree();
+		return rc;
+	}
+	rc = exfat_flush_node(&ef, node);
+	exfat_put_node(&ef, node);
+	unlock_tree();
+	return rc;
+}
+
+static int fuse_exfat_readdir(const char* path, void* buffer,
+		fuse_fill_dir_t filler, UNUSED off_t offset,
+		UNUSED struct fuse_file_info* fi
+#if FUSE_USE_VERSION >= 30
+		, UNUSED enum fuse_readdir_flags flags
+#endif
+		)
+{
+	struct exfat_node* parent;
+	struct exfat_node* node;
+	struct exfat_iterator it;
+	int rc;
+	char name[EXFAT_UTF8_NAME_BUFFER_MAX];
+	struct stat stbuf;
+
+	exfat_debug("[%s] %s", __func__, path);
+
+	lock_tree(false);
+	rc = exfat_lookup(&ef, &parent, path);
+	if (rc != 0)
+	{
+		unlock_tree();
+		return rc;
+	}
+	if (!(parent->attrib & EXFAT_ATTRIB_DIR))
+	{
+		exfat_put_node(&ef, parent);
+		unlock_tree();
+		exfat_error("'%s' is not a directory (%#hx)", path, parent->attrib);
+		return -ENOTDIR;
+	}
+
+#if FUSE_USE_VERSION < 30
+	filler(buffer, ".", NULL, 0);
+	filler(buffer, "..", NULL, 0);
+#else
+	filler(buffer, ".", NULL, 0, 0);
+	filler(buffer, "..", NULL, 0, 0);
+#endif
+
+	rc = exfat_opendir(&ef, parent, &it);
+	if (rc != 0)
+	{
+		exfat_put_node(&ef, parent);
+		unlock_tree();
+		exfat_error("failed to open directory '%s'", path);
+		return rc;
+	}
+	while ((node = exfat_readdir(&it)))
+	{
+		exfat_get_name(node, name);
+		exfat_debug("[%s] %s: %s, %"PRId64" bytes, cluster 0x%x", __func__,
+				name, node->is_contiguous ? "contiguous" : "fragmented",
+				node->size, node->start_cluster);
+		exfat_stat(&ef, node, &stbuf);
+#if FUSE_USE_VERSION < 30
+		filler(buffer, name, &stbuf, 0);
+#else
+		filler(buffer, name, &stbuf, 0, 0);
+#endif
+		exfat_put_node(&ef, node);
+	}
+	exfat_closedir(&ef, &it);
+	exfat_put_node(&ef, parent);
+	unlock_tree();
+	return 0;
+}
+
+static int fuse_exfat_open(const char* path, struct fuse_file_info* fi)
+{
+	struct exfat_node* node;
+	int rc;
+
+	exfat_debug("[%s] %s flags %#x%s%s%s%s%s", __func__, path, fi->flags,
+			fi->flags & O_RDONLY ? " O_RDONLY" : "",
+			fi->flags & O_WRONLY ? " O_WRONLY" : "",
+			fi->flags & O_RDWR   ? " O_RDWR"   : "",
+			fi->flags & O_APPEND ? " O_APPEND" : "",
+			fi->flags & O_TRUNC  ? " O_TRUNC"  : "");
+
+	lock_tree(false);
+	rc = exfat_lookup(&ef, &node, path);
+	if (rc != 0)
+	{
+		unlock_tree();
+		return rc;
+	}
+	/* FUSE 2.x will call fuse_exfat_truncate() explicitly */
+#if FUSE_USE_VERSION >= 30
+	if (fi->flags & O_TRUNC)
+	{
+		rc = exfat_truncate(&ef, node, 0, true);
+		if (rc != 0)
+		{
+			exfat_put_node(&ef, node);
+			unlock_tree();
+			return rc;
+		}
+	}
+#endif
+	exfat_open_node(node);
+	unlock_tree();
+	set_node(fi, node);
+	return 0;
+}
+
+static int fuse_exfat_create(const char* path, UNUSED mode_t mode,
+		struct fuse_file_info* fi)
+{
+	struct exfat_node* node;
+	int rc;
+
+	exfat_debug("[%s] %s 0%ho", __func__, path, mode);
+
+	lock_tree(true);
+	rc = exfat_mknod(&ef, path);
+	if (rc != 0)
+	{
+		unlock_tree();
+		return rc;
+	}
+	rc = exfat_lookup(&ef, &node, path);
+	if (rc != 0)
+	{
+		unlock_tree();
+		return rc;
+	}
+	exfat_open_node(node);
+	unlock_tree();
+	set_node(fi, node);
+	return 0;
+}
+
+static int fuse_exfat_release(UNUSED const char* path,
+		struct fuse_file_info* fi)
+{
+	/*
+	   This handler is called by FUSE on close() syscall. If the FUSE
+	   implementation does not call flush handler, we will flush node here.
+	   But in this case we will not be able to return an error to the caller.
+	   See fuse_exfat_flush() below.
+	*/
+	exfat_debug("[%s] %s", __func__, path);
+	lock_tree(false);
+ 	exfat_flush_node(&ef, get_node(fi));
+	exfat_close_node(&ef, get_node(fi));
+	exfat_put_node(&ef, get_node(fi));
+	unlock_tree();
+	return 0; /* FUSE ignores this return value */
+}
+
+static int fuse_exfat_flush(UNUSED const char* path, struct fuse_file_info* fi)
+{
+	/*
+	   This handler may be called by FUSE on close() syscall. FUSE also deals
+	   with removals of open files, so we don't free clusters on close but
+	   only on rmdir and unlink. If the FUSE implementation does not call this
+	   handler we will flush node on release. See fuse_exfat_release() above.
+	*/
+	int rc;
+
+	exfat_debug("[%s] %s", __func__, path);
+	lock_tree(false);
+	rc = exfat_flush_node(&ef, get_node(fi));
+	unlock_tree();
+	return rc;
+}
+
+static int fuse_exfat_fsync(UNUSED const char* path, UNUSED int datasync,
+		UNUSED struct fuse_file_info* fi)
+{
+	int rc;
+
+	exfat_debug("[%s] %s", __func__, path);
+	lock_tree(true);
+	rc = exfat_flush_nodes(&ef);
+	if (rc == 0)
+		rc = exfat_flush(&ef);
+	unlock_tree();
+	if (rc != 0)
+		return rc;
+	return exfat_fsync(ef.dev);
+}
+
+static int fuse_exfat_read(UNUSED const char* path, char* buffer,
+		size_t size, off_t offset, struct fuse_file_info* fi)
+{
+	int rc;
+
+	exfat_debug("[%s] %s (%zu bytes)", __func__, path, size);
+	lock_tree(false);
+	rc = exfat_generic_pread(&ef, get_node(fi), buffer, size, offset);
+	unlock_tree();
+	return rc;
+}
+
+static int fuse_exfat_write(UNUSED const char* path, const char* buffer,
+		size_t size, off_t offset, struct fuse_file_info* fi)
+{
+	int rc;
+
+	exfat_debug("[%s] %s (%zu bytes)", __func__, path, size);
+	lock_tree(false);
+	rc = exfat_generic_pwrite(&ef, get_node(fi), buffer, size, offset);
+	unlock_tree();
+	return rc;
+}
+
+#if FUSE_VERSION >= 29
+static int fuse_exfat_fallocate(UNUSED const char* path, int mode,
+		off_t offset, off_t length, struct fuse_file_info* fi)
+{
+	int rc;
+
+	exfat_debug("[%s] %s %#x %"PRId64" %"PRId64, __func__, path, mode,
+			offset, length);
+	lock_tree(false);
+	rc = preallocate(get_node(fi), mode, offset, length);
+	unlock_tree();
+	return rc;
+}
+#endif
+
+static int fuse_exfat_unlink(const char* path)
+{
+	struct exfat_node* node;
+	int rc;
+
+	exfat_debug("[%s] %s", __func__, path);
+
+	lock_tree(true);
+	rc = exfat_lookup(&ef, &node, path);
+	if (rc != 0)
+	{
+		unlock_tree();
+		return rc;
+	}
+
+	rc = exfat_unlink(&ef, node);
+	exfat_put_node(&ef, node);
+	if (rc == 0)
+		rc = exfat_cleanup_node(&ef, node);
+	unlock_tree();
+	return rc;
+}
+
+static int fuse_exfat_rmdir(const char* path)
+{
+	struct exfat_node* node;
+	int rc;
+
+	exfat_debug("[%s] %s", __func__, path);
+
+	lock_tree(true);
+	rc = exfat_lookup(&ef, &node, path);
+	if (rc != 0)
+	{
+		unlock_tree();
+		return rc;
+	}
+
+	rc = exfat_rmdir(&ef, node);
+	exfat_put_node(&ef, node);
+	if (rc == 0)
+		rc = exfat_cleanup_node(&ef, node);
+	unlock_tree();
+	return rc;
+}
+
+static int fuse_exfat_mknod(const char* path, UNUSED mode_t mode,
+		UNUSED dev_t dev)
+{
+	int rc;
+
+	exfat_debug("[%s] %s 0%ho", __func__, path, mode);
+	lock_tree(true);
+	rc = exfat_mknod(&ef, path);
+	unlock_tree();
+	return rc;
+}
+
+static int fuse_exfat_mkdir(const char* path, UNUSED mode_t mode)
+{
+	int rc;
+
+	exfat_debug("[%s] %s 0%ho", __func__, path, mode);
+	lock_tree(true);
+	rc = exfat_mkdir(&ef, path);
+	unlock_tree();
+	return rc;
+}
+
+static int fuse_exfat_rename(const char* old_path, const char* new_path
+#if FUSE_USE_VERSION >= 30
+		, UNUSED unsigned int flags
+#endif
+		)
+{
+	int rc;
+
+	exfat_debug("[%s] %s => %s", __func__, old_path, new_path);
+	lock_tree(true);
+	rc = exfat_rename(&ef, old_path, new_path);
+	unlock_tree();
+	return rc;
+}
+
+static int fuse_exfat_utimens(const char* path, const struct timespec tv[2]
+#if FUSE_USE_VERSION >= 30
+		, UNUSED struct fuse_file_info* fi
+#endif
+		)
+{
+	struct exfat_node* node;
+	int rc;
+
+	exfat_debug("[%s] %s", __func__, path);
+
+	lock_tree(false);
+	rc = exfat_lookup(&ef, &node, path);
+	if (rc != 0)
+	{
+		unlock_tree();
+		return rc;
+	}
+
+	exfat_utimes(node, tv);
+	rc = exfat_flush_node(&ef, node);
+	exfat_put_node(&ef, node);
+	unlock_tree();
+	return rc;
+}
+
+static int fuse_exfat_chmod(UNUSED const char* path, mode_t mode
+#if FUSE_USE_VERSION >= 30
+		, UNUSED struct fuse_file_info* fi
+#endif
+		)
+{
+	exfat_debug("[%s] %s 0%ho", __func__, path, mode);
+	return check_mode(mode);
+}
+
+static int fuse_exfat_chown(UNUSED const char* path, uid_t uid, gid_t gid
+#if FUSE_USE_VERSION >= 30
+		, UNUSED struct fuse_file_info* fi
+#endif
+		)
+{
+	exfat_debug("[%s] %s %u:%u", __func__, path, uid, gid);
+	return check_owner(uid, gid);
+}
+
+static int fuse_exfat_statfs(UNUSED const char* path, struct statvfs* sfs)
+{
+	exfat_debug("[%s]", __func__);
+	get_statfs(sfs);
+	return 0;
+}
+
+static void* fuse_exfat_init(
+#ifdef FUSE_CAP_BIG_WRITES
+		struct fuse_conn_info* fci
+#else
+		UNUSED struct fuse_conn_info* fci
+#endif
+#if FUSE_USE_VERSION >= 30
+		, UNUSED struct fuse_config* cfg
+#endif
+		)
+{
+	exfat_debug("[%s]", __func__);
+#ifdef FUSE_CAP_BIG_WRITES
+	fci->want |= FUSE_CAP_BIG_WRITES;
+#endif
+
+	/* mark super block as dirty; failure isn't a big deal */
+	exfat_soil_super_block(&ef);
+
+	return NULL;
+}
+
+static void fuse_exfat_destroy(UNUSED void* unused)
+{
+	exfat_debug("[%s]", __func__);
+	exfat_debug("[%s] FAT cache: %"PRIu64" hits, %"PRIu64" misses", __func__,
+			ef.fat.hits, ef.fat.misses);
+	exfat_debug("[%s] blocks cache: %"PRIu64" hits, %"PRIu64" misses",
+			__func__, ef.blocks.hits, ef.blocks.misses);
+	exfat_debug("[%s] dentry cache: %"PRIu64" hits, %"PRIu64" misses",
+			__func__, ef.dentries.hits, ef.dentries.misses);
+	exfat_debug("[%s] nodes: %u in use, %u directories cached, "
+			"%"PRIu64" evicted", __func__, ef.nodes.count,
+			ef.nodes.directories, ef.nodes.evictions);
+	exfat_unmount(&ef);
+}
+
+static struct fuse_operations fuse_exfat_ops =
+{
+	.getattr	= fuse_exfat_getattr,
+	.truncate	= fuse_exfat_truncate,
+	.readdir	= fuse_exfat_readdir,
+	.open		= fuse_exfat_open,
+	.create		= fuse_exfat_create,
+	.release	= fuse_exfat_release,
+	.flush		= fuse_exfat_flush,
+	.fsync		= fuse_exfat_fsync,
+	.fsyncdir	= fuse_exfat_fsync,
+	.read		= fuse_exfat_read,
+	.write		= fuse_exfat_write,
+#if FUSE_VERSION >= 29
+	.fallocate	= fuse_exfat_fallocate,
+#endif
+	.unlink		= fuse_exfat_unlink,
+	.rmdir		= fuse_exfat_rmdir,
+	.mknod		= fuse_exfat_mknod,
+	.mkdir		= fuse_exfat_mkdir,
+	.rename		= fuse_exfat_rename,
+	.utimens	= fuse_exfat_utimens,
+	.chmod		= fuse_exfat_chmod,
+	.chown		= fuse_exfat_chown,
+	.statfs		= fuse_exfat_statfs,
+	.init		= fuse_exfat_init,
+	.destroy	= fuse_exfat_destroy,
+};
+
+
+int fuse_exfat_main(char* mount_options, char* mount_point, bool multithread)
+{
+	char* argv[] = {"exfat", "-o", mount_options, mount_point, "-s", NULL};
+	int argc = sizeof(argv) / sizeof(argv[0]) - 1;
+
+	/* FUSE serves requests from a single thread if "-s" is passed */
+	if (multithread)
+		argc--;
+	return fuse_main(argc, argv, &fuse_exfat_ops, NULL);
+}
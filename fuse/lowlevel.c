@@ -0,0 +1,796 @@
+/*
+	lowlevel.c (16.10.26)
+	FUSE low-level (inode-based) API frontend. Requires FUSE 3.0 or later.
+
+	Free exFAT implementation.
+	Copyright (C) 2010-2023  Andrew Nayenko
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "frontend.h"
+#include <fuse_lowlevel.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#if !defined(FUSE_USE_VERSION) || (FUSE_USE_VERSION < 30)
+	#error FUSE 3.0 or later is required
+#endif
+
+/* same as default entry and attribute timeouts of the high-level API */
+#define CACHE_TIMEOUT 1.0
+
+/*
+   Contents of an open directory in the format of readdir replies. It is
+   built when the directory is read from the beginning, so that subsequent
+   replies are consistent even if the directory changes in between.
+*/
+struct dir_buffer
+{
+	char* data;
+	size_t size;
+	size_t allocated;
+};
+
+/*
+   Inode number is the node pointer, except for the root directory which
+   must be FUSE_ROOT_ID. Every successful lookup reply holds a reference to
+   the node which is dropped on forget, so the pointer remains valid as long
+   as the kernel knows it.
+*/
+static struct exfat_node* get_node(fuse_ino_t ino)
+{
+	if (ino == FUSE_ROOT_ID)
+		return ef.root;
+	return (struct exfat_node*) (size_t) ino;
+}
+
+static fuse_ino_t get_ino(const struct exfat_node* node)
+{
+	if (node == ef.root)
+		return FUSE_ROOT_ID;
+	return (fuse_ino_t) (size_t) node;
+}
+
+static struct exfat_node* get_file_node(const struct fuse_file_info* fi)
+{
+	return (struct exfat_node*) (size_t) fi->fh;
+}
+
+static void set_file_node(struct fuse_file_info* fi, struct exfat_node* node)
+{
+	fi->fh = (uint64_t) (size_t) node;
+	fi->keep_cache = 1;
+}
+
+static void get_stat(const struct exfat_node* node, struct stat* stbuf)
+{
+	exfat_stat(&ef, node, stbuf);
+	stbuf->st_ino = get_ino(node);
+}
+
+static void get_entry(struct exfat_node* node, struct fuse_entry_param* e)
+{
+	memset(e, 0, sizeof(struct fuse_entry_param));
+	e->ino = get_ino(node);
+	e->attr_timeout = CACHE_TIMEOUT;
+	e->entry_timeout = CACHE_TIMEOUT;
+	get_stat(node, &e->attr);
+}
+
+static bool is_unlinked(struct exfat_node* node)
+{
+	bool unlinked;
+
+	/* bit fields next to is_unlinked are changed under the node lock */
+	pthread_mutex_lock(&node->lock);
+	unlinked = node->is_unlinked;
+	pthread_mutex_unlock(&node->lock);
+	return unlinked;
+}
+
+/*
+   Drops references of a node. The tree must be locked exclusively: if the
+   node was unlinked while the kernel or an open file referenced it, its
+   clusters are freed when the last reference goes away.
+*/
+static int put_node(struct exfat_node* node, uint64_t count)
+{
+	while (count--)
+		exfat_put_node(&ef, node);
+	if (node->references != 0)
+		return 0;
+	return exfat_cleanup_node(&ef, node);
+}
+
+/*
+   Same as put_node() but takes the lock itself. Nodes cannot be unlinked
+   while the tree is locked shared, so the exclusive lock is taken only for
+   those that were unlinked already.
+*/
+static int release_node(struct exfat_node* node, uint64_t count)
+{
+	int rc;
+
+	lock_tree(false);
+	if (!is_unlinked(node))
+	{
+		while (count--)
+			exfat_put_node(&ef, node);
+		unlock_tree();
+		return 0;
+	}
+	unlock_tree();
+
+	lock_tree(true);
+	rc = put_node(node, count);
+	unlock_tree();
+	return rc;
+}
+
+/*
+   Replies with the node which has a reference for the kernel. If the reply
+   fails (e.g. the request was interrupted) the kernel will never forget the
+   node, so the reference is dropped here.
+*/
+static void reply_entry(fuse_req_t req, struct exfat_node* node)
+{
+	struct fuse_entry_param e;
+
+	get_entry(node, &e);
+	if (fuse_reply_entry(req, &e) == -ENOENT)
+		release_node(node, 1);
+}
+
+static void fuse_exfat_lookup(fuse_req_t req, fuse_ino_t parent,
+		const char* name)
+{
+	struct exfat_node* node;
+	int rc;
+
+	exfat_debug("[%s] %"PRIu64" %s", __func__, (uint64_t) parent, name);
+
+	lock_tree(false);
+	rc = exfat_lookup_name(&ef, get_node(parent), &node, name);
+	unlock_tree();
+	if (rc != 0)
+	{
+		fuse_reply_err(req, -rc);
+		return;
+	}
+	reply_entry(req, node);
+}
+
+static void fuse_exfat_forget(fuse_req_t req, fuse_ino_t ino,
+		uint64_t nlookup)
+{
+	exfat_debug("[%s] %"PRIu64" %"PRIu64, __func__, (uint64_t) ino, nlookup);
+
+	release_node(get_node(ino), nlookup);
+	fuse_reply_none(req);
+}
+
+static void fuse_exfat_forget_multi(fuse_req_t req, size_t count,
+		struct fuse_forget_data* forgets)
+{
+	size_t i;
+
+	exfat_debug("[%s] %zu", __func__, count);
+
+	for (i = 0; i < count; i++)
+		release_node(get_node(forgets[i].ino), forgets[i].nlookup);
+	fuse_reply_none(req);
+}
+
+static void fuse_exfat_getattr(fuse_req_t req, fuse_ino_t ino,
+		UNUSED struct fuse_file_info* fi)
+{
+	struct stat stbuf;
+
+	exfat_debug("[%s] %"PRIu64, __func__, (uint64_t) ino);
+
+	lock_tree(false);
+	get_stat(get_node(ino), &stbuf);
+	unlock_tree();
+	fuse_reply_attr(req, &stbuf, CACHE_TIMEOUT);
+}
+
+static int set_times(struct exfat_node* node, const struct stat* attr,
+		int to_set)
+{
+	struct timespec tv[2];
+
+	pthread_mutex_lock(&node->lock);
+	tv[0].tv_sec = node->atime;
+	tv[0].tv_nsec = 0;
+	tv[1].tv_sec = node->mtime;
+	tv[1].tv_nsec = 0;
+	if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+		tv[0].tv_sec = time(NULL);
+	else if (to_set & FUSE_SET_ATTR_ATIME)
+		tv[0].tv_sec = attr->st_atime;
+	if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+		tv[1].tv_sec = time(NULL);
+	else if (to_set & FUSE_SET_ATTR_MTIME)
+		tv[1].tv_sec = attr->st_mtime;
+	exfat_utimes(node, tv);
+	pthread_mutex_unlock(&node->lock);
+	return exfat_flush_node(&ef, node);
+}
+
+static void fuse_exfat_setattr(fuse_req_t req, fuse_ino_t ino,
+		struct stat* attr, int to_set, UNUSED struct fuse_file_info* fi)
+{
+	struct exfat_node* node = get_node(ino);
+	struct stat stbuf;
+	int rc = 0;
+
+	exfat_debug("[%s] %"PRIu64" %#x", __func__, (uint64_t) ino, to_set);
+
+	if (to_set & FUSE_SET_ATTR_MODE)
+		rc = check_mode(attr->st_mode);
+	if (rc == 0 && (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)))
+		rc = check_owner(to_set & FUSE_SET_ATTR_UID ? attr->st_uid : ef.uid,
+				to_set & FUSE_SET_ATTR_GID ? attr->st_gid : ef.gid);
+	if (rc != 0)
+	{
+		fuse_reply_err(req, -rc);
+		return;
+	}
+
+	lock_tree(false);
+	if (to_set & FUSE_SET_ATTR_SIZE)
+	{
+		rc = exfat_truncate(&ef, node, attr->st_size, true);
+		if (rc != 0)
+			exfat_flush_node(&ef, node);	/* ignore return code */
+		else
+			rc = exfat_flush_node(&ef, node);
+	}
+	if (rc == 0 && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)))
+		rc = set_times(node, attr, to_set);
+	get_stat(node, &stbuf);
+	unlock_tree();
+	if (rc != 0)
+		fuse_reply_err(req, -rc);
+	else
+		fuse_reply_attr(req, &stbuf, CACHE_TIMEOUT);
+}
+
+static int add_dir_entry(fuse_req_t req, struct dir_buffer* dir,
+		const char* name, const struct exfat_node* node)
+{
+	struct stat stbuf;
+	size_t size = fuse_add_direntry(req, NULL, 0, name, NULL, 0);
+
+	if (dir->size + size > dir->allocated)
+	{
+		size_t allocated = MAX(dir->allocated * 2, dir->size + size);
+		char* data = realloc(dir->data, allocated);
+
+		if (data == NULL)
+		{
+			exfat_error("failed to allocate directory buffer (%zu bytes)",
+					allocated);
+			return -ENOMEM;
+		}
+		dir->data = data;
+		dir->allocated = allocated;
+	}
+	/* only inode number and file type are used by the kernel */
+	memset(&stbuf, 0, sizeof(struct stat));
+	stbuf.st_ino = get_ino(node);
+	stbuf.st_mode = node->attrib & EXFAT_ATTRIB_DIR ? S_IFDIR : S_IFREG;
+	fuse_add_direntry(req, dir->data + dir->size, size, name, &stbuf,
+			dir->size + size);
+	dir->size += size;
+	return 0;
+}
+
+static int fill_dir_buffer(fuse_req_t req, struct dir_buffer* dir,
+		struct exfat_node* parent)
+{
+	struct exfat_node* node;
+	struct exfat_iterator it;
+	char name[EXFAT_UTF8_NAME_BUFFER_MAX];
+	int rc;
+
+	dir->size = 0;
+	rc = add_dir_entry(req, dir, ".", parent);
+	if (rc != 0)
+		return rc;
+	rc = add_dir_entry(req, dir, "..",
+			parent->parent ? parent->parent : parent);
+	if (rc != 0)
+		return rc;
+
+	rc = exfat_opendir(&ef, parent, &it);
+	if (rc != 0)
+		return rc;
+	while ((node = exfat_readdir(&it)))
+	{
+		exfat_get_name(node, name);
+		exfat_debug("[%s] %s: %s, %"PRId64" bytes, cluster 0x%x", __func__,
+				name, node->is_contiguous ? "contiguous" : "fragmented",
+				node->size, node->start_cluster);
+		rc = add_dir_entry(req, dir, name, node);
+		exfat_put_node(&ef, node);
+		if (rc != 0)
+			break;
+	}
+	exfat_closedir(&ef, &it);
+	return rc;
+}
+
+static void fuse_exfat_opendir(fuse_req_t req, fuse_ino_t ino,
+		struct fuse_file_info* fi)
+{
+	struct exfat_node* node = get_node(ino);
+	struct dir_buffer* dir;
+
+	exfat_debug("[%s] %"PRIu64, __func__, (uint64_t) ino);
+
+	if (!(node->attrib & EXFAT_ATTRIB_DIR))
+	{
+		fuse_reply_err(req, ENOTDIR);
+		return;
+	}
+	dir = calloc(1, sizeof(struct dir_buffer));
+	if (dir == NULL)
+	{
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	fi->fh = (uint64_t) (size_t) dir;
+	if (fuse_reply_open(req, fi) == -ENOENT)
+		free(dir);
+}
+
+static void fuse_exfat_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+		off_t offset, struct fuse_file_info* fi)
+{
+	struct dir_buffer* dir = (struct dir_buffer*) (size_t) fi->fh;
+	int rc;
+
+	exfat_debug("[%s] %"PRIu64" at %"PRId64, __func__, (uint64_t) ino,
+			(int64_t) offset);
+
+	if (offset == 0)
+	{
+		lock_tree(false);
+		rc = fill_dir_buffer(req, dir, get_node(ino));
+		unlock_tree();
+		if (rc != 0)
+		{
+			fuse_reply_err(req, -rc);
+			return;
+		}
+	}
+	if ((size_t) offset < dir->size)
+		fuse_reply_buf(req, dir->data + offset,
+				MIN(dir->size - offset, size));
+	else
+		fuse_reply_buf(req, NULL, 0);
+}
+
+static void fuse_exfat_releasedir(fuse_req_t req, fuse_ino_t ino,
+		struct fuse_file_info* fi)
+{
+	struct dir_buffer* dir = (struct dir_buffer*) (size_t) fi->fh;
+
+	exfat_debug("[%s] %"PRIu64, __func__, (uint64_t) ino);
+
+	free(dir->data);
+	free(dir);
+	fuse_reply_err(req, 0);
+}
+
+static void fuse_exfat_open(fuse_req_t req, fuse_ino_t ino,
+		struct fuse_file_info* fi)
+{
+	struct exfat_node* node = get_node(ino);
+	int rc;
+
+	exfat_debug("[%s] %"PRIu64" flags %#x", __func__, (uint64_t) ino,
+			fi->flags);
+
+	lock_tree(false);
+	if (fi->flags & O_TRUNC)
+	{
+		rc = exfat_truncate(&ef, node, 0, true);
+		if (rc != 0)
+		{
+			unlock_tree();
+			fuse_reply_err(req, -rc);
+			return;
+		}
+	}
+	/* open file holds its own reference, see fuse_exfat_release() */
+	exfat_get_node(node);
+	exfat_open_node(node);
+	unlock_tree();
+	set_file_node(fi, node);
+	if (fuse_reply_open(req, fi) == -ENOENT)
+	{
+		exfat_close_node(&ef, node);
+		release_node(node, 1);
+	}
+}
+
+static void fuse_exfat_create(fuse_req_t req, fuse_ino_t parent,
+		const char* name, UNUSED mode_t mode, struct fuse_file_info* fi)
+{
+	struct exfat_node* node;
+	struct fuse_entry_param e;
+	int rc;
+
+	exfat_debug("[%s] %"PRIu64" %s 0%ho", __func__, (uint64_t) parent, name,
+			mode);
+
+	lock_tree(true);
+	rc = exfat_mknodat(&ef, get_node(parent), name, &node);
+	if (rc != 0)
+	{
+		unlock_tree();
+		fuse_reply_err(req, -rc);
+		return;
+	}
+	/* one reference is for the kernel, another one for the open file */
+	exfat_get_node(node);
+	exfat_open_node(node);
+	get_entry(node, &e);
+	unlock_tree();
+	set_file_node(fi, node);
+	if (fuse_reply_create(req, &e, fi) == -ENOENT)
+	{
+		exfat_close_node(&ef, node);
+		release_node(node, 2);
+	}
+}
+
+static void fuse_exfat_release(fuse_req_t req, fuse_ino_t ino,
+		struct fuse_file_info* fi)
+{
+	struct exfat_node* node = get_file_node(fi);
+
+	/* see fuse_exfat_release() in the high-level frontend */
+	exfat_debug("[%s] %"PRIu64, __func__, (uint64_t) ino);
+
+	lock_tree(false);
+	exfat_flush_node(&ef, node);
+	exfat_close_node(&ef, node);
+	unlock_tree();
+	release_node(node, 1);
+	fuse_reply_err(req, 0);
+}
+
+static void fuse_exfat_flush(fuse_req_t req, fuse_ino_t ino,
+		struct fuse_file_info* fi)
+{
+	int rc;
+
+	exfat_debug("[%s] %"PRIu64, __func__, (uint64_t) ino);
+
+	lock_tree(false);
+	rc = exfat_flush_node(&ef, get_file_node(fi));
+	unlock_tree();
+	fuse_reply_err(req, -rc);
+}
+
+static void fuse_exfat_fsync(fuse_req_t req, fuse_ino_t ino,
+		UNUSED int datasync, UNUSED struct fuse_file_info* fi)
+{
+	int rc;
+
+	exfat_debug("[%s] %"PRIu64, __func__, (uint64_t) ino);
+
+	lock_tree(true);
+	rc = exfat_flush_nodes(&ef);
+	if (rc == 0)
+		rc = exfat_flush(&ef);
+	unlock_tree();
+	if (rc == 0)
+		rc = exfat_fsync(ef.dev);
+	fuse_reply_err(req, -rc);
+}
+
+static void fuse_exfat_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+		off_t offset, struct fuse_file_info* fi)
+{
+	char* buffer;
+	ssize_t rc;
+
+	exfat_debug("[%s] %"PRIu64" (%zu bytes)", __func__, (uint64_t) ino,
+			size);
+
+	buffer = malloc(size);
+	if (buffer == NULL)
+	{
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	lock_tree(false);
+	rc = exfat_generic_pread(&ef, get_file_node(fi), buffer, size, offset);
+	unlock_tree();
+	if (rc < 0)
+		fuse_reply_err(req, -rc);
+	else
+		fuse_reply_buf(req, buffer, rc);
+	free(buffer);
+}
+
+static void fuse_exfat_write(fuse_req_t req, fuse_ino_t ino,
+		const char* buffer, size_t size, off_t offset,
+		struct fuse_file_info* fi)
+{
+	ssize_t rc;
+
+	exfat_debug("[%s] %"PRIu64" (%zu bytes)", __func__, (uint64_t) ino,
+			size);
+
+	lock_tree(false);
+	rc = exfat_generic_pwrite(&ef, get_file_node(fi), buffer, size, offset);
+	unlock_tree();
+	if (rc < 0)
+		fuse_reply_err(req, -rc);
+	else
+		fuse_reply_write(req, rc);
+}
+
+static void fuse_exfat_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
+		off_t offset, off_t length, struct fuse_file_info* fi)
+{
+	int rc;
+
+	exfat_debug("[%s] %"PRIu64" %#x %"PRId64" %"PRId64, __func__,
+			(uint64_t) ino, mode, offset, length);
+
+	lock_tree(false);
+	rc = preallocate(get_file_node(fi), mode, offset, length);
+	unlock_tree();
+	fuse_reply_err(req, -rc);
+}
+
+static int remove_node(struct exfat_node* dir, const char* name,
+		int (*remove)(struct exfat*, struct exfat_node*))
+{
+	struct exfat_node* node;
+	int rc;
+
+	rc = exfat_lookup_name(&ef, dir, &node, name);
+	if (rc != 0)
+		return rc;
+	rc = remove(&ef, node);
+	/* if the kernel still references the node, its clusters are freed on
+	   forget */
+	if (rc != 0)
+	{
+		put_node(node, 1);
+		return rc;
+	}
+	return put_node(node, 1);
+}
+
+static void fuse_exfat_unlink(fuse_req_t req, fuse_ino_t parent,
+		const char* name)
+{
+	int rc;
+
+	exfat_debug("[%s] %"PRIu64" %s", __func__, (uint64_t) parent, name);
+
+	lock_tree(true);
+	rc = remove_node(get_node(parent), name, exfat_unlink);
+	unlock_tree();
+	fuse_reply_err(req, -rc);
+}
+
+static void fuse_exfat_rmdir(fuse_req_t req, fuse_ino_t parent,
+		const char* name)
+{
+	int rc;
+
+	exfat_debug("[%s] %"PRIu64" %s", __func__, (uint64_t) parent, name);
+
+	lock_tree(true);
+	rc = remove_node(get_node(parent), name, exfat_rmdir);
+	unlock_tree();
+	fuse_reply_err(req, -rc);
+}
+
+static void fuse_exfat_mknod(fuse_req_t req, fuse_ino_t parent,
+		const char* name, UNUSED mode_t mode, UNUSED dev_t dev)
+{
+	struct exfat_node* node;
+	int rc;
+
+	exfat_debug("[%s] %"PRIu64" %s 0%ho", __func__, (uint64_t) parent, name,
+			mode);
+
+	lock_tree(true);
+	rc = exfat_mknodat(&ef, get_node(parent), name, &node);
+	unlock_tree();
+	if (rc != 0)
+		fuse_reply_err(req, -rc);
+	else
+		reply_entry(req, node);
+}
+
+static void fuse_exfat_mkdir(fuse_req_t req, fuse_ino_t parent,
+		const char* name, UNUSED mode_t mode)
+{
+	struct exfat_node* node;
+	int rc;
+
+	exfat_debug("[%s] %"PRIu64" %s 0%ho", __func__, (uint64_t) parent, name,
+			mode);
+
+	lock_tree(true);
+	rc = exfat_mkdirat(&ef, get_node(parent), name, &node);
+	unlock_tree();
+	if (rc != 0)
+		fuse_reply_err(req, -rc);
+	else
+		reply_entry(req, node);
+}
+
+static void fuse_exfat_rename(fuse_req_t req, fuse_ino_t parent,
+		const char* name, fuse_ino_t new_parent, const char* new_name,
+		unsigned int flags)
+{
+	struct exfat_node* node;
+	int rc;
+
+	exfat_debug("[%s] %"PRIu64" %s => %"PRIu64" %s", __func__,
+			(uint64_t) parent, name, (uint64_t) new_parent, new_name);
+
+	/* neither RENAME_EXCHANGE nor RENAME_NOREPLACE is supported */
+	if (flags != 0)
+	{
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+
+	lock_tree(true);
+	rc = exfat_lookup_name(&ef, get_node(parent), &node, name);
+	if (rc == 0)
+	{
+		rc = exfat_renameat(&ef, node, get_node(new_parent), new_name);
+		exfat_put_node(&ef, node);
+	}
+	unlock_tree();
+	fuse_reply_err(req, -rc);
+}
+
+static void fuse_exfat_statfs(fuse_req_t req, UNUSED fuse_ino_t ino)
+{
+	struct statvfs sfs;
+
+	exfat_debug("[%s]", __func__);
+
+	memset(&sfs, 0, sizeof(struct statvfs));
+	get_statfs(&sfs);
+	fuse_reply_statfs(req, &sfs);
+}
+
+static void fuse_exfat_init(UNUSED void* userdata,
+		UNUSED struct fuse_conn_info* conn)
+{
+	exfat_debug("[%s]", __func__);
+
+	/* mark super block as dirty; failure isn't a big deal */
+	exfat_soil_super_block(&ef);
+}
+
+/*
+   The kernel does not send forget requests on unmount. Drop references it
+   still holds so that libexfat does not complain about them.
+*/
+static void forget_all(struct exfat_node* dir)
+{
+	struct exfat_node* node;
+
+	for (node = dir->child; node; node = node->next)
+	{
+		forget_all(node);
+		while (node->references)
+			exfat_put_node(&ef, node);
+	}
+}
+
+static void fuse_exfat_destroy(UNUSED void* userdata)
+{
+	exfat_debug("[%s]", __func__);
+	exfat_debug("[%s] FAT cache: %"PRIu64" hits, %"PRIu64" misses", __func__,
+			ef.fat.hits, ef.fat.misses);
+	exfat_debug("[%s] blocks cache: %"PRIu64" hits, %"PRIu64" misses",
+			__func__, ef.blocks.hits, ef.blocks.misses);
+	exfat_debug("[%s] dentry cache: %"PRIu64" hits, %"PRIu64" misses",
+			__func__, ef.dentries.hits, ef.dentries.misses);
+	exfat_debug("[%s] nodes: %u in use, %u directories cached, "
+			"%"PRIu64" evicted", __func__, ef.nodes.count,
+			ef.nodes.directories, ef.nodes.evictions);
+	forget_all(ef.root);
+	exfat_unmount(&ef);
+}
+
+static const struct fuse_lowlevel_ops fuse_exfat_ops =
+{
+	.init			= fuse_exfat_init,
+	.destroy		= fuse_exfat_destroy,
+	.lookup			= fuse_exfat_lookup,
+	.forget			= fuse_exfat_forget,
+	.forget_multi	= fuse_exfat_forget_multi,
+	.getattr		= fuse_exfat_getattr,
+	.setattr		= fuse_exfat_setattr,
+	.mknod			= fuse_exfat_mknod,
+	.mkdir			= fuse_exfat_mkdir,
+	.unlink			= fuse_exfat_unlink,
+	.rmdir			= fuse_exfat_rmdir,
+	.rename			= fuse_exfat_rename,
+	.open			= fuse_exfat_open,
+	.read			= fuse_exfat_read,
+	.write			= fuse_exfat_write,
+	.fallocate		= fuse_exfat_fallocate,
+	.flush			= fuse_exfat_flush,
+	.release		= fuse_exfat_release,
+	.fsync			= fuse_exfat_fsync,
+	.opendir		= fuse_exfat_opendir,
+	.readdir		= fuse_exfat_readdir,
+	.releasedir		= fuse_exfat_releasedir,
+	.fsyncdir		= fuse_exfat_fsync,
+	.statfs			= fuse_exfat_statfs,
+	.create			= fuse_exfat_create,
+};
+
+int fuse_exfat_main(char* mount_options, char* mount_point, bool multithread)
+{
+	char* argv[] = {"exfat", "-o", mount_options, mount_point, NULL};
+	struct fuse_args args =
+			FUSE_ARGS_INIT(sizeof(argv) / sizeof(argv[0]) - 1, argv);
+	struct fuse_cmdline_opts opts;
+	struct fuse_session* se;
+	int rc = 1;
+
+	if (fuse_parse_cmdline(&args, &opts) != 0)
+		return 1;
+
+	se = fuse_session_new(&args, &fuse_exfat_ops, sizeof(fuse_exfat_ops),
+			NULL);
+	if (se == NULL)
+		goto free_opts;
+	if (fuse_set_signal_handlers(se) != 0)
+		goto destroy_session;
+	if (fuse_session_mount(se, opts.mountpoint) != 0)
+		goto remove_handlers;
+
+	fuse_daemonize(opts.foreground);
+	if (multithread)
+		rc = fuse_session_loop_mt(se, 0);
+	else
+		rc = fuse_session_loop(se);
+	fuse_session_unmount(se);
+
+remove_handlers:
+	fuse_remove_signal_handlers(se);
+destroy_session:
+	fuse_session_destroy(se);
+free_opts:
+	free(opts.mountpoint);
+	fuse_opt_free_args(&args);
+	return rc == 0 ? 0 : 1;
+}
@@ -20,10 +20,8 @@
 	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 */
 
-#include <exfat.h>
-#include <fuse.h>
+#include "frontend.h"
 #include <errno.h>
-#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -32,352 +30,51 @@
 #include <sys/types.h>
 #include <pwd.h>
 #include <unistd.h>
-
-#ifndef DEBUG
-	#define exfat_debug(format, ...) do {} while (0)
-#endif
-
-#if !defined(FUSE_VERSION) || (FUSE_VERSION < 26)
-	#error FUSE 2.6 or later is required
-#endif
+#include <pthread.h>
 
 struct exfat ef;
 
-static struct exfat_node* get_node(const struct fuse_file_info* fi)
-{
-	return (struct exfat_node*) (size_t) fi->fh;
-}
-
-static void set_node(struct fuse_file_info* fi, struct exfat_node* node)
-{
-	fi->fh = (uint64_t) (size_t) node;
-	fi->keep_cache = 1;
-}
-
-static int fuse_exfat_getattr(const char* path, struct stat* stbuf
-#if FUSE_USE_VERSION >= 30
-		, UNUSED struct fuse_file_info* fi
-#endif
-		)
-{
-	struct exfat_node* node;
-	int rc;
-
-	exfat_debug("[%s] %s", __func__, path);
-
-	rc = exfat_lookup(&ef, &node, path);
-	if (rc != 0)
-		return rc;
-
-	exfat_stat(&ef, node, stbuf);
-	exfat_put_node(&ef, node);
-	return 0;
-}
-
-static int fuse_exfat_truncate(const char* path, off_t size
-#if FUSE_USE_VERSION >= 30
-		, UNUSED struct fuse_file_info* fi
-#endif
-		)
-{
-	struct exfat_node* node;
-	int rc;
+static pthread_rwlock_t tree_lock = PTHREAD_RWLOCK_INITIALIZER;
 
-	exfat_debug("[%s] %s, %"PRId64, __func__, path, size);
-
-	rc = exfat_lookup(&ef, &node, path);
-	if (rc != 0)
-		return rc;
-
-	rc = exfat_truncate(&ef, node, size, true);
-	if (rc != 0)
-	{
-		exfat_flush_node(&ef, node);	/* ignore return code */
-		exfat_put_node(&ef, node);
-		return rc;
-	}
-	rc = exfat_flush_node(&ef, node);
-	exfat_put_node(&ef, node);
-	return rc;
-}
-
-static int fuse_exfat_readdir(const char* path, void* buffer,
-		fuse_fill_dir_t filler, UNUSED off_t offset,
-		UNUSED struct fuse_file_info* fi
-#if FUSE_USE_VERSION >= 30
-		, UNUSED enum fuse_readdir_flags flags
-#endif
-		)
+void lock_tree(bool exclusive)
 {
-	struct exfat_node* parent;
-	struct exfat_node* node;
-	struct exfat_iterator it;
-	int rc;
-	char name[EXFAT_UTF8_NAME_BUFFER_MAX];
-	struct stat stbuf;
-
-	exfat_debug("[%s] %s", __func__, path);
-
-	rc = exfat_lookup(&ef, &parent, path);
-	if (rc != 0)
-		return rc;
-	if (!(parent->attrib & EXFAT_ATTRIB_DIR))
-	{
-		exfat_put_node(&ef, parent);
-		exfat_error("'%s' is not a directory (%#hx)", path, parent->attrib);
-		return -ENOTDIR;
-	}
-
-#if FUSE_USE_VERSION < 30
-	filler(buffer, ".", NULL, 0);
-	filler(buffer, "..", NULL, 0);
-#else
-	filler(buffer, ".", NULL, 0, 0);
-	filler(buffer, "..", NULL, 0, 0);
-#endif
-
-	rc = exfat_opendir(&ef, parent, &it);
-	if (rc != 0)
-	{
-		exfat_put_node(&ef, parent);
-		exfat_error("failed to open directory '%s'", path);
-		return rc;
-	}
-	while ((node = exfat_readdir(&it)))
-	{
-		exfat_get_name(node, name);
-		exfat_debug("[%s] %s: %s, %"PRId64" bytes, cluster 0x%x", __func__,
-				name, node->is_contiguous ? "contiguous" : "fragmented",
-				node->size, node->start_cluster);
-		exfat_stat(&ef, node, &stbuf);
-#if FUSE_USE_VERSION < 30
-		filler(buffer, name, &stbuf, 0);
-#else
-		filler(buffer, name, &stbuf, 0, 0);
-#endif
-		exfat_put_node(&ef, node);
-	}
-	exfat_closedir(&ef, &it);
-	exfat_put_node(&ef, parent);
-	return 0;
+	if (exclusive)
+		pthread_rwlock_wrlock(&tree_lock);
+	else
+		pthread_rwlock_rdlock(&tree_lock);
 }
 
-static int fuse_exfat_open(const char* path, struct fuse_file_info* fi)
+void unlock_tree(void)
 {
-	struct exfat_node* node;
-	int rc;
-
-	exfat_debug("[%s] %s flags %#x%s%s%s%s%s", __func__, path, fi->flags,
-			fi->flags & O_RDONLY ? " O_RDONLY" : "",
-			fi->flags & O_WRONLY ? " O_WRONLY" : "",
-			fi->flags & O_RDWR   ? " O_RDWR"   : "",
-			fi->flags & O_APPEND ? " O_APPEND" : "",
-			fi->flags & O_TRUNC  ? " O_TRUNC"  : "");
-
-	rc = exfat_lookup(&ef, &node, path);
-	if (rc != 0)
-		return rc;
-	/* FUSE 2.x will call fuse_exfat_truncate() explicitly */
-#if FUSE_USE_VERSION >= 30
-	if (fi->flags & O_TRUNC)
+	pthread_rwlock_unlock(&tree_lock);
+	/* keep the memory taken by nodes within the limit */
+	if (exfat_need_eviction(&ef))
 	{
-		rc = exfat_truncate(&ef, node, 0, true);
-		if (rc != 0)
-		{
-			exfat_put_node(&ef, node);
-			return rc;
-		}
+		pthread_rwlock_wrlock(&tree_lock);
+		exfat_evict_nodes(&ef);
+		pthread_rwlock_unlock(&tree_lock);
 	}
-#endif
-	set_node(fi, node);
-	return 0;
-}
-
-static int fuse_exfat_create(const char* path, UNUSED mode_t mode,
-		struct fuse_file_info* fi)
-{
-	struct exfat_node* node;
-	int rc;
-
-	exfat_debug("[%s] %s 0%ho", __func__, path, mode);
-
-	rc = exfat_mknod(&ef, path);
-	if (rc != 0)
-		return rc;
-	rc = exfat_lookup(&ef, &node, path);
-	if (rc != 0)
-		return rc;
-	set_node(fi, node);
-	return 0;
-}
-
-static int fuse_exfat_release(UNUSED const char* path,
-		struct fuse_file_info* fi)
-{
-	/*
-	   This handler is called by FUSE on close() syscall. If the FUSE
-	   implementation does not call flush handler, we will flush node here.
-	   But in this case we will not be able to return an error to the caller.
-	   See fuse_exfat_flush() below.
-	*/
-	exfat_debug("[%s] %s", __func__, path);
- 	exfat_flush_node(&ef, get_node(fi));
-	exfat_put_node(&ef, get_node(fi));
-	return 0; /* FUSE ignores this return value */
-}
-
-static int fuse_exfat_flush(UNUSED const char* path, struct fuse_file_info* fi)
-{
-	/*
-	   This handler may be called by FUSE on close() syscall. FUSE also deals
-	   with removals of open files, so we don't free clusters on close but
-	   only on rmdir and unlink. If the FUSE implementation does not call this
-	   handler we will flush node on release. See fuse_exfat_release() above.
-	*/
-	exfat_debug("[%s] %s", __func__, path);
-	return exfat_flush_node(&ef, get_node(fi));
-}
-
-static int fuse_exfat_fsync(UNUSED const char* path, UNUSED int datasync,
-		UNUSED struct fuse_file_info* fi)
-{
-	int rc;
-
-	exfat_debug("[%s] %s", __func__, path);
-	rc = exfat_flush_nodes(&ef);
-	if (rc != 0)
-		return rc;
-	rc = exfat_flush(&ef);
-	if (rc != 0)
-		return rc;
-	return exfat_fsync(ef.dev);
-}
-
-static int fuse_exfat_read(UNUSED const char* path, char* buffer,
-		size_t size, off_t offset, struct fuse_file_info* fi)
-{
-	exfat_debug("[%s] %s (%zu bytes)", __func__, path, size);
-	return exfat_generic_pread(&ef, get_node(fi), buffer, size, offset);
-}
-
-static int fuse_exfat_write(UNUSED const char* path, const char* buffer,
-		size_t size, off_t offset, struct fuse_file_info* fi)
-{
-	exfat_debug("[%s] %s (%zu bytes)", __func__, path, size);
-	return exfat_generic_pwrite(&ef, get_node(fi), buffer, size, offset);
-}
-
-static int fuse_exfat_unlink(const char* path)
-{
-	struct exfat_node* node;
-	int rc;
-
-	exfat_debug("[%s] %s", __func__, path);
-
-	rc = exfat_lookup(&ef, &node, path);
-	if (rc != 0)
-		return rc;
-
-	rc = exfat_unlink(&ef, node);
-	exfat_put_node(&ef, node);
-	if (rc != 0)
-		return rc;
-	return exfat_cleanup_node(&ef, node);
 }
 
-static int fuse_exfat_rmdir(const char* path)
-{
-	struct exfat_node* node;
-	int rc;
-
-	exfat_debug("[%s] %s", __func__, path);
-
-	rc = exfat_lookup(&ef, &node, path);
-	if (rc != 0)
-		return rc;
-
-	rc = exfat_rmdir(&ef, node);
-	exfat_put_node(&ef, node);
-	if (rc != 0)
-		return rc;
-	return exfat_cleanup_node(&ef, node);
-}
-
-static int fuse_exfat_mknod(const char* path, UNUSED mode_t mode,
-		UNUSED dev_t dev)
-{
-	exfat_debug("[%s] %s 0%ho", __func__, path, mode);
-	return exfat_mknod(&ef, path);
-}
-
-static int fuse_exfat_mkdir(const char* path, UNUSED mode_t mode)
-{
-	exfat_debug("[%s] %s 0%ho", __func__, path, mode);
-	return exfat_mkdir(&ef, path);
-}
-
-static int fuse_exfat_rename(const char* old_path, const char* new_path
-#if FUSE_USE_VERSION >= 30
-		, UNUSED unsigned int flags
-#endif
-		)
-{
-	exfat_debug("[%s] %s => %s", __func__, old_path, new_path);
-	return exfat_rename(&ef, old_path, new_path);
-}
-
-static int fuse_exfat_utimens(const char* path, const struct timespec tv[2]
-#if FUSE_USE_VERSION >= 30
-		, UNUSED struct fuse_file_info* fi
-#endif
-		)
-{
-	struct exfat_node* node;
-	int rc;
-
-	exfat_debug("[%s] %s", __func__, path);
-
-	rc = exfat_lookup(&ef, &node, path);
-	if (rc != 0)
-		return rc;
-
-	exfat_utimes(node, tv);
-	rc = exfat_flush_node(&ef, node);
-	exfat_put_node(&ef, node);
-	return rc;
-}
-
-static int fuse_exfat_chmod(UNUSED const char* path, mode_t mode
-#if FUSE_USE_VERSION >= 30
-		, UNUSED struct fuse_file_info* fi
-#endif
-		)
+int check_mode(mode_t mode)
 {
 	const mode_t VALID_MODE_MASK = S_IFREG | S_IFDIR |
 			S_IRWXU | S_IRWXG | S_IRWXO;
 
-	exfat_debug("[%s] %s 0%ho", __func__, path, mode);
 	if (mode & ~VALID_MODE_MASK)
 		return -EPERM;
 	return 0;
 }
 
-static int fuse_exfat_chown(UNUSED const char* path, uid_t uid, gid_t gid
-#if FUSE_USE_VERSION >= 30
-		, UNUSED struct fuse_file_info* fi
-#endif
-		)
+int check_owner(uid_t uid, gid_t gid)
 {
-	exfat_debug("[%s] %s %u:%u", __func__, path, uid, gid);
 	if (uid != ef.uid || gid != ef.gid)
 		return -EPERM;
 	return 0;
 }
 
-static int fuse_exfat_statfs(UNUSED const char* path, struct statvfs* sfs)
+void get_statfs(struct statvfs* sfs)
 {
-	exfat_debug("[%s]", __func__);
-
 	sfs->f_bsize = CLUSTER_SIZE(*ef.sb);
 	sfs->f_frsize = CLUSTER_SIZE(*ef.sb);
 	sfs->f_blocks = le64_to_cpu(ef.sb->sector_count) >> ef.sb->spc_bits;
@@ -394,36 +91,28 @@ static int fuse_exfat_statfs(UNUSED const char* path, struct statvfs* sfs)
 	sfs->f_files = le32_to_cpu(ef.sb->cluster_count);
 	sfs->f_favail = sfs->f_bfree >> ef.sb->spc_bits;
 	sfs->f_ffree = sfs->f_bavail;
-
-	return 0;
 }
 
-static void* fuse_exfat_init(
-#ifdef FUSE_CAP_BIG_WRITES
-		struct fuse_conn_info* fci
-#else
-		UNUSED struct fuse_conn_info* fci
-#endif
-#if FUSE_USE_VERSION >= 30
-		, UNUSED struct fuse_config* cfg
-#endif
-		)
+int preallocate(struct exfat_node* node, int mode, off_t offset,
+		off_t length)
 {
-	exfat_debug("[%s]", __func__);
-#ifdef FUSE_CAP_BIG_WRITES
-	fci->want |= FUSE_CAP_BIG_WRITES;
-#endif
+	int rc;
 
-	/* mark super block as dirty; failure isn't a big deal */
-	exfat_soil_super_block(&ef);
+	if (offset < 0 || length <= 0)
+		return -EINVAL;
+	if (length > INT64_MAX - offset)
+		return -EFBIG;
+	if (mode & ~FALLOC_FL_KEEP_SIZE)
+		return -EOPNOTSUPP;
 
-	return NULL;
-}
-
-static void fuse_exfat_destroy(UNUSED void* unused)
-{
-	exfat_debug("[%s]", __func__);
-	exfat_unmount(&ef);
+	rc = exfat_preallocate(&ef, node, offset + length,
+			mode & FALLOC_FL_KEEP_SIZE);
+	if (rc != 0)
+	{
+		exfat_flush_node(&ef, node);	/* ignore return code */
+		return rc;
+	}
+	return exfat_flush_node(&ef, node);
 }
 
 static void usage(const char* prog)
@@ -432,32 +121,6 @@ static void usage(const char* prog)
 	exit(1);
 }
 
-static struct fuse_operations fuse_exfat_ops =
-{
-	.getattr	= fuse_exfat_getattr,
-	.truncate	= fuse_exfat_truncate,
-	.readdir	= fuse_exfat_readdir,
-	.open		= fuse_exfat_open,
-	.create		= fuse_exfat_create,
-	.release	= fuse_exfat_release,
-	.flush		= fuse_exfat_flush,
-	.fsync		= fuse_exfat_fsync,
-	.fsyncdir	= fuse_exfat_fsync,
-	.read		= fuse_exfat_read,
-	.write		= fuse_exfat_write,
-	.unlink		= fuse_exfat_unlink,
-	.rmdir		= fuse_exfat_rmdir,
-	.mknod		= fuse_exfat_mknod,
-	.mkdir		= fuse_exfat_mkdir,
-	.rename		= fuse_exfat_rename,
-	.utimens	= fuse_exfat_utimens,
-	.chmod		= fuse_exfat_chmod,
-	.chown		= fuse_exfat_chown,
-	.statfs		= fuse_exfat_statfs,
-	.init		= fuse_exfat_init,
-	.destroy	= fuse_exfat_destroy,
-};
-
 static char* add_option(char* options, const char* name, const char* value)
 {
 	size_t size;
@@ -596,19 +259,13 @@ static char* add_passthrough_fuse_options(char* fuse_options,
 	return fuse_options;
 }
 
-static int fuse_exfat_main(char* mount_options, char* mount_point)
-{
-	char* argv[] = {"exfat", "-s", "-o", mount_options, mount_point, NULL};
-	return fuse_main(sizeof(argv) / sizeof(argv[0]) - 1, argv,
-			&fuse_exfat_ops, NULL);
-}
-
 int main(int argc, char* argv[])
 {
 	const char* spec = NULL;
 	char* mount_point = NULL;
 	char* fuse_options;
 	char* exfat_options;
+	bool multithread;
 	int opt;
 	int rc;
 
@@ -689,6 +346,7 @@ int main(int argc, char* argv[])
 		return 1;
 	}
 
+	multithread = exfat_match_option(exfat_options, "multithread");
 	free(exfat_options);
 
 	fuse_options = add_fuse_options(fuse_options, spec, ef.ro != 0);
@@ -699,7 +357,7 @@ int main(int argc, char* argv[])
 	}
 
 	/* let FUSE do all its wizardry */
-	rc = fuse_exfat_main(fuse_options, mount_point);
+	rc = fuse_exfat_main(fuse_options, mount_point, multithread);
 
 	free(fuse_options);
 	return rc;
@@ -0,0 +1,73 @@
+/*
+	bitmap.c (16.10.26)
+	exFAT file system implementation library.
+
+	Free exFAT implementation.
+	Copyright (C) 2010-2023  Andrew Nayenko
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "exfat.h"
+
+#define BMAP_BITS (sizeof(bitmap_t) * 8)
+
+/*
+   Returns the index of the first bit in [start, end) that differs from the
+   bits set in "skip" (all zeros or all ones), or end if there is none.
+*/
+static size_t find_bit(const bitmap_t* bitmap, size_t start, size_t end,
+		bitmap_t skip)
+{
+	size_t i = BMAP_BLOCK(start);
+	bitmap_t word;
+
+	if (start >= end)
+		return end;
+	/* ignore bits below start in the first word */
+	word = (bitmap[i] ^ skip) & ~(BMAP_MASK(start) - 1);
+	for (;;)
+	{
+		if (word != 0)
+			return MIN(i * BMAP_BITS + CTZ(word), end);
+		if (++i * BMAP_BITS >= end)
+			return end;
+		word = bitmap[i] ^ skip;
+	}
+}
+
+size_t exfat_bmap_find_zero(const bitmap_t* bitmap, size_t start, size_t end)
+{
+	return find_bit(bitmap, start, end, (bitmap_t) ~((bitmap_t) 0));
+}
+
+size_t exfat_bmap_find_one(const bitmap_t* bitmap, size_t start, size_t end)
+{
+	return find_bit(bitmap, start, end, 0);
+}
+
+size_t exfat_bmap_count(const bitmap_t* bitmap, size_t count)
+{
+	const size_t full = count / BMAP_BITS;
+	size_t ones = 0;
+	size_t i;
+
+	for (i = 0; i < full; i++)
+		ones += POPCOUNT(bitmap[i]);
+	/* bits past count are not necessarily zero */
+	if (count % BMAP_BITS != 0)
+		ones += POPCOUNT(bitmap[full] & (BMAP_MASK(count) - 1));
+	return ones;
+}
@@ -0,0 +1,441 @@
+/*
+	blkcache.c (16.10.26)
+	Write-back cache of directory blocks.
+
+	Free exFAT implementation.
+	Copyright (C) 2010-2023  Andrew Nayenko
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "exfat.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+struct exfat_block
+{
+	off_t offset;					/* on the device, aligned to block size */
+	bool dirty;
+	struct exfat_block* hash_next;
+	struct exfat_block* prev;		/* LRU list, the head is the most */
+	struct exfat_block* next;		/* recently used block */
+	char data[];
+};
+
+/*
+ * Blocks are aligned relative to the clusters heap, so that a block never
+ * crosses a cluster boundary and writing it back cannot touch a neighbouring
+ * cluster that belongs to something else.
+ */
+static off_t block_start(const struct exfat* ef, off_t offset)
+{
+	const off_t heap = exfat_c2o(ef, EXFAT_FIRST_DATA_CLUSTER);
+
+	return heap + (offset - heap) / ef->blocks.block_size *
+			ef->blocks.block_size;
+}
+
+static uint32_t block_hash(const struct exfat* ef, off_t offset)
+{
+	return (offset / ef->blocks.block_size) & (ef->blocks.buckets - 1);
+}
+
+static struct exfat_block* find_block(struct exfat* ef, off_t offset)
+{
+	struct exfat_block* block;
+
+	for (block = ef->blocks.hash[block_hash(ef, offset)]; block != NULL;
+			block = block->hash_next)
+		if (block->offset == offset)
+			return block;
+	return NULL;
+}
+
+static void lru_remove(struct exfat* ef, struct exfat_block* block)
+{
+	if (block->prev)
+		block->prev->next = block->next;
+	else
+		ef->blocks.head = block->next;
+	if (block->next)
+		block->next->prev = block->prev;
+	else
+		ef->blocks.tail = block->prev;
+}
+
+static void lru_insert(struct exfat* ef, struct exfat_block* block)
+{
+	block->prev = NULL;
+	block->next = ef->blocks.head;
+	if (ef->blocks.head)
+		ef->blocks.head->prev = block;
+	else
+		ef->blocks.tail = block;
+	ef->blocks.head = block;
+}
+
+static void touch_block(struct exfat* ef, struct exfat_block* block)
+{
+	if (ef->blocks.head == block)
+		return;
+	lru_remove(ef, block);
+	lru_insert(ef, block);
+}
+
+static void hash_remove(struct exfat* ef, struct exfat_block* block)
+{
+	struct exfat_block** link =
+			&ef->blocks.hash[block_hash(ef, block->offset)];
+
+	while (*link != block)
+		link = &(*link)->hash_next;
+	*link = block->hash_next;
+}
+
+static int write_block(struct exfat* ef, struct exfat_block* block)
+{
+	if (!block->dirty)
+		return 0;
+	if (exfat_pwrite(ef->dev, block->data, ef->blocks.block_size,
+			block->offset) < 0)
+	{
+		exfat_error("failed to write block at %"PRId64, block->offset);
+		return -EIO;
+	}
+	block->dirty = false;
+	ef->blocks.dirty_count--;
+	return 0;
+}
+
+/*
+ * Returns an unused block for the given offset: either a new one or the least
+ * recently used one, which is written back if needed. The block is not filled.
+ */
+static struct exfat_block* get_block(struct exfat* ef, off_t offset)
+{
+	struct exfat_block* block;
+	uint32_t hash;
+
+	if (ef->blocks.count < ef->blocks.max)
+	{
+		block = malloc(sizeof(struct exfat_block) + ef->blocks.block_size);
+		if (block == NULL)
+		{
+			exfat_error("failed to allocate a block");
+			return NULL;
+		}
+		ef->blocks.count++;
+	}
+	else
+	{
+		block = ef->blocks.tail;
+		if (write_block(ef, block) != 0)
+			return NULL;
+		lru_remove(ef, block);
+		hash_remove(ef, block);
+	}
+	block->offset = offset;
+	block->dirty = false;
+	hash = block_hash(ef, offset);
+	block->hash_next = ef->blocks.hash[hash];
+	ef->blocks.hash[hash] = block;
+	lru_insert(ef, block);
+	return block;
+}
+
+static void put_block(struct exfat* ef, struct exfat_block* block)
+{
+	if (block->dirty)
+		ef->blocks.dirty_count--;
+	lru_remove(ef, block);
+	hash_remove(ef, block);
+	free(block);
+	ef->blocks.count--;
+}
+
+/*
+ * Reads the blocks covering [offset, offset + size) into the cache. Missing
+ * blocks are read from the device in one request, cached ones are newer than
+ * the device and win.
+ */
+static int fill_range(struct exfat* ef, off_t offset, size_t size)
+{
+	const size_t block_size = ef->blocks.block_size;
+	const off_t end = block_start(ef, offset + size - 1) + block_size;
+	struct exfat_block* block;
+	off_t first = end;
+	char* data;
+	off_t o;
+
+	/* move cached blocks of the range to the head of the LRU list, so that
+	   filling the gaps does not evict them */
+	for (o = block_start(ef, offset); o < end; o += block_size)
+	{
+		block = find_block(ef, o);
+		if (block != NULL)
+			touch_block(ef, block);
+		else if (first == end)
+			first = o;
+	}
+	if (first == end)
+	{
+		ef->blocks.hits++;
+		return 0;
+	}
+	ef->blocks.misses++;
+
+	data = malloc(end - first);
+	if (data == NULL)
+	{
+		exfat_error("failed to allocate %"PRId64" bytes", end - first);
+		return -ENOMEM;
+	}
+	if (exfat_pread(ef->dev, data, end - first, first) < 0)
+	{
+		free(data);
+		exfat_error("failed to read blocks at %"PRId64, first);
+		return -EIO;
+	}
+	for (o = first; o < end; o += block_size)
+	{
+		if (find_block(ef, o) != NULL)
+			continue;
+		block = get_block(ef, o);
+		if (block == NULL)
+		{
+			free(data);
+			return -EIO;
+		}
+		memcpy(block->data, data + (o - first), block_size);
+	}
+	free(data);
+	return 0;
+}
+
+int exfat_blkcache_read(struct exfat* ef, void* buffer, size_t size,
+		off_t offset)
+{
+	const size_t block_size = ef->blocks.block_size;
+	struct exfat_block* block;
+	char* bufp = buffer;
+	off_t o;
+	int rc = 0;
+
+	if (ef->blocks.max == 0)
+		return exfat_pread(ef->dev, buffer, size, offset) < 0 ? -EIO : 0;
+
+	pthread_mutex_lock(&ef->blocks.lock);
+	while (size > 0)
+	{
+		/* the cache can be smaller than the range, so fill and consume it
+		   piece by piece */
+		size_t chunk = MIN(size, (size_t) ef->blocks.max * block_size -
+				(offset - block_start(ef, offset)));
+
+		rc = fill_range(ef, offset, chunk);
+		if (rc != 0)
+			break;
+		for (o = offset; o < offset + (off_t) chunk; )
+		{
+			const off_t start = block_start(ef, o);
+			const size_t n = MIN(start + block_size - o, offset + chunk - o);
+
+			block = find_block(ef, start);
+			if (block == NULL)
+				exfat_bug("block at %"PRId64" vanished", start);
+			memcpy(bufp, block->data + (o - start), n);
+			touch_block(ef, block);
+			bufp += n;
+			o += n;
+		}
+		offset += chunk;
+		size -= chunk;
+	}
+	pthread_mutex_unlock(&ef->blocks.lock);
+	return rc;
+}
+
+int exfat_blkcache_write(struct exfat* ef, const void* buffer, size_t size,
+		off_t offset)
+{
+	const size_t block_size = ef->blocks.block_size;
+	struct exfat_block* block;
+	const char* bufp = buffer;
+	int rc = 0;
+
+	if (ef->blocks.max == 0)
+		return exfat_pwrite(ef->dev, buffer, size, offset) < 0 ? -EIO : 0;
+
+	pthread_mutex_lock(&ef->blocks.lock);
+	while (size > 0)
+	{
+		const off_t start = block_start(ef, offset);
+		const size_t n = MIN(start + block_size - offset, size);
+
+		block = find_block(ef, start);
+		if (block == NULL)
+		{
+			block = get_block(ef, start);
+			if (block == NULL)
+			{
+				rc = -EIO;
+				break;
+			}
+			/* a partially overwritten block must be read first */
+			if (n != block_size && exfat_pread(ef->dev, block->data,
+					block_size, start) < 0)
+			{
+				exfat_error("failed to read block at %"PRId64, start);
+				put_block(ef, block);
+				rc = -EIO;
+				break;
+			}
+		}
+		else
+			touch_block(ef, block);
+		memcpy(block->data + (offset - start), bufp, n);
+		if (!block->dirty)
+		{
+			block->dirty = true;
+			ef->blocks.dirty_count++;
+		}
+		bufp += n;
+		offset += n;
+		size -= n;
+	}
+	pthread_mutex_unlock(&ef->blocks.lock);
+	return rc;
+}
+
+void exfat_blkcache_discard(struct exfat* ef, off_t offset, size_t size)
+{
+	const size_t block_size = ef->blocks.block_size;
+	struct exfat_block* block;
+	off_t o;
+
+	if (ef->blocks.max == 0 || size == 0)
+		return;
+
+	pthread_mutex_lock(&ef->blocks.lock);
+	for (o = block_start(ef, offset); o < offset + (off_t) size;
+			o += block_size)
+	{
+		block = find_block(ef, o);
+		if (block != NULL)
+			put_block(ef, block);
+	}
+	pthread_mutex_unlock(&ef->blocks.lock);
+}
+
+static int compare_blocks(const void* a, const void* b)
+{
+	const struct exfat_block* x = *(const struct exfat_block* const*) a;
+	const struct exfat_block* y = *(const struct exfat_block* const*) b;
+
+	return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+int exfat_flush_blkcache(struct exfat* ef)
+{
+	struct exfat_block** dirty;
+	struct exfat_block* block;
+	struct exfat_batch batch;
+	uint32_t count = 0;
+	uint32_t i;
+	int rc = 0;
+
+	pthread_mutex_lock(&ef->blocks.lock);
+	if (ef->blocks.dirty_count == 0)
+	{
+		pthread_mutex_unlock(&ef->blocks.lock);
+		return 0;
+	}
+	dirty = malloc(ef->blocks.dirty_count * sizeof(struct exfat_block*));
+	if (dirty == NULL)
+	{
+		/* write blocks one by one in LRU order */
+		for (block = ef->blocks.head; block != NULL; block = block->next)
+			if (write_block(ef, block) != 0)
+				rc = -EIO;
+		pthread_mutex_unlock(&ef->blocks.lock);
+		return rc;
+	}
+	for (block = ef->blocks.head; block != NULL; block = block->next)
+		if (block->dirty)
+			dirty[count++] = block;
+
+	/* write back in the device order, this way adjacent blocks end up in
+	   adjacent requests */
+	qsort(dirty, count, sizeof(struct exfat_block*), compare_blocks);
+	exfat_batch_init(&batch, ef->dev, true);
+	for (i = 0; i < count; i++)
+		if (exfat_batch_add(&batch, dirty[i]->data, ef->blocks.block_size,
+				dirty[i]->offset) != 0)
+			break;
+	if (i < count || exfat_batch_flush(&batch) != 0)
+	{
+		exfat_error("failed to write back %u blocks", count);
+		rc = -EIO;
+	}
+	else
+	{
+		for (i = 0; i < count; i++)
+			dirty[i]->dirty = false;
+		ef->blocks.dirty_count = 0;
+	}
+	free(dirty);
+	pthread_mutex_unlock(&ef->blocks.lock);
+	return rc;
+}
+
+int exfat_init_blkcache(struct exfat* ef, size_t cache_size)
+{
+	uint32_t buckets = 1;
+
+	ef->blocks.block_size = MIN(EXFAT_BLOCK_SIZE, CLUSTER_SIZE(*ef->sb));
+	ef->blocks.max = cache_size / ef->blocks.block_size;
+	while (buckets < ef->blocks.max)
+		buckets <<= 1;
+	ef->blocks.hash = calloc(buckets, sizeof(struct exfat_block*));
+	if (ef->blocks.hash == NULL)
+	{
+		exfat_error("failed to allocate blocks cache (%u buckets)", buckets);
+		return -ENOMEM;
+	}
+	ef->blocks.buckets = buckets;
+	ef->blocks.head = ef->blocks.tail = NULL;
+	ef->blocks.count = 0;
+	ef->blocks.dirty_count = 0;
+	ef->blocks.hits = 0;
+	ef->blocks.misses = 0;
+	return 0;
+}
+
+void exfat_free_blkcache(struct exfat* ef)
+{
+	struct exfat_block* block;
+
+	while ((block = ef->blocks.head) != NULL)
+	{
+		ef->blocks.head = block->next;
+		free(block);
+	}
+	ef->blocks.tail = NULL;
+	ef->blocks.count = 0;
+	free(ef->blocks.hash);
+	ef->blocks.hash = NULL;
+}
@@ -25,6 +25,18 @@
 #include <string.h>
 #include <inttypes.h>
 
+/* free extents looked at before settling for the longest of them */
+#define EXTENT_PROBES 256
+/* an extent of this many clusters ends the search for a longer one */
+#define EXTENT_ENOUGH 1024
+
+struct exfat_extent
+{
+	uint32_t index;					/* first logical cluster of the run */
+	cluster_t cluster;				/* first physical cluster of the run */
+	uint32_t count;					/* length of the run in clusters */
+};
+
 /*
  * Sector to absolute offset.
  */
@@ -70,119 +82,231 @@ static uint32_t bytes2clusters(const struct exfat* ef, uint64_t bytes)
 	return DIV_ROUND_UP(bytes, cluster_size);
 }
 
-cluster_t exfat_next_cluster(const struct exfat* ef,
+cluster_t exfat_next_cluster(struct exfat* ef,
 		const struct exfat_node* node, cluster_t cluster)
 {
-	le32_t next;
-	off_t fat_offset;
+	cluster_t next;
 
 	if (cluster < EXFAT_FIRST_DATA_CLUSTER)
 		exfat_bug("bad cluster 0x%x", cluster);
 
 	if (node->is_contiguous)
 		return cluster + 1;
-	fat_offset = s2o(ef, le32_to_cpu(ef->sb->fat_sector_start))
-		+ cluster * sizeof(cluster_t);
-	if (exfat_pread(ef->dev, &next, sizeof(next), fat_offset) < 0)
+	if (exfat_read_fat(ef, cluster, &next) != 0)
 		return EXFAT_CLUSTER_BAD; /* the caller should handle this and print
 		                             appropriate error message */
-	return le32_to_cpu(next);
+	return next;
 }
 
-cluster_t exfat_advance_cluster(const struct exfat* ef,
-		struct exfat_node* node, uint32_t count)
+void exfat_free_extents(struct exfat_node* node)
 {
-	uint32_t i;
+	free(node->extents);
+	node->extents = NULL;
+	node->extents_count = 0;
+	node->extents_size = 0;
+}
 
-	if (node->fptr_index > count)
+/*
+ * Index of the first logical cluster that is not covered by extents.
+ */
+static uint32_t extents_end(const struct exfat_node* node)
+{
+	const struct exfat_extent* last;
+
+	if (node->extents_count == 0)
+		return 0;
+	last = &node->extents[node->extents_count - 1];
+	return last->index + last->count;
+}
+
+static bool append_extent(struct exfat_node* node, uint32_t index,
+		cluster_t cluster)
+{
+	struct exfat_extent* extent;
+
+	if (node->extents_count != 0)
 	{
-		node->fptr_index = 0;
-		node->fptr_cluster = node->start_cluster;
+		extent = &node->extents[node->extents_count - 1];
+		if (extent->cluster + extent->count == cluster)
+		{
+			extent->count++;
+			return true;
+		}
 	}
-
-	for (i = node->fptr_index; i < count; i++)
+	if (node->extents_count == node->extents_size)
 	{
-		node->fptr_cluster = exfat_next_cluster(ef, node, node->fptr_cluster);
-		if (CLUSTER_INVALID(*ef->sb, node->fptr_cluster))
-			break; /* the caller should handle this and print appropriate 
-			          error message */
+		uint32_t size = MAX(node->extents_size * 2, 8);
+
+		extent = realloc(node->extents, size * sizeof(struct exfat_extent));
+		if (extent == NULL)
+			return false;
+		node->extents = extent;
+		node->extents_size = size;
 	}
-	node->fptr_index = count;
-	return node->fptr_cluster;
+	extent = &node->extents[node->extents_count++];
+	extent->index = index;
+	extent->cluster = cluster;
+	extent->count = 1;
+	return true;
 }
 
-static cluster_t find_bit_and_set(bitmap_t* bitmap, size_t start, size_t end)
+/*
+ * Walk the whole cluster chain once and remember it as a list of runs.
+ * On invalid cluster or allocation failure the list covers only the
+ * beginning of the chain, the rest is handled by the linear walk.
+ */
+static void build_extents(struct exfat* ef, struct exfat_node* node)
 {
-	const size_t start_index = start / sizeof(bitmap_t) / 8;
-	const size_t end_index = DIV_ROUND_UP(end, sizeof(bitmap_t) * 8);
-	size_t i;
-	size_t start_bitindex;
-	size_t end_bitindex;
-	size_t c;
+	const uint32_t count = bytes2clusters(ef, node->size);
+	cluster_t cluster = node->start_cluster;
+	uint32_t i;
 
-	for (i = start_index; i < end_index; i++)
+	for (i = 0; i < count; i++)
 	{
-		if (bitmap[i] == (bitmap_t) ~((bitmap_t) 0))
-			continue;
-		start_bitindex = MAX(i * sizeof(bitmap_t) * 8, start);
-		end_bitindex = MIN((i + 1) * sizeof(bitmap_t) * 8, end);
-		for (c = start_bitindex; c < end_bitindex; c++)
-			if (BMAP_GET(bitmap, c) == 0)
-			{
-				BMAP_SET(bitmap, c);
-				return c + EXFAT_FIRST_DATA_CLUSTER;
-			}
+		if (CLUSTER_INVALID(*ef->sb, cluster))
+			break;
+		if (!append_extent(node, i, cluster))
+			break;
+		cluster = exfat_next_cluster(ef, node, cluster);
 	}
-	return EXFAT_CLUSTER_END;
 }
 
-static int flush_nodes(struct exfat* ef, struct exfat_node* node)
+static const struct exfat_extent* find_extent(const struct exfat_node* node,
+		uint32_t index)
 {
-	struct exfat_node* p;
+	uint32_t first = 0;
+	uint32_t last = node->extents_count - 1;
 
-	for (p = node->child; p != NULL; p = p->next)
+	/* find the last extent that starts at or before the index */
+	while (first < last)
 	{
-		int rc = flush_nodes(ef, p);
-		if (rc != 0)
-			return rc;
+		uint32_t middle = last - (last - first) / 2;
+
+		if (node->extents[middle].index <= index)
+			first = middle;
+		else
+			last = middle - 1;
 	}
-	return exfat_flush_node(ef, node);
+	return &node->extents[first];
 }
 
-int exfat_flush_nodes(struct exfat* ef)
+/*
+ * Keep extents in sync when a cluster is appended to a node.
+ */
+static void grow_extents(struct exfat_node* node, uint32_t index,
+		cluster_t cluster)
 {
-	return flush_nodes(ef, ef->root);
+	if (node->extents == NULL)
+		return; /* will be built on demand */
+	if (extents_end(node) != index || !append_extent(node, index, cluster))
+		exfat_free_extents(node);
 }
 
-int exfat_flush(struct exfat* ef)
+/*
+ * Keep extents in sync when a node is cropped to the specified number
+ * of clusters.
+ */
+static void shrink_extents(struct exfat_node* node, uint32_t count)
 {
-	if (ef->cmap.dirty)
+	while (node->extents_count != 0)
 	{
-		if (exfat_pwrite(ef->dev, ef->cmap.chunk,
-				BMAP_SIZE(ef->cmap.chunk_size),
-				exfat_c2o(ef, ef->cmap.start_cluster)) < 0)
+		struct exfat_extent* last = &node->extents[node->extents_count - 1];
+
+		if (last->index < count)
 		{
-			exfat_error("failed to write clusters bitmap");
-			return -EIO;
+			last->count = MIN(last->count, count - last->index);
+			break;
 		}
-		ef->cmap.dirty = false;
+		node->extents_count--;
 	}
+	if (node->extents_count == 0)
+		exfat_free_extents(node);
+}
 
-	return 0;
+cluster_t exfat_advance_cluster(struct exfat* ef,
+		struct exfat_node* node, uint32_t count)
+{
+	uint32_t i;
+
+	if (node->is_contiguous)
+	{
+		node->fptr_index = count;
+		node->fptr_cluster = node->start_cluster + count;
+		return node->fptr_cluster;
+	}
+
+	if (node->extents == NULL)
+		build_extents(ef, node);
+	if (count < extents_end(node))
+	{
+		const struct exfat_extent* extent = find_extent(node, count);
+
+		node->fptr_index = count;
+		node->fptr_cluster = extent->cluster + (count - extent->index);
+		return node->fptr_cluster;
+	}
+	if (node->extents_count != 0)
+	{
+		const struct exfat_extent* last =
+				&node->extents[node->extents_count - 1];
+
+		/* continue from the last known cluster */
+		node->fptr_index = last->index + last->count - 1;
+		node->fptr_cluster = last->cluster + last->count - 1;
+	}
+
+	if (node->fptr_index > count)
+	{
+		node->fptr_index = 0;
+		node->fptr_cluster = node->start_cluster;
+	}
+
+	for (i = node->fptr_index; i < count; i++)
+	{
+		node->fptr_cluster = exfat_next_cluster(ef, node, node->fptr_cluster);
+		if (CLUSTER_INVALID(*ef->sb, node->fptr_cluster))
+			break; /* the caller should handle this and print appropriate 
+			          error message */
+	}
+	node->fptr_index = count;
+	return node->fptr_cluster;
 }
 
-static bool set_next_cluster(const struct exfat* ef, bool contiguous,
-		cluster_t current, cluster_t next)
+/*
+ * Writes FAT and clusters bitmap changes. Directory blocks stay cached.
+ */
+int exfat_flush_clusters(struct exfat* ef)
+{
+	int rc;
+
+	rc = exfat_flush_fat(ef);
+	if (rc != 0)
+		return rc;
+
+	pthread_mutex_lock(&ef->cmap.lock);
+	rc = exfat_flush_cmap(ef);
+	pthread_mutex_unlock(&ef->cmap.lock);
+	return rc;
+}
+
+int exfat_flush(struct exfat* ef)
 {
-	off_t fat_offset;
-	le32_t next_le32;
+	int rc;
 
+	rc = exfat_flush_clusters(ef);
+	if (rc != 0)
+		return rc;
+	/* directory entries go last: by this time everything they refer to is
+	   already allocated on the device */
+	return exfat_flush_blkcache(ef);
+}
+
+static bool set_next_cluster(struct exfat* ef, bool contiguous,
+		cluster_t current, cluster_t next)
+{
 	if (contiguous)
 		return true;
-	fat_offset = s2o(ef, le32_to_cpu(ef->sb->fat_sector_start))
-		+ current * sizeof(cluster_t);
-	next_le32 = cpu_to_le32(next);
-	if (exfat_pwrite(ef->dev, &next_le32, sizeof(next_le32), fat_offset) < 0)
+	if (exfat_write_fat(ef, current, next) != 0)
 	{
 		exfat_error("failed to write the next cluster %#x after %#x", next,
 				current);
@@ -191,45 +315,127 @@ static bool set_next_cluster(const struct exfat* ef, bool contiguous,
 	return true;
 }
 
-static cluster_t allocate_cluster(struct exfat* ef, cluster_t hint)
+/*
+   Finds a free extent of up to count clusters within bitmap [start, end).
+   Stops at the first extent of min(count, EXTENT_ENOUGH) clusters or after
+   looking at probes extents, whichever comes first, and returns the longest
+   one found. This bounds the search on a fragmented volume, where looking
+   for the longest extent would mean walking every free run.
+*/
+static size_t find_extent_bits(struct exfat* ef, size_t start,
+		size_t end, uint32_t count, uint32_t* length, int* probes)
 {
-	cluster_t cluster;
+	const uint32_t enough = MIN(count, EXTENT_ENOUGH);
+	size_t best = end;
+	size_t first;
+	size_t last;
 
-	hint -= EXFAT_FIRST_DATA_CLUSTER;
-	if (hint >= ef->cmap.chunk_size)
-		hint = 0;
+	*length = 0;
+	while (start < end && *probes > 0)
+	{
+		first = exfat_cmap_find_zero(ef, start, end);
+		if (first >= end)
+			break;
+		last = exfat_cmap_find_one(ef, first, MIN(end, first + count));
+		(*probes)--;
+		if (last - first > *length)
+		{
+			best = first;
+			*length = last - first;
+			if (*length >= enough)
+				break;
+		}
+		start = last;
+	}
+	return best;
+}
 
-	cluster = find_bit_and_set(ef->cmap.chunk, hint, ef->cmap.chunk_size);
-	if (cluster == EXFAT_CLUSTER_END)
-		cluster = find_bit_and_set(ef->cmap.chunk, 0, hint);
-	if (cluster == EXFAT_CLUSTER_END)
+/*
+   Allocates up to count contiguous clusters and returns the first of them,
+   the number of allocated clusters is stored in length. Free clusters
+   starting at hint are preferred, so that the caller can extend its chain
+   without breaking contiguity. Pass EXFAT_CLUSTER_FREE as hint if there is
+   no chain to extend. Otherwise the search goes forward from hint (i.e.
+   from the end of the previous extent) and wraps around, see
+   find_extent_bits().
+*/
+static cluster_t allocate_extent(struct exfat* ef, cluster_t hint,
+		uint32_t count, uint32_t* length)
+{
+	const size_t end = ef->cmap.size;
+	size_t start = hint - EXFAT_FIRST_DATA_CLUSTER;
+	size_t first;
+	uint32_t wrapped_length;
+	size_t wrapped;
+	int probes = EXTENT_PROBES;
+
+	if (hint < EXFAT_FIRST_DATA_CLUSTER || start >= end)
+		start = 0;
+
+	pthread_mutex_lock(&ef->cmap.lock);
+	if (hint != EXFAT_CLUSTER_FREE && exfat_cmap_get(ef, start) == 0)
 	{
+		first = start;
+		*length = exfat_cmap_find_one(ef, first,
+				MIN(end, first + count)) - first;
+	}
+	else
+	{
+		first = find_extent_bits(ef, start, end, count, length, &probes);
+		if (*length < MIN(count, EXTENT_ENOUGH))
+		{
+			wrapped = find_extent_bits(ef, 0, start, count,
+					&wrapped_length, &probes);
+			if (wrapped_length > *length)
+			{
+				first = wrapped;
+				*length = wrapped_length;
+			}
+		}
+	}
+	if (*length == 0)
+	{
+		pthread_mutex_unlock(&ef->cmap.lock);
 		exfat_error("no free space left");
 		return EXFAT_CLUSTER_END;
 	}
 
-	ef->cmap.dirty = true;
-	return cluster;
+	if (exfat_cmap_set(ef, first, *length) != 0)
+	{
+		pthread_mutex_unlock(&ef->cmap.lock);
+		return EXFAT_CLUSTER_END;
+	}
+	pthread_mutex_unlock(&ef->cmap.lock);
+	return first + EXFAT_FIRST_DATA_CLUSTER;
 }
 
-static void free_cluster(struct exfat* ef, cluster_t cluster)
+static int free_clusters(struct exfat* ef, cluster_t first, uint32_t count)
 {
-	if (cluster - EXFAT_FIRST_DATA_CLUSTER >= ef->cmap.size)
-		exfat_bug("caller must check cluster validity (%#x, %#x)", cluster,
-				ef->cmap.size);
+	uint32_t index = first - EXFAT_FIRST_DATA_CLUSTER;
+	int rc;
+
+	if (index >= ef->cmap.size || count > ef->cmap.size - index)
+		exfat_bug("caller must check cluster validity (%#x+%u, %#x)", first,
+				count, ef->cmap.size);
 
-	BMAP_CLR(ef->cmap.chunk, cluster - EXFAT_FIRST_DATA_CLUSTER);
-	ef->cmap.dirty = true;
+	pthread_mutex_lock(&ef->cmap.lock);
+	rc = exfat_cmap_clear(ef, index, count);
+	pthread_mutex_unlock(&ef->cmap.lock);
+	return rc;
 }
 
-static bool make_noncontiguous(const struct exfat* ef, cluster_t first,
+/*
+ * Chains clusters [first, last] one after another. The entry of the last
+ * cluster is left as is for the caller to set.
+ */
+static bool link_clusters(struct exfat* ef, cluster_t first,
 		cluster_t last)
 {
-	cluster_t c;
-
-	for (c = first; c < last; c++)
-		if (!set_next_cluster(ef, false, c, c + 1))
-			return false;
+	if (exfat_link_fat(ef, first, last - first, last) != 0)
+	{
+		exfat_error("failed to write the chain %#x-%#x", first, last);
+		return false;
+	}
 	return true;
 }
 
@@ -242,6 +448,8 @@ static int grow_file(struct exfat* ef, struct exfat_node* node,
 	cluster_t previous;
 	cluster_t next;
 	uint32_t allocated = 0;
+	uint32_t length;
+	uint32_t i;
 
 	if (difference == 0)
 		exfat_bug("zero clusters count passed");
@@ -261,19 +469,21 @@ static int grow_file(struct exfat* ef, struct exfat_node* node,
 		if (node->fptr_index != 0)
 			exfat_bug("non-zero pointer index (%u)", node->fptr_index);
 		/* file does not have clusters (i.e. is empty), allocate
-		   the first one for it */
-		previous = allocate_cluster(ef, 0);
-		if (CLUSTER_INVALID(*ef->sb, previous))
+		   the first extent for it */
+		next = allocate_extent(ef, EXFAT_CLUSTER_FREE, difference, &length);
+		if (CLUSTER_INVALID(*ef->sb, next))
 			return -ENOSPC;
-		node->fptr_cluster = node->start_cluster = previous;
-		allocated = 1;
-		/* file consists of only one cluster, so it's contiguous */
+		node->fptr_cluster = node->start_cluster = next;
+		allocated = length;
+		previous = next + length - 1;
+		/* file consists of only one extent, so it's contiguous */
 		node->is_contiguous = true;
 	}
 
 	while (allocated < difference)
 	{
-		next = allocate_cluster(ef, previous + 1);
+		next = allocate_extent(ef, previous + 1, difference - allocated,
+				&length);
 		if (CLUSTER_INVALID(*ef->sb, next))
 		{
 			if (allocated != 0)
@@ -284,15 +494,24 @@ static int grow_file(struct exfat* ef, struct exfat_node* node,
 		{
 			/* it's a pity, but we are not able to keep the file contiguous
 			   anymore */
-			if (!make_noncontiguous(ef, node->start_cluster, previous))
+			if (!link_clusters(ef, node->start_cluster, previous))
 				return -EIO;
 			node->is_contiguous = false;
 			node->is_dirty = true;
 		}
 		if (!set_next_cluster(ef, node->is_contiguous, previous, next))
 			return -EIO;
-		previous = next;
-		allocated++;
+		/* the extent is linked in one go, its last cluster is linked to
+		   the next extent or marked as the end of the chain below */
+		if (!node->is_contiguous)
+		{
+			if (!link_clusters(ef, next, next + length - 1))
+				return -EIO;
+			for (i = 0; i < length; i++)
+				grow_extents(node, current + allocated + i, next + i);
+		}
+		previous = next + length - 1;
+		allocated += length;
 	}
 
 	if (!set_next_cluster(ef, node->is_contiguous, previous,
@@ -337,42 +556,56 @@ static int shrink_file(struct exfat* ef, struct exfat_node* node,
 	}
 	node->fptr_index = 0;
 	node->fptr_cluster = node->start_cluster;
+	shrink_extents(node, current - difference);
+	/* the entry must stop referring to the clusters before they are freed on
+	   the device, see flush_node() */
+	node->is_shrunk = true;
 
-	/* free remaining clusters */
-	while (difference--)
+	/* free remaining clusters run by run */
+	while (difference != 0)
 	{
+		cluster_t first = previous;
+		uint32_t count = 0;
+
 		if (CLUSTER_INVALID(*ef->sb, previous))
 		{
 			exfat_error("invalid cluster 0x%x while freeing after shrink",
 					previous);
 			return -EIO;
 		}
+		do
+		{
+			next = exfat_next_cluster(ef, node, previous);
+			count++;
+			difference--;
+			previous = next;
+		}
+		while (difference != 0 && next == first + count &&
+				!CLUSTER_INVALID(*ef->sb, next));
 
-		next = exfat_next_cluster(ef, node, previous);
-		if (!set_next_cluster(ef, node->is_contiguous, previous,
-				EXFAT_CLUSTER_FREE))
+		if (!node->is_contiguous && exfat_clear_fat(ef, first, count) != 0)
+		{
+			exfat_error("failed to free clusters %#x-%#x", first,
+					first + count - 1);
+			return -EIO;
+		}
+		/* the clusters can be reused by a file, whose data must not be
+		   overwritten by stale directory blocks */
+		if (node->attrib & EXFAT_ATTRIB_DIR)
+			exfat_blkcache_discard(ef, exfat_c2o(ef, first),
+					(size_t) count * CLUSTER_SIZE(*ef->sb));
+		if (free_clusters(ef, first, count) != 0)
 			return -EIO;
-		free_cluster(ef, previous);
-		previous = next;
 	}
 	return 0;
 }
 
-static bool erase_raw(struct exfat* ef, size_t size, off_t offset)
-{
-	if (exfat_pwrite(ef->dev, ef->zero_cluster, size, offset) < 0)
-	{
-		exfat_error("failed to erase %zu bytes at %"PRId64, size, offset);
-		return false;
-	}
-	return true;
-}
-
 static int erase_range(struct exfat* ef, struct exfat_node* node,
 		uint64_t begin, uint64_t end)
 {
 	uint64_t cluster_boundary;
 	cluster_t cluster;
+	struct exfat_batch batch;
 
 	if (begin >= end)
 		return 0;
@@ -385,9 +618,13 @@ static int erase_range(struct exfat* ef, struct exfat_node* node,
 		exfat_error("invalid cluster 0x%x while erasing", cluster);
 		return -EIO;
 	}
+	/* all clusters are erased from the same zero-filled buffer, so the
+	   writes are independent and can be submitted together */
+	exfat_batch_init(&batch, ef->dev, true);
 	/* erase from the beginning to the closest cluster boundary */
-	if (!erase_raw(ef, MIN(cluster_boundary, end) - begin,
-			exfat_c2o(ef, cluster) + begin % CLUSTER_SIZE(*ef->sb)))
+	if (exfat_batch_add(&batch, ef->zero_cluster,
+			MIN(cluster_boundary, end) - begin,
+			exfat_c2o(ef, cluster) + begin % CLUSTER_SIZE(*ef->sb)) != 0)
 		return -EIO;
 	/* erase whole clusters */
 	while (cluster_boundary < end)
@@ -396,26 +633,30 @@ static int erase_range(struct exfat* ef, struct exfat_node* node,
 		/* the cluster cannot be invalid because we have just allocated it */
 		if (CLUSTER_INVALID(*ef->sb, cluster))
 			exfat_bug("invalid cluster 0x%x after allocation", cluster);
-		if (!erase_raw(ef, CLUSTER_SIZE(*ef->sb), exfat_c2o(ef, cluster)))
+		if (exfat_batch_add(&batch, ef->zero_cluster, CLUSTER_SIZE(*ef->sb),
+				exfat_c2o(ef, cluster)) != 0)
 			return -EIO;
 		cluster_boundary += CLUSTER_SIZE(*ef->sb);
 	}
+	if (exfat_batch_flush(&batch) != 0)
+		return -EIO;
 	return 0;
 }
 
-int exfat_truncate(struct exfat* ef, struct exfat_node* node, uint64_t size,
-		bool erase)
+static int resize_node(struct exfat* ef, struct exfat_node* node,
+		uint64_t size, bool erase)
 {
 	uint32_t c1 = bytes2clusters(ef, node->size);
 	uint32_t c2 = bytes2clusters(ef, size);
 	int rc = 0;
 
-	if (node->references == 0 && node->parent)
+	if (ATOMIC_ADD(&node->references, 0) == 0 && node->parent)
 		exfat_bug("no references, node changes can be lost");
 
 	if (node->size == size)
 		return 0;
 
+	exfat_invalidate_readahead(node);
 	if (c1 < c2)
 		rc = grow_file(ef, node, c1, c2 - c1);
 	else if (c1 > c2)
@@ -442,43 +683,129 @@ int exfat_truncate(struct exfat* ef, struct exfat_node* node, uint64_t size,
 	return 0;
 }
 
-uint32_t exfat_count_free_clusters(const struct exfat* ef)
+int exfat_truncate(struct exfat* ef, struct exfat_node* node, uint64_t size,
+		bool erase)
+{
+	int rc;
+
+	pthread_mutex_lock(&node->lock);
+	/* growing keeps buffered data intact, it lies below the old size */
+	if (size < node->size)
+	{
+		rc = exfat_flush_writeback(ef, node);
+		if (rc != 0)
+		{
+			pthread_mutex_unlock(&node->lock);
+			return rc;
+		}
+	}
+	rc = resize_node(ef, node, size, erase);
+	pthread_mutex_unlock(&node->lock);
+	return rc;
+}
+
+int exfat_preallocate(struct exfat* ef, struct exfat_node* node,
+		uint64_t size, bool keep_size)
+{
+	int rc = 0;
+
+	pthread_mutex_lock(&node->lock);
+	if (size > node->size)
+	{
+		/* exFAT cannot have clusters allocated past the end of a file */
+		if (keep_size)
+			rc = -EOPNOTSUPP;
+		else
+			/* the new space lies above valid_size and reads as zeros */
+			rc = resize_node(ef, node, size, false);
+	}
+	pthread_mutex_unlock(&node->lock);
+	return rc;
+}
+
+int exfat_extend_valid_size(struct exfat* ef, struct exfat_node* node,
+		uint64_t size)
+{
+	int rc;
+
+	if (size <= node->valid_size)
+		return 0;
+	rc = erase_range(ef, node, node->valid_size, size);
+	if (rc != 0)
+		return rc;
+	node->valid_size = size;
+	node->is_dirty = true;
+	return 0;
+}
+
+/*
+ * Counts free clusters page by page, ignoring the counters.
+ */
+uint32_t exfat_scan_free_clusters(struct exfat* ef)
 {
+	size_t first;
+	size_t last = 0;
 	uint32_t free_clusters = 0;
-	uint32_t i;
 
-	for (i = 0; i < ef->cmap.size; i++)
-		if (BMAP_GET(ef->cmap.chunk, i) == 0)
-			free_clusters++;
+	pthread_mutex_lock(&ef->cmap.lock);
+	while ((first = exfat_cmap_find_zero(ef, last, ef->cmap.size)) <
+			ef->cmap.size)
+	{
+		last = exfat_cmap_find_one(ef, first, ef->cmap.size);
+		free_clusters += last - first;
+	}
+	pthread_mutex_unlock(&ef->cmap.lock);
+	return free_clusters;
+}
+
+/*
+ * Returns 1 if the cluster is marked as used in the bitmap, 0 if it is free
+ * or a negative error code.
+ */
+int exfat_test_cluster(struct exfat* ef, cluster_t cluster)
+{
+	int rc;
+
+	if (cluster - EXFAT_FIRST_DATA_CLUSTER >= ef->cmap.size)
+		exfat_bug("caller must check cluster validity (%#x, %#x)", cluster,
+				ef->cmap.size);
+	pthread_mutex_lock(&ef->cmap.lock);
+	rc = exfat_cmap_get(ef, cluster - EXFAT_FIRST_DATA_CLUSTER);
+	pthread_mutex_unlock(&ef->cmap.lock);
+	return rc;
+}
+
+uint32_t exfat_count_free_clusters(struct exfat* ef)
+{
+	uint32_t free_clusters;
+
+	pthread_mutex_lock(&ef->cmap.lock);
+	free_clusters = ef->cmap.free_count;
+	pthread_mutex_unlock(&ef->cmap.lock);
 	return free_clusters;
 }
 
-static int find_used_clusters(const struct exfat* ef,
-		cluster_t* a, cluster_t* b)
+static int find_used_clusters(struct exfat* ef, cluster_t* a, cluster_t* b)
 {
-	const cluster_t end = le32_to_cpu(ef->sb->cluster_count);
+	const size_t end = ef->cmap.size;
+	size_t i;
 
 	/* find first used cluster */
-	for (*a = *b + 1; *a < end; (*a)++)
-		if (BMAP_GET(ef->cmap.chunk, *a - EXFAT_FIRST_DATA_CLUSTER))
-			break;
-	if (*a >= end)
+	i = exfat_cmap_find_one(ef, *b + 1 - EXFAT_FIRST_DATA_CLUSTER, end);
+	if (i >= end)
 		return 1;
+	*a = i + EXFAT_FIRST_DATA_CLUSTER;
 
 	/* find last contiguous used cluster */
-	for (*b = *a; *b < end; (*b)++)
-		if (BMAP_GET(ef->cmap.chunk, *b - EXFAT_FIRST_DATA_CLUSTER) == 0)
-		{
-			(*b)--;
-			break;
-		}
-
+	i = exfat_cmap_find_zero(ef, i, end);
+	*b = i - 1 + EXFAT_FIRST_DATA_CLUSTER;
 	return 0;
 }
 
-int exfat_find_used_sectors(const struct exfat* ef, off_t* a, off_t* b)
+int exfat_find_used_sectors(struct exfat* ef, off_t* a, off_t* b)
 {
 	cluster_t ca, cb;
+	int rc;
 
 	if (*a == 0 && *b == 0)
 		ca = cb = EXFAT_FIRST_DATA_CLUSTER - 1;
@@ -487,7 +814,10 @@ int exfat_find_used_sectors(const struct exfat* ef, off_t* a, off_t* b)
 		ca = s2c(ef, *a);
 		cb = s2c(ef, *b);
 	}
-	if (find_used_clusters(ef, &ca, &cb) != 0)
+	pthread_mutex_lock(&ef->cmap.lock);
+	rc = find_used_clusters(ef, &ca, &cb);
+	pthread_mutex_unlock(&ef->cmap.lock);
+	if (rc != 0)
 		return 1;
 	if (*a != 0 || *b != 0)
 		*a = c2s(ef, ca);
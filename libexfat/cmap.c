@@ -0,0 +1,474 @@
+/*
+	cmap.c (16.10.26)
+	Clusters bitmap loaded page by page.
+
+	Free exFAT implementation.
+	Copyright (C) 2010-2023  Andrew Nayenko
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "exfat.h"
+#include <errno.h>
+#include <string.h>
+#include <inttypes.h>
+
+#define PAGE_BITS (EXFAT_CMAP_PAGE_SIZE * 8)
+/* pages read at once while counting free clusters on mount */
+#define SCAN_PAGES 64
+
+struct exfat_cmap_page
+{
+	uint32_t index;					/* page number within the bitmap */
+	uint8_t dirty;					/* modified sectors of the page */
+	struct exfat_cmap_page* hash_next;
+	struct exfat_cmap_page* prev;	/* LRU list, the head is the most */
+	struct exfat_cmap_page* next;	/* recently used page */
+	bitmap_t bits[EXFAT_CMAP_PAGE_SIZE / sizeof(bitmap_t)];
+};
+
+/*
+ * Number of meaningful bits in the page, the last one can be partial.
+ */
+static uint32_t page_bits(const struct exfat* ef, uint32_t index)
+{
+	return MIN(PAGE_BITS, ef->cmap.size - (size_t) index * PAGE_BITS);
+}
+
+/*
+ * Number of bytes the page occupies on the device.
+ */
+static size_t page_size(const struct exfat* ef, uint32_t index)
+{
+	return BMAP_SIZE(page_bits(ef, index));
+}
+
+static off_t page_offset(const struct exfat* ef, uint32_t index)
+{
+	return exfat_c2o(ef, ef->cmap.start_cluster) +
+			(off_t) index * EXFAT_CMAP_PAGE_SIZE;
+}
+
+static struct exfat_cmap_page* find_page(const struct exfat* ef,
+		uint32_t index)
+{
+	struct exfat_cmap_page* page;
+
+	for (page = ef->cmap.hash[index & (ef->cmap.buckets - 1)]; page != NULL;
+			page = page->hash_next)
+		if (page->index == index)
+			return page;
+	return NULL;
+}
+
+static void lru_remove(struct exfat* ef, struct exfat_cmap_page* page)
+{
+	if (page->prev)
+		page->prev->next = page->next;
+	else
+		ef->cmap.head = page->next;
+	if (page->next)
+		page->next->prev = page->prev;
+	else
+		ef->cmap.tail = page->prev;
+}
+
+static void lru_insert(struct exfat* ef, struct exfat_cmap_page* page)
+{
+	page->prev = NULL;
+	page->next = ef->cmap.head;
+	if (ef->cmap.head)
+		ef->cmap.head->prev = page;
+	else
+		ef->cmap.tail = page;
+	ef->cmap.head = page;
+}
+
+static void hash_remove(struct exfat* ef, struct exfat_cmap_page* page)
+{
+	struct exfat_cmap_page** link =
+			&ef->cmap.hash[page->index & (ef->cmap.buckets - 1)];
+
+	while (*link != page)
+		link = &(*link)->hash_next;
+	*link = page->hash_next;
+}
+
+/*
+ * Marks sectors holding bits [start, end) of the page as modified.
+ */
+static void mark_dirty(const struct exfat* ef, struct exfat_cmap_page* page,
+		size_t start, size_t end)
+{
+	const int shift = ef->sb->sector_bits;
+	size_t i;
+
+	for (i = (start / 8) >> shift; i <= ((end - 1) / 8) >> shift; i++)
+		page->dirty |= 1u << i;
+}
+
+/*
+ * Queues runs of modified sectors of the page for writing.
+ */
+static int add_dirty(struct exfat* ef, struct exfat_batch* batch,
+		const struct exfat_cmap_page* page)
+{
+	const size_t sector_size = SECTOR_SIZE(*ef->sb);
+	const size_t size = page_size(ef, page->index);
+	size_t start, end;
+
+	for (start = 0; start < size; start = end)
+	{
+		if (!(page->dirty & (1u << (start / sector_size))))
+		{
+			end = start + sector_size;
+			continue;
+		}
+		for (end = start + sector_size;
+				end < size && (page->dirty & (1u << (end / sector_size)));
+				end += sector_size);
+		if (exfat_batch_add(batch, (const char*) page->bits + start,
+				MIN(end, size) - start, page_offset(ef, page->index) + start))
+			return -EIO;
+	}
+	return 0;
+}
+
+static int write_page(struct exfat* ef, struct exfat_cmap_page* page)
+{
+	struct exfat_batch batch;
+
+	if (!page->dirty)
+		return 0;
+	exfat_batch_init(&batch, ef->dev, true);
+	if (add_dirty(ef, &batch, page) != 0 || exfat_batch_flush(&batch) != 0)
+	{
+		exfat_error("failed to write clusters bitmap page %u", page->index);
+		return -EIO;
+	}
+	page->dirty = 0;
+	return 0;
+}
+
+static struct exfat_cmap_page* get_page(struct exfat* ef, uint32_t index)
+{
+	struct exfat_cmap_page* page = find_page(ef, index);
+	uint32_t hash = index & (ef->cmap.buckets - 1);
+
+	if (page != NULL)
+	{
+		if (ef->cmap.head != page)
+		{
+			lru_remove(ef, page);
+			lru_insert(ef, page);
+		}
+		return page;
+	}
+
+	if (ef->cmap.count < ef->cmap.max)
+	{
+		page = malloc(sizeof(struct exfat_cmap_page));
+		if (page == NULL)
+		{
+			exfat_error("failed to allocate clusters bitmap page");
+			return NULL;
+		}
+		ef->cmap.count++;
+	}
+	else
+	{
+		/* evict the least recently used page */
+		page = ef->cmap.tail;
+		if (write_page(ef, page) != 0)
+			return NULL;
+		lru_remove(ef, page);
+		hash_remove(ef, page);
+	}
+
+	/* the tail of the last page is not on the device */
+	memset(page->bits, 0, sizeof(page->bits));
+	if (exfat_pread(ef->dev, page->bits, page_size(ef, index),
+			page_offset(ef, index)) < 0)
+	{
+		exfat_error("failed to read clusters bitmap page %u", index);
+		free(page);
+		ef->cmap.count--;
+		return NULL;
+	}
+	page->index = index;
+	page->dirty = 0;
+	page->hash_next = ef->cmap.hash[hash];
+	ef->cmap.hash[hash] = page;
+	lru_insert(ef, page);
+	return page;
+}
+
+/*
+ * Returns the index of the first bit in [start, end) equal to "one", or end
+ * if there is none or a page cannot be read. Pages that cannot contain such
+ * a bit according to the summary are not loaded.
+ */
+static size_t find_bit(struct exfat* ef, size_t start, size_t end, bool one)
+{
+	while (start < end)
+	{
+		const uint32_t index = start / PAGE_BITS;
+		const size_t base = (size_t) index * PAGE_BITS;
+		const size_t page_end = MIN(end, base + PAGE_BITS);
+		const struct exfat_cmap_page* page;
+		size_t i;
+
+		if (ef->cmap.free[index] != (one ? page_bits(ef, index) : 0))
+		{
+			page = get_page(ef, index);
+			if (page == NULL)
+				return end;
+			if (one)
+				i = exfat_bmap_find_one(page->bits, start - base,
+						page_end - base);
+			else
+				i = exfat_bmap_find_zero(page->bits, start - base,
+						page_end - base);
+			if (i < page_end - base)
+				return base + i;
+		}
+		start = page_end;
+	}
+	return end;
+}
+
+size_t exfat_cmap_find_zero(struct exfat* ef, size_t start, size_t end)
+{
+	return find_bit(ef, start, end, false);
+}
+
+size_t exfat_cmap_find_one(struct exfat* ef, size_t start, size_t end)
+{
+	return find_bit(ef, start, end, true);
+}
+
+int exfat_cmap_get(struct exfat* ef, size_t index)
+{
+	const struct exfat_cmap_page* page = get_page(ef, index / PAGE_BITS);
+
+	if (page == NULL)
+		return -EIO;
+	return BMAP_GET(page->bits, index % PAGE_BITS) != 0;
+}
+
+/*
+ * Sets bits [start, start + count) to "one" keeping the free clusters
+ * counters in sync.
+ */
+static int fill_bits(struct exfat* ef, size_t start, size_t count, bool one)
+{
+	const size_t end = start + count;
+
+	while (start < end)
+	{
+		const uint32_t index = start / PAGE_BITS;
+		const size_t base = (size_t) index * PAGE_BITS;
+		const size_t page_end = MIN(end, base + PAGE_BITS);
+		struct exfat_cmap_page* page = get_page(ef, index);
+		size_t i;
+
+		if (page == NULL)
+			return -EIO;
+		for (i = start - base; i < page_end - base; i++)
+		{
+			if ((BMAP_GET(page->bits, i) != 0) == one)
+				continue;
+			if (one)
+			{
+				BMAP_SET(page->bits, i);
+				ef->cmap.free[index]--;
+				ef->cmap.free_count--;
+			}
+			else
+			{
+				BMAP_CLR(page->bits, i);
+				ef->cmap.free[index]++;
+				ef->cmap.free_count++;
+			}
+		}
+		mark_dirty(ef, page, start - base, page_end - base);
+		ef->cmap.dirty = true;
+		start = page_end;
+	}
+	return 0;
+}
+
+int exfat_cmap_set(struct exfat* ef, size_t start, size_t count)
+{
+	return fill_bits(ef, start, count, true);
+}
+
+int exfat_cmap_clear(struct exfat* ef, size_t start, size_t count)
+{
+	return fill_bits(ef, start, count, false);
+}
+
+static int compare_pages(const void* a, const void* b)
+{
+	const struct exfat_cmap_page* x = *(const struct exfat_cmap_page* const*) a;
+	const struct exfat_cmap_page* y = *(const struct exfat_cmap_page* const*) b;
+
+	return (x->index > y->index) - (x->index < y->index);
+}
+
+int exfat_flush_cmap(struct exfat* ef)
+{
+	struct exfat_cmap_page** dirty;
+	struct exfat_cmap_page* page;
+	struct exfat_batch batch;
+	uint32_t count = 0;
+	uint32_t i;
+	int rc = 0;
+
+	if (!ef->cmap.dirty)
+		return 0;
+
+	dirty = malloc(ef->cmap.count * sizeof(struct exfat_cmap_page*));
+	if (dirty == NULL)
+	{
+		/* write pages one by one */
+		for (page = ef->cmap.head; page != NULL; page = page->next)
+			if (write_page(ef, page) != 0)
+				rc = -EIO;
+		if (rc == 0)
+			ef->cmap.dirty = false;
+		return rc;
+	}
+	for (page = ef->cmap.head; page != NULL; page = page->next)
+		if (page->dirty)
+			dirty[count++] = page;
+
+	/* write back in the device order */
+	qsort(dirty, count, sizeof(struct exfat_cmap_page*), compare_pages);
+	exfat_batch_init(&batch, ef->dev, true);
+	for (i = 0; i < count; i++)
+		if (add_dirty(ef, &batch, dirty[i]) != 0)
+			break;
+	if (i < count || exfat_batch_flush(&batch) != 0)
+	{
+		exfat_error("failed to write clusters bitmap");
+		rc = -EIO;
+	}
+	else
+	{
+		for (i = 0; i < count; i++)
+			dirty[i]->dirty = 0;
+		ef->cmap.dirty = false;
+	}
+	free(dirty);
+	return rc;
+}
+
+/*
+ * Reads the whole bitmap once to count free clusters in every page. Only the
+ * counters are kept, pages are loaded later on demand.
+ */
+static int count_free(struct exfat* ef)
+{
+	bitmap_t* buffer;
+	uint32_t index;
+	uint32_t i;
+
+	buffer = malloc(SCAN_PAGES * EXFAT_CMAP_PAGE_SIZE);
+	if (buffer == NULL)
+	{
+		exfat_error("failed to allocate clusters bitmap buffer");
+		return -ENOMEM;
+	}
+	ef->cmap.free_count = 0;
+	for (index = 0; index < ef->cmap.pages_count; index += SCAN_PAGES)
+	{
+		const uint32_t n = MIN(SCAN_PAGES, ef->cmap.pages_count - index);
+		/* all pages but the last one are full */
+		const size_t size = (size_t) (n - 1) * EXFAT_CMAP_PAGE_SIZE +
+				page_size(ef, index + n - 1);
+
+		if (exfat_pread(ef->dev, buffer, size, page_offset(ef, index)) < 0)
+		{
+			exfat_error("failed to read clusters bitmap "
+					"(%zu bytes starting at cluster %#x)", size,
+					ef->cmap.start_cluster);
+			free(buffer);
+			return -EIO;
+		}
+		for (i = 0; i < n; i++)
+		{
+			const uint32_t bits = page_bits(ef, index + i);
+
+			ef->cmap.free[index + i] = bits - exfat_bmap_count(
+					buffer + i * (EXFAT_CMAP_PAGE_SIZE / sizeof(bitmap_t)),
+					bits);
+			ef->cmap.free_count += ef->cmap.free[index + i];
+		}
+	}
+	free(buffer);
+	return 0;
+}
+
+int exfat_init_cmap(struct exfat* ef, cluster_t start_cluster)
+{
+	uint32_t buckets = 1;
+
+	ef->cmap.start_cluster = start_cluster;
+	ef->cmap.size = le32_to_cpu(ef->sb->cluster_count);
+	ef->cmap.pages_count = DIV_ROUND_UP(ef->cmap.size, PAGE_BITS);
+	/* no need to keep more pages than the bitmap has */
+	ef->cmap.max = MAX(1, MIN(ef->cmap.max, ef->cmap.pages_count));
+	while (buckets < ef->cmap.max)
+		buckets <<= 1;
+
+	ef->cmap.hash = calloc(buckets, sizeof(struct exfat_cmap_page*));
+	ef->cmap.free = malloc(ef->cmap.pages_count * sizeof(uint16_t));
+	if (ef->cmap.hash == NULL || ef->cmap.free == NULL)
+	{
+		exfat_error("failed to allocate clusters bitmap (%u pages)",
+				ef->cmap.pages_count);
+		exfat_free_cmap(ef);
+		return -ENOMEM;
+	}
+	ef->cmap.buckets = buckets;
+	ef->cmap.head = ef->cmap.tail = NULL;
+	ef->cmap.count = 0;
+	ef->cmap.dirty = false;
+
+	if (count_free(ef) != 0)
+	{
+		exfat_free_cmap(ef);
+		return -EIO;
+	}
+	return 0;
+}
+
+void exfat_free_cmap(struct exfat* ef)
+{
+	struct exfat_cmap_page* page;
+
+	while ((page = ef->cmap.head) != NULL)
+	{
+		ef->cmap.head = page->next;
+		free(page);
+	}
+	ef->cmap.tail = NULL;
+	ef->cmap.count = 0;
+	free(ef->cmap.hash);
+	ef->cmap.hash = NULL;
+	free(ef->cmap.free);
+	ef->cmap.free = NULL;
+}
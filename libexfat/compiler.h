@@ -34,6 +34,10 @@
 #define NORETURN __attribute__((noreturn))
 #define PACKED __attribute__((packed))
 #define UNUSED __attribute__((unused))
+#define ATOMIC_ADD(ptr, value) __sync_add_and_fetch(ptr, value)
+#define ATOMIC_SUB(ptr, value) __sync_sub_and_fetch(ptr, value)
+#define POPCOUNT(x) __builtin_popcountll(x)
+#define CTZ(x) __builtin_ctzll(x)
 #if __has_extension(c_static_assert)
 #define USE_C11_STATIC_ASSERT
 #endif
@@ -44,6 +48,10 @@
 #define NORETURN __attribute__((noreturn))
 #define PACKED __attribute__((packed))
 #define UNUSED __attribute__((unused))
+#define ATOMIC_ADD(ptr, value) __sync_add_and_fetch(ptr, value)
+#define ATOMIC_SUB(ptr, value) __sync_sub_and_fetch(ptr, value)
+#define POPCOUNT(x) __builtin_popcountll(x)
+#define CTZ(x) __builtin_ctzll(x)
 #if __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 6)
 #define USE_C11_STATIC_ASSERT
 #endif
@@ -54,6 +62,30 @@
 #define NORETURN
 #define PACKED
 #define UNUSED
+/* not atomic, multi-threaded mode must not be used with such compilers */
+#define ATOMIC_ADD(ptr, value) (*(ptr) += (value))
+#define ATOMIC_SUB(ptr, value) (*(ptr) -= (value))
+#define POPCOUNT(x) exfat_popcount(x)
+#define CTZ(x) exfat_ctz(x)
+
+static inline int exfat_popcount(unsigned long long x)
+{
+	int count = 0;
+
+	for (; x != 0; x &= x - 1)
+		count++;
+	return count;
+}
+
+/* x must not be zero */
+static inline int exfat_ctz(unsigned long long x)
+{
+	int count = 0;
+
+	for (; (x & 1) == 0; x >>= 1)
+		count++;
+	return count;
+}
 
 #endif
 
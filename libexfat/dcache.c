@@ -0,0 +1,185 @@
+/*
+	dcache.c (16.10.26)
+	Cache of path components resolution results.
+
+	Free exFAT implementation.
+	Copyright (C) 2010-2023  Andrew Nayenko
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "exfat.h"
+#include <errno.h>
+#include <string.h>
+
+/*
+ * Every entry maps a component name in a directory to its node or to nothing
+ * (a negative entry). Names are stored upcased, so all case variants of a
+ * name share one entry, just like they match one node. Entries are not
+ * removed one by one: each cached directory has a generation number that
+ * changes whenever its list of children changes, and entries of older
+ * generations are ignored. Generations are never reused, so an entry cannot
+ * become valid again even if the directory node memory gets reused.
+ */
+struct exfat_dentry
+{
+	const struct exfat_node* parent;
+	struct exfat_node* node;		/* NULL for a negative entry */
+	uint64_t generation;			/* zero for an unused entry */
+	uint8_t length;
+	uint16_t name[EXFAT_DENTRY_NAME_MAX];
+};
+
+/*
+ * Returns the length of the upcased name or zero if the name is too long to
+ * be cached.
+ */
+static size_t upcase_name(const struct exfat* ef,
+		uint16_t upcased[EXFAT_DENTRY_NAME_MAX], const le16_t* name)
+{
+	size_t n;
+
+	for (n = 0; le16_to_cpu(name[n]) != 0; n++)
+	{
+		if (n == EXFAT_DENTRY_NAME_MAX)
+			return 0;
+		upcased[n] = ef->upcase[le16_to_cpu(name[n])];
+	}
+	return n;
+}
+
+static uint32_t hash_name(const struct exfat_node* parent,
+		const uint16_t* name, size_t n)
+{
+	uint32_t hash = 2166136261u ^ (uint32_t) (uintptr_t) parent;
+	size_t i;
+
+	/* FNV-1a */
+	for (i = 0; i < n; i++)
+		hash = (hash ^ name[i]) * 16777619u;
+	return hash;
+}
+
+static struct exfat_dentry* get_slot(const struct exfat* ef,
+		const struct exfat_node* parent, const uint16_t* name, size_t n)
+{
+	return &ef->dentries.entries[hash_name(parent, name, n) &
+			(ef->dentries.count - 1)];
+}
+
+int exfat_init_dcache(struct exfat* ef, size_t cache_size)
+{
+	uint32_t count = 1;
+
+	ef->dentries.entries = NULL;
+	ef->dentries.count = 0;
+	ef->dentries.generation = 0;
+	if (cache_size < sizeof(struct exfat_dentry))
+		return 0; /* caching is disabled */
+
+	/* direct-mapped, so the number of entries is a power of 2 */
+	while (count * 2 <= cache_size / sizeof(struct exfat_dentry))
+		count *= 2;
+	ef->dentries.entries = calloc(count, sizeof(struct exfat_dentry));
+	if (ef->dentries.entries == NULL)
+	{
+		exfat_error("failed to allocate dentry cache (%u entries)", count);
+		return -ENOMEM;
+	}
+	ef->dentries.count = count;
+	return 0;
+}
+
+void exfat_free_dcache(struct exfat* ef)
+{
+	free(ef->dentries.entries);
+	ef->dentries.entries = NULL;
+	ef->dentries.count = 0;
+}
+
+bool exfat_dcache_lookup(struct exfat* ef, const struct exfat_node* parent,
+		const le16_t* name, struct exfat_node** node)
+{
+	const struct exfat_dentry* dentry;
+	uint16_t upcased[EXFAT_DENTRY_NAME_MAX];
+	bool found = false;
+	size_t n;
+
+	if (ef->dentries.count == 0)
+		return false;
+	n = upcase_name(ef, upcased, name);
+	if (n == 0)
+		return false;
+
+	pthread_mutex_lock(&ef->dentries.lock);
+	dentry = get_slot(ef, parent, upcased, n);
+	if (dentry->generation != 0 &&
+			dentry->generation == parent->dentry_generation &&
+			dentry->parent == parent && dentry->length == n &&
+			memcmp(dentry->name, upcased, n * sizeof(uint16_t)) == 0)
+	{
+		/* the node is still a child of the parent, so it is alive */
+		*node = dentry->node ? exfat_get_node(dentry->node) : NULL;
+		found = true;
+		ef->dentries.hits++;
+	}
+	else
+		ef->dentries.misses++;
+	pthread_mutex_unlock(&ef->dentries.lock);
+	return found;
+}
+
+void exfat_dcache_insert(struct exfat* ef, const struct exfat_node* parent,
+		const le16_t* name, struct exfat_node* node)
+{
+	struct exfat_dentry* dentry;
+	uint16_t upcased[EXFAT_DENTRY_NAME_MAX];
+	size_t n;
+
+	if (ef->dentries.count == 0)
+		return;
+	n = upcase_name(ef, upcased, name);
+	if (n == 0)
+		return;
+
+	pthread_mutex_lock(&ef->dentries.lock);
+	/* a directory that was never cached has no generation */
+	if (parent->dentry_generation != 0)
+	{
+		dentry = get_slot(ef, parent, upcased, n);
+		dentry->parent = parent;
+		dentry->node = node;
+		dentry->generation = parent->dentry_generation;
+		dentry->length = n;
+		memcpy(dentry->name, upcased, n * sizeof(uint16_t));
+	}
+	pthread_mutex_unlock(&ef->dentries.lock);
+}
+
+void exfat_dcache_invalidate(struct exfat* ef, struct exfat_node* dir)
+{
+	pthread_mutex_lock(&ef->dentries.lock);
+	dir->dentry_generation = ++ef->dentries.generation;
+	pthread_mutex_unlock(&ef->dentries.lock);
+}
+
+void exfat_dcache_reset(struct exfat* ef)
+{
+	pthread_mutex_lock(&ef->dentries.lock);
+	if (ef->dentries.count != 0)
+		memset(ef->dentries.entries, 0,
+				ef->dentries.count * sizeof(struct exfat_dentry));
+	pthread_mutex_unlock(&ef->dentries.lock);
+}
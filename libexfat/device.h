@@ -0,0 +1,79 @@
+/*
+	device.h (16.10.26)
+	Block device backends interface.
+
+	Free exFAT implementation.
+	Copyright (C) 2010-2023  Andrew Nayenko
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef DEVICE_H_INCLUDED
+#define DEVICE_H_INCLUDED
+
+#include "exfat.h"
+
+/*
+   A backend implements raw device I/O, everything else (including
+   sequential exfat_read() and exfat_write()) is built on top of it by io.c.
+   pread and pwrite follow POSIX semantics: they return the number of bytes
+   transferred or -1 with errno set and must be safe to call from several
+   threads at once. Backends without transfer get batches executed one
+   request at a time. open sets ops, mode and size of the device it returns
+   (which can belong to a different backend if this one is unavailable).
+*/
+struct exfat_dev_ops
+{
+	const char* name;
+	struct exfat_dev* (*open)(const char* spec, enum exfat_mode mode);
+	int (*close)(struct exfat_dev* dev);
+	int (*fsync)(struct exfat_dev* dev);
+	ssize_t (*pread)(struct exfat_dev* dev, void* buffer, size_t size,
+			off_t offset);
+	ssize_t (*pwrite)(struct exfat_dev* dev, const void* buffer, size_t size,
+			off_t offset);
+	/* optional, performs a batch of transfers, returns 0 or -errno */
+	int (*transfer)(struct exfat_dev* dev, const struct exfat_io* ios,
+			size_t count, bool write);
+};
+
+/* backends embed this as the first member of their own structure */
+struct exfat_dev
+{
+	const struct exfat_dev_ops* ops;
+	enum exfat_mode mode;
+	off_t size;						/* in bytes */
+	off_t pos;						/* for exfat_read() and exfat_write() */
+};
+
+extern const struct exfat_dev_ops exfat_posix_dev_ops;
+extern const struct exfat_dev_ops exfat_mmap_dev_ops;
+extern const struct exfat_dev_ops exfat_ram_dev_ops;
+#ifdef USE_IO_URING
+extern const struct exfat_dev_ops exfat_uring_dev_ops;
+#endif
+
+int exfat_open_fd(const char* spec, enum exfat_mode* mode, off_t* size);
+
+/* clips a transfer to the device end, like pread() and pwrite() do */
+static inline size_t exfat_dev_clip(const struct exfat_dev* dev, size_t size,
+		off_t offset)
+{
+	if (offset >= dev->size)
+		return 0;
+	return MIN(size, (uint64_t) (dev->size - offset));
+}
+
+#endif /* ifndef DEVICE_H_INCLUDED */
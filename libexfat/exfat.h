@@ -34,6 +34,7 @@
 #include <stdlib.h>
 #include <time.h>
 #include <stdbool.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
@@ -64,6 +65,53 @@
 #define BMAP_CLR(bitmap, index) \
 	((bitmap)[BMAP_BLOCK(index)] &= ~BMAP_MASK(index))
 
+/* clusters bitmap is loaded in pages of this size */
+#define EXFAT_CMAP_PAGE_SIZE 4096
+/* default clusters bitmap cache size, can be changed with "bitmapcache"
+   option (in KB) */
+#define EXFAT_CMAP_CACHE_SIZE (256 * 1024)
+
+/* FAT is cached in pages of this size */
+#define EXFAT_FAT_PAGE_SIZE 4096
+/* default FAT cache size, can be changed with "fatcache" option (in KB) */
+#define EXFAT_FAT_CACHE_SIZE (1024 * 1024)
+
+/* directory clusters are cached in blocks of this size (or cluster size if
+   it is smaller) */
+#define EXFAT_BLOCK_SIZE 4096
+/* default blocks cache size, can be changed with "blkcache" option (in KB) */
+#define EXFAT_BLOCK_CACHE_SIZE (256 * 1024)
+
+/* default dentry cache size, can be changed with "dcache" option (in KB) */
+#define EXFAT_DENTRY_CACHE_SIZE (256 * 1024)
+/* longer names (in UTF-16 characters) are not cached */
+#define EXFAT_DENTRY_NAME_MAX 35
+
+/* default maximum readahead window, can be changed with "readahead" option
+   (in KB) */
+#define EXFAT_READAHEAD_SIZE (1024 * 1024)
+/* default write-back buffer size, can be changed with "writeback" option
+   (in KB) */
+#define EXFAT_WRITEBACK_SIZE (1024 * 1024)
+
+/* number of transfers a batch collects before passing them to the device */
+#define EXFAT_BATCH_SIZE 32
+
+/* directory index size limits; there are only 65536 distinct name hashes */
+#define EXFAT_HASH_BUCKETS_MIN 16
+#define EXFAT_HASH_BUCKETS_MAX 0x10000
+
+/* used entries bitmap of a directory is allocated for at least this many
+   entries */
+#define EXFAT_SLOTS_MIN 64
+
+/* default nodes cache size, can be changed with "nodecache" option (in KB);
+   cached directories are evicted when nodes take more memory */
+#define EXFAT_NODE_CACHE_SIZE (64 * 1024 * 1024)
+
+/* names that fit into a single name entry are stored in the node itself */
+#define EXFAT_INLINE_NAME_MAX EXFAT_ENAME_MAX
+
 #define EXFAT_REPAIR(hook, ef, ...) \
 	(exfat_ask_to_fix(ef) && exfat_fix_ ## hook(ef, __VA_ARGS__))
 
@@ -71,6 +119,32 @@
    be corrupted with 32-bit off_t. */
 STATIC_ASSERT(sizeof(off_t) == 8);
 
+/*
+	Locking model. The library can be used from several threads if the
+	caller follows these rules:
+	- Operations that change the tree of nodes (creation, removal, renaming,
+	  flushing all nodes, cache reset, eviction) must be serialized against
+	  all other operations by the caller, e.g. with a readers-writer lock.
+	- Everything else (lookups, directory listing, reading, writing,
+	  truncation, node flushing) can run concurrently.
+	- exfat_node.lock protects node data I/O and node fields. For a directory
+	  it also protects its entry sets and the list of its children while the
+	  directory is being cached. A node lock can be taken while holding the
+	  lock of its child, but not vice versa. Node locks are recursive.
+	- exfat.cmap.lock protects the clusters bitmap and the allocator;
+	  exfat_cmap_*() functions expect it to be held.
+	- exfat.fat.lock protects the FAT cache.
+	- exfat.blocks.lock protects the directory blocks cache.
+	- exfat.dentries.lock protects the dentry cache.
+	- exfat.nodes.lock protects the nodes allocator.
+	- The latter five are never held while taking any other lock.
+	- References counter is updated atomically.
+*/
+
+struct exfat_extent;
+struct exfat_readahead;
+struct exfat_writeback;
+
 struct exfat_node
 {
 	struct exfat_node* parent;
@@ -78,21 +152,49 @@ struct exfat_node
 	struct exfat_node* next;
 	struct exfat_node* prev;
 
+	pthread_mutex_t lock;
 	int references;
+	int opens;					/* open file handles */
 	uint32_t fptr_index;
 	cluster_t fptr_cluster;
 	off_t entry_offset;
 	cluster_t start_cluster;
 	uint16_t attrib;
 	uint8_t continuations;
+	uint16_t name_hash;
 	bool is_contiguous : 1;
 	bool is_cached : 1;
 	bool is_dirty : 1;
 	bool is_unlinked : 1;
+	bool is_shrunk : 1;			/* freed clusters since the last flush */
 	uint64_t valid_size;
 	uint64_t size;
 	time_t mtime, atime;
-	le16_t name[EXFAT_NAME_MAX + 1];
+	/* cluster runs of a fragmented node, built on demand */
+	struct exfat_extent* extents;
+	uint32_t extents_count;
+	uint32_t extents_size;
+	/* children of a cached directory indexed by name hash */
+	struct exfat_node** hash_table;
+	uint32_t hash_buckets;
+	uint32_t hash_entries;
+	struct exfat_node* hash_next;
+	/* used entries of a cached directory, built on demand */
+	bitmap_t* slots;
+	uint32_t slots_count;			/* entries the bitmap can hold */
+	uint32_t slots_hint;			/* entries before this one are used */
+	/* dentry cache entries of a directory with another value are stale */
+	uint64_t dentry_generation;
+	/* cached directories list, the most recently used first */
+	struct exfat_node* lru_prev;
+	struct exfat_node* lru_next;
+	/* sequential reads detection and prefetched data of a regular file */
+	struct exfat_readahead* readahead;
+	/* written data of a regular file not yet passed to the device */
+	struct exfat_writeback* writeback;
+	/* points either to inline_name or to a separately allocated buffer */
+	le16_t* name;
+	le16_t inline_name[EXFAT_INLINE_NAME_MAX + 1];
 };
 
 enum exfat_mode
@@ -103,6 +205,30 @@ enum exfat_mode
 };
 
 struct exfat_dev;
+struct exfat_fat_page;
+struct exfat_cmap_page;
+struct exfat_block;
+struct exfat_dentry;
+struct exfat_node_slab;
+
+struct exfat_io
+{
+	void* buffer;
+	size_t size;
+	off_t offset;
+};
+
+/*
+   Collects independent transfers of the same direction so that the device
+   backend can issue them all at once.
+*/
+struct exfat_batch
+{
+	struct exfat_dev* dev;
+	bool write;
+	size_t count;
+	struct exfat_io ios[EXFAT_BATCH_SIZE];
+};
 
 struct exfat
 {
@@ -114,11 +240,68 @@ struct exfat
 	{
 		cluster_t start_cluster;
 		uint32_t size;				/* in bits */
-		bitmap_t* chunk;
-		uint32_t chunk_size;		/* in bits */
+		uint32_t free_count;		/* zero bits among the first size */
+		uint32_t pages_count;		/* pages the bitmap consists of */
+		uint16_t* free;				/* zero bits in every page */
+		struct exfat_cmap_page** hash;
+		uint32_t buckets;
+		struct exfat_cmap_page* head;	/* most recently used */
+		struct exfat_cmap_page* tail;	/* least recently used */
+		uint32_t count;				/* pages in memory */
+		uint32_t max;
 		bool dirty;
+		pthread_mutex_t lock;
 	}
 	cmap;
+	struct
+	{
+		struct exfat_fat_page* pages;
+		uint32_t pages_count;
+		bool dirty;
+		uint64_t hits;				/* lookups served from memory */
+		uint64_t misses;			/* lookups that required reading */
+		pthread_mutex_t lock;
+	}
+	fat;
+	struct
+	{
+		struct exfat_block** hash;
+		uint32_t buckets;
+		struct exfat_block* head;	/* most recently used */
+		struct exfat_block* tail;	/* least recently used */
+		uint32_t count;
+		uint32_t max;				/* zero disables caching */
+		uint32_t dirty_count;
+		uint32_t block_size;
+		uint64_t hits;				/* reads served from memory */
+		uint64_t misses;			/* reads that required reading */
+		pthread_mutex_t lock;
+	}
+	blocks;
+	struct
+	{
+		struct exfat_dentry* entries;
+		uint32_t count;				/* zero disables caching */
+		uint64_t generation;		/* last one given to a directory */
+		uint64_t hits;				/* lookups served from memory */
+		uint64_t misses;			/* lookups that required a search */
+		pthread_mutex_t lock;
+	}
+	dentries;
+	struct
+	{
+		struct exfat_node_slab* slabs;
+		struct exfat_node* free;	/* linked with the next field */
+		uint32_t count;				/* nodes in use */
+		uint32_t max;				/* zero means no limit */
+		uint32_t threshold;			/* when eviction is tried next time */
+		struct exfat_node* head;	/* most recently used directory */
+		struct exfat_node* tail;	/* least recently used directory */
+		uint32_t directories;		/* cached directories */
+		uint64_t evictions;			/* directories evicted */
+		pthread_mutex_t lock;
+	}
+	nodes;
 	char label[EXFAT_UTF8_ENAME_BUFFER_MAX];
 	void* zero_cluster;
 	int dmask, fmask;
@@ -126,6 +309,8 @@ struct exfat
 	gid_t gid;
 	int ro;
 	bool noatime;
+	size_t readahead;				/* maximum window, zero disables it */
+	size_t writeback;				/* buffer size, zero disables it */
 	enum { EXFAT_REPAIR_NO, EXFAT_REPAIR_ASK, EXFAT_REPAIR_YES } repair;
 };
 
@@ -151,6 +336,8 @@ void exfat_warn(const char* format, ...) PRINTF;
 void exfat_debug(const char* format, ...) PRINTF;
 
 struct exfat_dev* exfat_open(const char* spec, enum exfat_mode mode);
+struct exfat_dev* exfat_open_backend(const char* spec, enum exfat_mode mode,
+		const char* backend);
 int exfat_close(struct exfat_dev* dev);
 int exfat_fsync(struct exfat_dev* dev);
 enum exfat_mode exfat_get_mode(const struct exfat_dev* dev);
@@ -162,10 +349,21 @@ ssize_t exfat_pread(struct exfat_dev* dev, void* buffer, size_t size,
 		off_t offset);
 ssize_t exfat_pwrite(struct exfat_dev* dev, const void* buffer, size_t size,
 		off_t offset);
-ssize_t exfat_generic_pread(const struct exfat* ef, struct exfat_node* node,
+void exfat_batch_init(struct exfat_batch* batch, struct exfat_dev* dev,
+		bool write);
+int exfat_batch_add(struct exfat_batch* batch, const void* buffer,
+		size_t size, off_t offset);
+int exfat_batch_flush(struct exfat_batch* batch);
+ssize_t exfat_generic_pread(struct exfat* ef, struct exfat_node* node,
 		void* buffer, size_t size, off_t offset);
 ssize_t exfat_generic_pwrite(struct exfat* ef, struct exfat_node* node,
 		const void* buffer, size_t size, off_t offset);
+ssize_t exfat_generic_pwrite_through(struct exfat* ef, struct exfat_node* node,
+		const void* buffer, size_t size, off_t offset);
+void exfat_invalidate_readahead(struct exfat_node* node);
+void exfat_free_readahead(struct exfat_node* node);
+int exfat_flush_writeback(struct exfat* ef, struct exfat_node* node);
+void exfat_free_writeback(struct exfat_node* node);
 
 int exfat_opendir(struct exfat* ef, struct exfat_node* dir,
 		struct exfat_iterator* it);
@@ -175,18 +373,70 @@ int exfat_lookup(struct exfat* ef, struct exfat_node** node,
 		const char* path);
 int exfat_split(struct exfat* ef, struct exfat_node** parent,
 		struct exfat_node** node, le16_t* name, const char* path);
+int exfat_lookup_name(struct exfat* ef, struct exfat_node* parent,
+		struct exfat_node** node, const char* name);
+int exfat_split_name(struct exfat* ef, struct exfat_node* dir,
+		struct exfat_node** node, le16_t* name, const char* comp);
+
+size_t exfat_bmap_find_zero(const bitmap_t* bitmap, size_t start, size_t end);
+size_t exfat_bmap_find_one(const bitmap_t* bitmap, size_t start, size_t end);
+size_t exfat_bmap_count(const bitmap_t* bitmap, size_t count);
 
 off_t exfat_c2o(const struct exfat* ef, cluster_t cluster);
-cluster_t exfat_next_cluster(const struct exfat* ef,
+cluster_t exfat_next_cluster(struct exfat* ef,
 		const struct exfat_node* node, cluster_t cluster);
-cluster_t exfat_advance_cluster(const struct exfat* ef,
+cluster_t exfat_advance_cluster(struct exfat* ef,
 		struct exfat_node* node, uint32_t count);
+void exfat_free_extents(struct exfat_node* node);
 int exfat_flush_nodes(struct exfat* ef);
+int exfat_flush_clusters(struct exfat* ef);
 int exfat_flush(struct exfat* ef);
 int exfat_truncate(struct exfat* ef, struct exfat_node* node, uint64_t size,
 		bool erase);
-uint32_t exfat_count_free_clusters(const struct exfat* ef);
-int exfat_find_used_sectors(const struct exfat* ef, off_t* a, off_t* b);
+int exfat_preallocate(struct exfat* ef, struct exfat_node* node,
+		uint64_t size, bool keep_size);
+int exfat_extend_valid_size(struct exfat* ef, struct exfat_node* node,
+		uint64_t size);
+uint32_t exfat_count_free_clusters(struct exfat* ef);
+uint32_t exfat_scan_free_clusters(struct exfat* ef);
+int exfat_test_cluster(struct exfat* ef, cluster_t cluster);
+int exfat_find_used_sectors(struct exfat* ef, off_t* a, off_t* b);
+
+int exfat_init_fat(struct exfat* ef, size_t cache_size);
+void exfat_free_fat(struct exfat* ef);
+int exfat_read_fat(struct exfat* ef, cluster_t cluster, cluster_t* next);
+int exfat_write_fat(struct exfat* ef, cluster_t cluster, cluster_t next);
+int exfat_link_fat(struct exfat* ef, cluster_t first, uint32_t count,
+		cluster_t next);
+int exfat_clear_fat(struct exfat* ef, cluster_t first, uint32_t count);
+int exfat_flush_fat(struct exfat* ef);
+
+int exfat_init_cmap(struct exfat* ef, cluster_t start_cluster);
+void exfat_free_cmap(struct exfat* ef);
+size_t exfat_cmap_find_zero(struct exfat* ef, size_t start, size_t end);
+size_t exfat_cmap_find_one(struct exfat* ef, size_t start, size_t end);
+int exfat_cmap_get(struct exfat* ef, size_t index);
+int exfat_cmap_set(struct exfat* ef, size_t start, size_t count);
+int exfat_cmap_clear(struct exfat* ef, size_t start, size_t count);
+int exfat_flush_cmap(struct exfat* ef);
+
+int exfat_init_blkcache(struct exfat* ef, size_t cache_size);
+void exfat_free_blkcache(struct exfat* ef);
+int exfat_blkcache_read(struct exfat* ef, void* buffer, size_t size,
+		off_t offset);
+int exfat_blkcache_write(struct exfat* ef, const void* buffer, size_t size,
+		off_t offset);
+void exfat_blkcache_discard(struct exfat* ef, off_t offset, size_t size);
+int exfat_flush_blkcache(struct exfat* ef);
+
+int exfat_init_dcache(struct exfat* ef, size_t cache_size);
+void exfat_free_dcache(struct exfat* ef);
+bool exfat_dcache_lookup(struct exfat* ef, const struct exfat_node* parent,
+		const le16_t* name, struct exfat_node** node);
+void exfat_dcache_insert(struct exfat* ef, const struct exfat_node* parent,
+		const le16_t* name, struct exfat_node* node);
+void exfat_dcache_invalidate(struct exfat* ef, struct exfat_node* dir);
+void exfat_dcache_reset(struct exfat* ef);
 
 void exfat_stat(const struct exfat* ef, const struct exfat_node* node,
 		struct stat* stbuf);
@@ -210,8 +460,16 @@ int exfat_utf8_to_utf16(le16_t* output, const char* input, size_t outsize,
 		size_t insize);
 size_t exfat_utf16_length(const le16_t* str);
 
+struct exfat_node* exfat_allocate_node(struct exfat* ef);
+void exfat_free_node(struct exfat* ef, struct exfat_node* node);
+void exfat_free_nodes(struct exfat* ef);
+void exfat_touch_directory(struct exfat* ef, struct exfat_node* dir);
+bool exfat_need_eviction(struct exfat* ef);
+void exfat_evict_nodes(struct exfat* ef);
 struct exfat_node* exfat_get_node(struct exfat_node* node);
 void exfat_put_node(struct exfat* ef, struct exfat_node* node);
+void exfat_open_node(struct exfat_node* node);
+void exfat_close_node(struct exfat* ef, struct exfat_node* node);
 int exfat_cleanup_node(struct exfat* ef, struct exfat_node* node);
 int exfat_cache_directory(struct exfat* ef, struct exfat_node* dir);
 void exfat_reset_cache(struct exfat* ef);
@@ -221,6 +479,12 @@ int exfat_rmdir(struct exfat* ef, struct exfat_node* node);
 int exfat_mknod(struct exfat* ef, const char* path);
 int exfat_mkdir(struct exfat* ef, const char* path);
 int exfat_rename(struct exfat* ef, const char* old_path, const char* new_path);
+int exfat_mknodat(struct exfat* ef, struct exfat_node* dir, const char* name,
+		struct exfat_node** node);
+int exfat_mkdirat(struct exfat* ef, struct exfat_node* dir, const char* name,
+		struct exfat_node** node);
+int exfat_renameat(struct exfat* ef, struct exfat_node* node,
+		struct exfat_node* dir, const char* name);
 void exfat_utimes(struct exfat_node* node, const struct timespec tv[2]);
 void exfat_update_atime(struct exfat_node* node);
 void exfat_update_mtime(struct exfat_node* node);
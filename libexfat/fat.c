@@ -0,0 +1,271 @@
+/*
+	fat.c (16.10.26)
+	exFAT file system implementation library.
+
+	Free exFAT implementation.
+	Copyright (C) 2010-2023  Andrew Nayenko
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "exfat.h"
+#include <errno.h>
+#include <string.h>
+#include <inttypes.h>
+
+#define FAT_PAGE_ENTRIES (EXFAT_FAT_PAGE_SIZE / sizeof(cluster_t))
+
+struct exfat_fat_page
+{
+	uint32_t index;					/* page number within the FAT */
+	bool valid;
+	bool dirty;
+	le32_t entries[FAT_PAGE_ENTRIES];
+};
+
+/*
+ * Number of FAT entries, including two reserved ones at the beginning.
+ */
+static uint64_t fat_entries(const struct exfat* ef)
+{
+	return (uint64_t) le32_to_cpu(ef->sb->cluster_count) +
+			EXFAT_FIRST_DATA_CLUSTER;
+}
+
+static off_t page_offset(const struct exfat* ef, uint32_t index)
+{
+	return ((off_t) le32_to_cpu(ef->sb->fat_sector_start) <<
+			ef->sb->sector_bits) + (off_t) index * EXFAT_FAT_PAGE_SIZE;
+}
+
+/*
+ * The last page can be partial: never touch sectors beyond the FAT end.
+ */
+static size_t page_size(const struct exfat* ef, uint32_t index)
+{
+	return MIN(FAT_PAGE_ENTRIES,
+			fat_entries(ef) - (uint64_t) index * FAT_PAGE_ENTRIES) *
+			sizeof(cluster_t);
+}
+
+static int write_page(struct exfat* ef, struct exfat_fat_page* page)
+{
+	if (!page->dirty)
+		return 0;
+	if (exfat_pwrite(ef->dev, page->entries, page_size(ef, page->index),
+			page_offset(ef, page->index)) < 0)
+	{
+		exfat_error("failed to write FAT page %u", page->index);
+		return -EIO;
+	}
+	page->dirty = false;
+	return 0;
+}
+
+/*
+ * The cache is direct-mapped: a FAT page can live only in one slot. This
+ * keeps lookups O(1) without any bookkeeping. Cluster chains are mostly
+ * local, so conflicts are rare.
+ */
+static struct exfat_fat_page* get_page(struct exfat* ef, cluster_t cluster)
+{
+	const uint32_t index = cluster / FAT_PAGE_ENTRIES;
+	struct exfat_fat_page* page =
+			&ef->fat.pages[index % ef->fat.pages_count];
+
+	if (page->valid && page->index == index)
+	{
+		ef->fat.hits++;
+		return page;
+	}
+	ef->fat.misses++;
+
+	/* evict the page occupying the slot */
+	if (page->valid && write_page(ef, page) != 0)
+		return NULL;
+	page->valid = false;
+
+	if (exfat_pread(ef->dev, page->entries, page_size(ef, index),
+			page_offset(ef, index)) < 0)
+	{
+		exfat_error("failed to read FAT page %u", index);
+		return NULL;
+	}
+	page->index = index;
+	page->valid = true;
+	page->dirty = false;
+	return page;
+}
+
+int exfat_init_fat(struct exfat* ef, size_t cache_size)
+{
+	uint64_t pages_max = DIV_ROUND_UP(fat_entries(ef), FAT_PAGE_ENTRIES);
+
+	/* no need to allocate more slots than there are pages in the FAT */
+	ef->fat.pages_count = MAX(1, MIN(cache_size / EXFAT_FAT_PAGE_SIZE,
+			pages_max));
+	ef->fat.pages = calloc(ef->fat.pages_count,
+			sizeof(struct exfat_fat_page));
+	if (ef->fat.pages == NULL)
+	{
+		exfat_error("failed to allocate FAT cache (%u pages)",
+				ef->fat.pages_count);
+		return -ENOMEM;
+	}
+	ef->fat.dirty = false;
+	ef->fat.hits = 0;
+	ef->fat.misses = 0;
+	return 0;
+}
+
+void exfat_free_fat(struct exfat* ef)
+{
+	free(ef->fat.pages);
+	ef->fat.pages = NULL;
+	ef->fat.pages_count = 0;
+}
+
+int exfat_read_fat(struct exfat* ef, cluster_t cluster, cluster_t* next)
+{
+	const struct exfat_fat_page* page;
+	int rc = 0;
+
+	if (cluster >= fat_entries(ef))
+	{
+		exfat_error("cluster %#x is beyond the FAT", cluster);
+		return -EIO;
+	}
+	pthread_mutex_lock(&ef->fat.lock);
+	page = get_page(ef, cluster);
+	if (page != NULL)
+		*next = le32_to_cpu(page->entries[cluster % FAT_PAGE_ENTRIES]);
+	else
+		rc = -EIO;
+	pthread_mutex_unlock(&ef->fat.lock);
+	return rc;
+}
+
+int exfat_write_fat(struct exfat* ef, cluster_t cluster, cluster_t next)
+{
+	struct exfat_fat_page* page;
+	int rc = 0;
+
+	if (cluster >= fat_entries(ef))
+		exfat_bug("cluster %#x is beyond the FAT", cluster);
+	pthread_mutex_lock(&ef->fat.lock);
+	page = get_page(ef, cluster);
+	if (page != NULL)
+	{
+		page->entries[cluster % FAT_PAGE_ENTRIES] = cpu_to_le32(next);
+		page->dirty = true;
+		ef->fat.dirty = true;
+	}
+	else
+		rc = -EIO;
+	pthread_mutex_unlock(&ef->fat.lock);
+	return rc;
+}
+
+/*
+ * Sets FAT entries of clusters [first, first + count): each one points to the
+ * following cluster if chain is true or is freed otherwise, the last one
+ * points to last_next. Every FAT page is looked up once.
+ */
+static int write_range(struct exfat* ef, cluster_t first, uint32_t count,
+		bool chain, cluster_t last_next)
+{
+	const cluster_t end = first + count;
+	struct exfat_fat_page* page;
+	cluster_t cluster = first;
+	int rc = 0;
+
+	if (count == 0)
+		return 0;
+	if (end > fat_entries(ef) || end < first)
+		exfat_bug("clusters %#x-%#x are beyond the FAT", first, end - 1);
+	pthread_mutex_lock(&ef->fat.lock);
+	while (cluster < end)
+	{
+		const uint32_t n = MIN(end - cluster,
+				FAT_PAGE_ENTRIES - cluster % FAT_PAGE_ENTRIES);
+		le32_t* entries;
+		uint32_t i;
+
+		page = get_page(ef, cluster);
+		if (page == NULL)
+		{
+			rc = -EIO;
+			break;
+		}
+		entries = &page->entries[cluster % FAT_PAGE_ENTRIES];
+		for (i = 0; i < n; i++)
+			entries[i] = cpu_to_le32(chain ? cluster + i + 1 :
+					EXFAT_CLUSTER_FREE);
+		page->dirty = true;
+		ef->fat.dirty = true;
+		cluster += n;
+	}
+	if (rc == 0)
+		page->entries[(end - 1) % FAT_PAGE_ENTRIES] = cpu_to_le32(last_next);
+	pthread_mutex_unlock(&ef->fat.lock);
+	return rc;
+}
+
+int exfat_link_fat(struct exfat* ef, cluster_t first, uint32_t count,
+		cluster_t next)
+{
+	return write_range(ef, first, count, true, next);
+}
+
+int exfat_clear_fat(struct exfat* ef, cluster_t first, uint32_t count)
+{
+	return write_range(ef, first, count, false, EXFAT_CLUSTER_FREE);
+}
+
+int exfat_flush_fat(struct exfat* ef)
+{
+	struct exfat_batch batch;
+	struct exfat_fat_page* page;
+	uint32_t i;
+	int rc = 0;
+
+	pthread_mutex_lock(&ef->fat.lock);
+	if (ef->fat.dirty)
+	{
+		/* dirty pages are independent, pass them to the device at once */
+		exfat_batch_init(&batch, ef->dev, true);
+		for (i = 0; i < ef->fat.pages_count && rc == 0; i++)
+		{
+			page = &ef->fat.pages[i];
+			if (page->valid && page->dirty &&
+					exfat_batch_add(&batch, page->entries,
+							page_size(ef, page->index),
+							page_offset(ef, page->index)) != 0)
+				rc = -EIO;
+		}
+		if (rc == 0 && exfat_batch_flush(&batch) != 0)
+			rc = -EIO;
+		if (rc == 0)
+		{
+			for (i = 0; i < ef->fat.pages_count; i++)
+				ef->fat.pages[i].dirty = false;
+			ef->fat.dirty = false;
+		}
+		else
+			exfat_error("failed to write FAT");
+	}
+	pthread_mutex_unlock(&ef->fat.lock);
+	return rc;
+}
@@ -20,39 +20,20 @@
 	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 */
 
-#include "exfat.h"
+#include "device.h"
 #include <inttypes.h>
-#include <sys/types.h>
-#include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
-#if defined(__APPLE__)
-#include <sys/disk.h>
-#elif defined(__OpenBSD__)
-#include <sys/param.h>
-#include <sys/disklabel.h>
-#include <sys/dkio.h>
-#include <sys/ioctl.h>
-#elif defined(__NetBSD__)
-#include <sys/ioctl.h>
-#elif __linux__
-#include <sys/mount.h>
-#endif
-#ifdef USE_UBLIO
-#include <sys/uio.h>
-#include <ublio.h>
-#endif
 
-struct exfat_dev
+static const struct exfat_dev_ops* const backends[] =
 {
-	int fd;
-	enum exfat_mode mode;
-	off_t size; /* in bytes */
-#ifdef USE_UBLIO
-	off_t pos;
-	ublio_filehandle_t ufh;
+	&exfat_posix_dev_ops,
+	&exfat_mmap_dev_ops,
+	&exfat_ram_dev_ops,
+#ifdef USE_IO_URING
+	&exfat_uring_dev_ops,
 #endif
 };
 
@@ -61,38 +42,26 @@ static bool is_open(int fd)
 	return fcntl(fd, F_GETFD) != -1;
 }
 
-static int open_ro(const char* spec)
+struct exfat_dev* exfat_open(const char* spec, enum exfat_mode mode)
 {
-	return open(spec, O_RDONLY);
+	return exfat_open_backend(spec, mode, exfat_posix_dev_ops.name);
 }
 
-static int open_rw(const char* spec)
+struct exfat_dev* exfat_open_backend(const char* spec, enum exfat_mode mode,
+		const char* backend)
 {
-	int fd = open(spec, O_RDWR);
-#ifdef __linux__
-	int ro = 0;
+	const struct exfat_dev_ops* ops = NULL;
+	struct exfat_dev* dev;
+	size_t i;
 
-	/*
-	   This ioctl is needed because after "blockdev --setro" kernel still
-	   allows to open the device in read-write mode but fails writes.
-	*/
-	if (fd != -1 && ioctl(fd, BLKROGET, &ro) == 0 && ro)
+	for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++)
+		if (strcmp(backends[i]->name, backend) == 0)
+			ops = backends[i];
+	if (ops == NULL)
 	{
-		close(fd);
-		errno = EROFS;
-		return -1;
+		exfat_error("unknown device backend '%s'", backend);
+		return NULL;
 	}
-#endif
-	return fd;
-}
-
-struct exfat_dev* exfat_open(const char* spec, enum exfat_mode mode)
-{
-	struct exfat_dev* dev;
-	struct stat stbuf;
-#ifdef USE_UBLIO
-	struct ublio_param up;
-#endif
 
 	/* The system allocates file descriptors sequentially. If we have been
 	   started with stdin (0), stdout (1) or stderr (2) closed, the system
@@ -112,215 +81,21 @@ struct exfat_dev* exfat_open(const char* spec, enum exfat_mode mode)
 		}
 	}
 
-	dev = malloc(sizeof(struct exfat_dev));
+	dev = ops->open(spec, mode);
 	if (dev == NULL)
-	{
-		exfat_error("failed to allocate memory for device structure");
-		return NULL;
-	}
-
-	switch (mode)
-	{
-	case EXFAT_MODE_RO:
-		dev->fd = open_ro(spec);
-		if (dev->fd == -1)
-		{
-			free(dev);
-			exfat_error("failed to open '%s' in read-only mode: %s", spec,
-					strerror(errno));
-			return NULL;
-		}
-		dev->mode = EXFAT_MODE_RO;
-		break;
-	case EXFAT_MODE_RW:
-		dev->fd = open_rw(spec);
-		if (dev->fd == -1)
-		{
-			free(dev);
-			exfat_error("failed to open '%s' in read-write mode: %s", spec,
-					strerror(errno));
-			return NULL;
-		}
-		dev->mode = EXFAT_MODE_RW;
-		break;
-	case EXFAT_MODE_ANY:
-		dev->fd = open_rw(spec);
-		if (dev->fd != -1)
-		{
-			dev->mode = EXFAT_MODE_RW;
-			break;
-		}
-		dev->fd = open_ro(spec);
-		if (dev->fd != -1)
-		{
-			dev->mode = EXFAT_MODE_RO;
-			exfat_warn("'%s' is write-protected, mounting read-only", spec);
-			break;
-		}
-		free(dev);
-		exfat_error("failed to open '%s': %s", spec, strerror(errno));
-		return NULL;
-	}
-
-	if (fstat(dev->fd, &stbuf) != 0)
-	{
-		close(dev->fd);
-		free(dev);
-		exfat_error("failed to fstat '%s'", spec);
-		return NULL;
-	}
-	if (!S_ISBLK(stbuf.st_mode) &&
-		!S_ISCHR(stbuf.st_mode) &&
-		!S_ISREG(stbuf.st_mode))
-	{
-		close(dev->fd);
-		free(dev);
-		exfat_error("'%s' is neither a device, nor a regular file", spec);
 		return NULL;
-	}
-
-#if defined(__APPLE__)
-	if (!S_ISREG(stbuf.st_mode))
-	{
-		uint32_t block_size = 0;
-		uint64_t blocks = 0;
-
-		if (ioctl(dev->fd, DKIOCGETBLOCKSIZE, &block_size) != 0)
-		{
-			close(dev->fd);
-			free(dev);
-			exfat_error("failed to get block size");
-			return NULL;
-		}
-		if (ioctl(dev->fd, DKIOCGETBLOCKCOUNT, &blocks) != 0)
-		{
-			close(dev->fd);
-			free(dev);
-			exfat_error("failed to get blocks count");
-			return NULL;
-		}
-		dev->size = blocks * block_size;
-	}
-	else
-#elif defined(__OpenBSD__)
-	if (!S_ISREG(stbuf.st_mode))
-	{
-		struct disklabel lab;
-		struct partition* pp;
-		char* partition;
-
-		if (ioctl(dev->fd, DIOCGDINFO, &lab) == -1)
-		{
-			close(dev->fd);
-			free(dev);
-			exfat_error("failed to get disklabel");
-			return NULL;
-		}
-
-		/* Don't need to check that partition letter is valid as we won't get
-		   this far otherwise. */
-		partition = strchr(spec, '\0') - 1;
-		pp = &(lab.d_partitions[*partition - 'a']);
-		dev->size = DL_GETPSIZE(pp) * lab.d_secsize;
-
-		if (pp->p_fstype != FS_NTFS)
-			exfat_warn("partition type is not 0x07 (NTFS/exFAT); "
-					"you can fix this with fdisk(8)");
-	}
-	else
-#elif defined(__NetBSD__)
-	if (!S_ISREG(stbuf.st_mode))
-	{
-		off_t size;
-
-		if (ioctl(dev->fd, DIOCGMEDIASIZE, &size) == -1)
-		{
-			close(dev->fd);
-			free(dev);
-			exfat_error("failed to get media size");
-			return NULL;
-		}
-		dev->size = size;
-	}
-	else
-#endif
-	{
-		/* works for Linux, FreeBSD, Solaris */
-		dev->size = exfat_seek(dev, 0, SEEK_END);
-		if (dev->size <= 0)
-		{
-			close(dev->fd);
-			free(dev);
-			exfat_error("failed to get size of '%s'", spec);
-			return NULL;
-		}
-		if (exfat_seek(dev, 0, SEEK_SET) == -1)
-		{
-			close(dev->fd);
-			free(dev);
-			exfat_error("failed to seek to the beginning of '%s'", spec);
-			return NULL;
-		}
-	}
-
-#ifdef USE_UBLIO
-	memset(&up, 0, sizeof(struct ublio_param));
-	up.up_blocksize = 256 * 1024;
-	up.up_items = 64;
-	up.up_grace = 32;
-	up.up_priv = &dev->fd;
-
 	dev->pos = 0;
-	dev->ufh = ublio_open(&up);
-	if (dev->ufh == NULL)
-	{
-		close(dev->fd);
-		free(dev);
-		exfat_error("failed to initialize ublio");
-		return NULL;
-	}
-#endif
-
 	return dev;
 }
 
 int exfat_close(struct exfat_dev* dev)
 {
-	int rc = 0;
-
-#ifdef USE_UBLIO
-	if (ublio_close(dev->ufh) != 0)
-	{
-		exfat_error("failed to close ublio");
-		rc = -EIO;
-	}
-#endif
-	if (close(dev->fd) != 0)
-	{
-		exfat_error("failed to close device: %s", strerror(errno));
-		rc = -EIO;
-	}
-	free(dev);
-	return rc;
+	return dev->ops->close(dev);
 }
 
 int exfat_fsync(struct exfat_dev* dev)
 {
-	int rc = 0;
-
-#ifdef USE_UBLIO
-	if (ublio_fsync(dev->ufh) != 0)
-	{
-		exfat_error("ublio fsync failed");
-		rc = -EIO;
-	}
-#endif
-	if (fsync(dev->fd) != 0)
-	{
-		exfat_error("fsync failed: %s", strerror(errno));
-		rc = -EIO;
-	}
-	return rc;
+	return dev->ops->fsync(dev);
 }
 
 enum exfat_mode exfat_get_mode(const struct exfat_dev* dev)
@@ -335,65 +110,174 @@ off_t exfat_get_size(const struct exfat_dev* dev)
 
 off_t exfat_seek(struct exfat_dev* dev, off_t offset, int whence)
 {
-#ifdef USE_UBLIO
-	/* XXX SEEK_CUR will be handled incorrectly */
-	return dev->pos = lseek(dev->fd, offset, whence);
-#else
-	return lseek(dev->fd, offset, whence);
-#endif
+	switch (whence)
+	{
+	case SEEK_SET:
+		break;
+	case SEEK_CUR:
+		offset += dev->pos;
+		break;
+	case SEEK_END:
+		offset += dev->size;
+		break;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+	if (offset < 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	return dev->pos = offset;
 }
 
 ssize_t exfat_read(struct exfat_dev* dev, void* buffer, size_t size)
 {
-#ifdef USE_UBLIO
-	ssize_t result = ublio_pread(dev->ufh, buffer, size, dev->pos);
-	if (result >= 0)
-		dev->pos += size;
+	ssize_t result = dev->ops->pread(dev, buffer, size, dev->pos);
+
+	if (result > 0)
+		dev->pos += result;
 	return result;
-#else
-	return read(dev->fd, buffer, size);
-#endif
 }
 
 ssize_t exfat_write(struct exfat_dev* dev, const void* buffer, size_t size)
 {
-#ifdef USE_UBLIO
-	ssize_t result = ublio_pwrite(dev->ufh, (void*) buffer, size, dev->pos);
-	if (result >= 0)
-		dev->pos += size;
+	ssize_t result = dev->ops->pwrite(dev, buffer, size, dev->pos);
+
+	if (result > 0)
+		dev->pos += result;
 	return result;
-#else
-	return write(dev->fd, buffer, size);
-#endif
 }
 
 ssize_t exfat_pread(struct exfat_dev* dev, void* buffer, size_t size,
 		off_t offset)
 {
-#ifdef USE_UBLIO
-	return ublio_pread(dev->ufh, buffer, size, offset);
-#else
-	return pread(dev->fd, buffer, size, offset);
-#endif
+	return dev->ops->pread(dev, buffer, size, offset);
 }
 
 ssize_t exfat_pwrite(struct exfat_dev* dev, const void* buffer, size_t size,
 		off_t offset)
 {
-#ifdef USE_UBLIO
-	return ublio_pwrite(dev->ufh, (void*) buffer, size, offset);
-#else
-	return pwrite(dev->fd, buffer, size, offset);
-#endif
+	return dev->ops->pwrite(dev, buffer, size, offset);
+}
+
+void exfat_batch_init(struct exfat_batch* batch, struct exfat_dev* dev,
+		bool write)
+{
+	batch->dev = dev;
+	batch->write = write;
+	batch->count = 0;
 }
 
-ssize_t exfat_generic_pread(const struct exfat* ef, struct exfat_node* node,
+int exfat_batch_add(struct exfat_batch* batch, const void* buffer,
+		size_t size, off_t offset)
+{
+	struct exfat_io* io;
+
+	if (batch->count == EXFAT_BATCH_SIZE)
+	{
+		int rc = exfat_batch_flush(batch);
+		if (rc != 0)
+			return rc;
+	}
+	io = &batch->ios[batch->count++];
+	io->buffer = (void*) buffer;
+	io->size = size;
+	io->offset = offset;
+	return 0;
+}
+
+static int transfer(struct exfat_dev* dev, const struct exfat_io* ios,
+		size_t count, bool write)
+{
+	size_t i;
+	ssize_t result;
+
+	for (i = 0; i < count; i++)
+	{
+		if (write)
+			result = exfat_pwrite(dev, ios[i].buffer, ios[i].size,
+					ios[i].offset);
+		else
+			result = exfat_pread(dev, ios[i].buffer, ios[i].size,
+					ios[i].offset);
+		if (result < 0)
+			return -errno;
+	}
+	return 0;
+}
+
+int exfat_batch_flush(struct exfat_batch* batch)
+{
+	int rc;
+
+	if (batch->count == 0)
+		return 0;
+	if (batch->dev->ops->transfer)
+		rc = batch->dev->ops->transfer(batch->dev, batch->ios, batch->count,
+				batch->write);
+	else
+		rc = transfer(batch->dev, batch->ios, batch->count, batch->write);
+	if (rc != 0)
+		exfat_error("failed to %s %zu blocks starting at %"PRId64": %s",
+				batch->write ? "write" : "read", batch->count,
+				batch->ios[0].offset, strerror(-rc));
+	batch->count = 0;
+	return rc;
+}
+
+/*
+ * Extend a transfer of *lsize bytes that starts in the specified cluster
+ * while the following clusters are physically adjacent to it, so that the
+ * whole run is transferred with one system call. Returns the cluster that
+ * follows the run.
+ */
+static cluster_t expand_run(struct exfat* ef, const struct exfat_node* node,
+		cluster_t cluster, off_t* lsize, off_t remainder)
+{
+	cluster_t next = exfat_next_cluster(ef, node, cluster);
+
+	while (*lsize < remainder && next == cluster + 1 &&
+			!CLUSTER_INVALID(*ef->sb, next))
+	{
+		*lsize += MIN(CLUSTER_SIZE(*ef->sb), remainder - *lsize);
+		cluster = next;
+		next = exfat_next_cluster(ef, node, cluster);
+	}
+	return next;
+}
+
+/*
+ * Directories are read and written through the blocks cache: entry sets are
+ * small and the same blocks are accessed over and over again. Regular files
+ * go straight to the device. With "through" directory data is also written
+ * to the device right away; other changes of the same blocks stay cached.
+ */
+static int transfer_run(struct exfat* ef, const struct exfat_node* node,
+		struct exfat_batch* batch, const void* buffer, size_t size,
+		off_t offset, bool through)
+{
+	int rc;
+
+	if (!(node->attrib & EXFAT_ATTRIB_DIR))
+		return exfat_batch_add(batch, buffer, size, offset);
+	if (!batch->write)
+		return exfat_blkcache_read(ef, (void*) buffer, size, offset);
+	rc = exfat_blkcache_write(ef, buffer, size, offset);
+	if (rc != 0 || !through || ef->blocks.max == 0)
+		return rc;
+	return exfat_batch_add(batch, buffer, size, offset);
+}
+
+static ssize_t generic_pread(struct exfat* ef, struct exfat_node* node,
 		void* buffer, size_t size, off_t offset)
 {
 	uint64_t uoffset = offset;
-	cluster_t cluster;
+	cluster_t cluster, next;
 	char* bufp = buffer;
 	off_t lsize, loffset, remainder;
+	struct exfat_batch batch;
 
 	if (offset < 0)
 		return -EINVAL;
@@ -408,7 +292,7 @@ ssize_t exfat_generic_pread(const struct exfat* ef, struct exfat_node* node,
 
 		if (uoffset < node->valid_size)
 		{
-			bytes = exfat_generic_pread(ef, node, buffer,
+			bytes = generic_pread(ef, node, buffer,
 					node->valid_size - uoffset, offset);
 			if (bytes < 0 || (size_t) bytes < node->valid_size - uoffset)
 				return bytes;
@@ -425,6 +309,7 @@ ssize_t exfat_generic_pread(const struct exfat* ef, struct exfat_node* node,
 		return -EIO;
 	}
 
+	exfat_batch_init(&batch, ef->dev, false);
 	loffset = uoffset % CLUSTER_SIZE(*ef->sb);
 	remainder = MIN(size, node->size - uoffset);
 	while (remainder > 0)
@@ -435,39 +320,204 @@ ssize_t exfat_generic_pread(const struct exfat* ef, struct exfat_node* node,
 			return -EIO;
 		}
 		lsize = MIN(CLUSTER_SIZE(*ef->sb) - loffset, remainder);
-		if (exfat_pread(ef->dev, bufp, lsize,
-					exfat_c2o(ef, cluster) + loffset) < 0)
-		{
-			exfat_error("failed to read cluster %#x", cluster);
+		next = expand_run(ef, node, cluster, &lsize, remainder);
+		if (transfer_run(ef, node, &batch, bufp, lsize,
+				exfat_c2o(ef, cluster) + loffset, false) != 0)
 			return -EIO;
-		}
 		bufp += lsize;
 		loffset = 0;
 		remainder -= lsize;
-		cluster = exfat_next_cluster(ef, node, cluster);
+		cluster = next;
 	}
+	if (exfat_batch_flush(&batch) != 0)
+		return -EIO;
 	if (!(node->attrib & EXFAT_ATTRIB_DIR) && !ef->ro && !ef->noatime)
 		exfat_update_atime(node);
 	return MIN(size, node->size - uoffset) - remainder;
 }
 
-ssize_t exfat_generic_pwrite(struct exfat* ef, struct exfat_node* node,
-		const void* buffer, size_t size, off_t offset)
+struct exfat_readahead
+{
+	off_t offset;				/* file offset of the buffered data */
+	size_t size;				/* buffered bytes, zero if none */
+	off_t next;					/* where a sequential read would start */
+	size_t window;				/* how much to read next time */
+	char* buffer;				/* of exfat.readahead bytes */
+};
+
+struct exfat_writeback
+{
+	off_t offset;				/* file offset of the buffered data */
+	size_t size;				/* buffered bytes, zero if none */
+	bool is_flushing;			/* the data is being written */
+	char* buffer;				/* of exfat.writeback bytes */
+};
+
+void exfat_invalidate_readahead(struct exfat_node* node)
+{
+	if (node->readahead != NULL)
+		node->readahead->size = 0;
+}
+
+void exfat_free_readahead(struct exfat_node* node)
+{
+	if (node->readahead == NULL)
+		return;
+	free(node->readahead->buffer);
+	free(node->readahead);
+	node->readahead = NULL;
+}
+
+static bool is_buffered(const struct exfat_node* node, size_t size,
+		off_t offset)
+{
+	const struct exfat_writeback* wb = node->writeback;
+
+	return wb != NULL && wb->size != 0 &&
+			offset < wb->offset + (off_t) wb->size &&
+			offset + (off_t) size > wb->offset;
+}
+
+static size_t copy_buffered(const struct exfat_readahead* ra, void* buffer,
+		size_t size, off_t offset)
+{
+	if (offset < ra->offset || offset >= ra->offset + (off_t) ra->size)
+		return 0;
+	size = MIN(size, ra->offset + ra->size - offset);
+	memcpy(buffer, ra->buffer + (offset - ra->offset), size);
+	return size;
+}
+
+/*
+ * Reads into the readahead buffer [offset, offset + window) rounded up to a
+ * cluster boundary, then copies the requested part. Returns the number of
+ * bytes copied.
+ */
+static ssize_t fill_readahead(struct exfat* ef, struct exfat_node* node,
+		void* buffer, size_t size, off_t offset)
+{
+	struct exfat_readahead* ra = node->readahead;
+	uint64_t end;
+	ssize_t rc;
+
+	if (ra->buffer == NULL)
+	{
+		ra->buffer = malloc(ef->readahead);
+		if (ra->buffer == NULL)
+			return generic_pread(ef, node, buffer, size, offset);
+	}
+	/* the window doubles with every sequential read that misses the
+	   buffer */
+	ra->window = MIN(MAX(ra->window * 2, size * 2), ef->readahead);
+	end = ROUND_UP(offset + ra->window, CLUSTER_SIZE(*ef->sb));
+	end = MIN(MIN(end, offset + ef->readahead), node->size);
+
+	ra->size = 0;
+	rc = generic_pread(ef, node, ra->buffer, end - offset, offset);
+	if (rc <= 0)
+		return rc;
+	ra->offset = offset;
+	ra->size = rc;
+	return copy_buffered(ra, buffer, size, offset);
+}
+
+/*
+ * Sequential reads of regular files are served from a per-node buffer that
+ * is filled with large device reads, regardless of how small the requests
+ * are. Random reads go straight to the device.
+ */
+static ssize_t readahead_pread(struct exfat* ef, struct exfat_node* node,
+		void* buffer, size_t size, off_t offset)
+{
+	struct exfat_readahead* ra = node->readahead;
+	size_t copied;
+	ssize_t rc;
+
+	if (offset < 0 || (uint64_t) offset >= node->size || size == 0)
+		return generic_pread(ef, node, buffer, size, offset);
+	size = MIN(size, node->size - offset);
+
+	if (ra == NULL)
+	{
+		/* a file read from the beginning is considered sequential */
+		ra = calloc(1, sizeof(struct exfat_readahead));
+		if (ra == NULL)
+			return generic_pread(ef, node, buffer, size, offset);
+		node->readahead = ra;
+	}
+	if (offset != ra->next)
+	{
+		ra->window = 0;
+		rc = generic_pread(ef, node, buffer, size, offset);
+		if (rc > 0)
+			ra->next = offset + rc;
+		return rc;
+	}
+
+	copied = copy_buffered(ra, buffer, size, offset);
+	if (copied == size)
+	{
+		if (!ef->ro && !ef->noatime)
+			exfat_update_atime(node);
+	}
+	else if (size - copied >= ef->readahead)
+	{
+		/* the request itself is larger than the window */
+		rc = generic_pread(ef, node, (char*) buffer + copied, size - copied,
+				offset + copied);
+		if (rc < 0)
+			return rc;
+		copied += rc;
+	}
+	else
+	{
+		rc = fill_readahead(ef, node, (char*) buffer + copied, size - copied,
+				offset + copied);
+		if (rc < 0)
+			return rc;
+		copied += rc;
+	}
+	ra->next = offset + copied;
+	return copied;
+}
+
+ssize_t exfat_generic_pread(struct exfat* ef, struct exfat_node* node,
+		void* buffer, size_t size, off_t offset)
+{
+	ssize_t rc;
+
+	pthread_mutex_lock(&node->lock);
+	/* buffered data is newer than the device */
+	if (is_buffered(node, size, offset))
+	{
+		rc = exfat_flush_writeback(ef, node);
+		if (rc != 0)
+		{
+			pthread_mutex_unlock(&node->lock);
+			return rc;
+		}
+	}
+	if (ef->readahead != 0 && !(node->attrib & EXFAT_ATTRIB_DIR))
+		rc = readahead_pread(ef, node, buffer, size, offset);
+	else
+		rc = generic_pread(ef, node, buffer, size, offset);
+	pthread_mutex_unlock(&node->lock);
+	return rc;
+}
+
+static ssize_t generic_pwrite(struct exfat* ef, struct exfat_node* node,
+		const void* buffer, size_t size, off_t offset, bool through)
 {
 	uint64_t uoffset = offset;
 	int rc;
-	cluster_t cluster;
+	cluster_t cluster, next;
 	const char* bufp = buffer;
 	off_t lsize, loffset, remainder;
+	struct exfat_batch batch;
 
 	if (offset < 0)
 		return -EINVAL;
-	if (uoffset > node->size)
-	{
-		rc = exfat_truncate(ef, node, uoffset, true);
-		if (rc != 0)
-			return rc;
-	}
+	exfat_invalidate_readahead(node);
 	if (uoffset + size > node->size)
 	{
 		rc = exfat_truncate(ef, node, uoffset + size, false);
@@ -476,6 +526,11 @@ ssize_t exfat_generic_pwrite(struct exfat* ef, struct exfat_node* node,
 	}
 	if (size == 0)
 		return 0;
+	/* data between valid_size and offset (e.g. preallocated space) must be
+	   zeroed, otherwise it will become valid together with the new data */
+	rc = exfat_extend_valid_size(ef, node, uoffset);
+	if (rc != 0)
+		return rc;
 
 	cluster = exfat_advance_cluster(ef, node, uoffset / CLUSTER_SIZE(*ef->sb));
 	if (CLUSTER_INVALID(*ef->sb, cluster))
@@ -484,6 +539,7 @@ ssize_t exfat_generic_pwrite(struct exfat* ef, struct exfat_node* node,
 		return -EIO;
 	}
 
+	exfat_batch_init(&batch, ef->dev, true);
 	loffset = uoffset % CLUSTER_SIZE(*ef->sb);
 	remainder = size;
 	while (remainder > 0)
@@ -494,21 +550,162 @@ ssize_t exfat_generic_pwrite(struct exfat* ef, struct exfat_node* node,
 			return -EIO;
 		}
 		lsize = MIN(CLUSTER_SIZE(*ef->sb) - loffset, remainder);
-		if (exfat_pwrite(ef->dev, bufp, lsize,
-				exfat_c2o(ef, cluster) + loffset) < 0)
-		{
-			exfat_error("failed to write cluster %#x", cluster);
+		next = expand_run(ef, node, cluster, &lsize, remainder);
+		if (transfer_run(ef, node, &batch, bufp, lsize,
+				exfat_c2o(ef, cluster) + loffset, through) != 0)
 			return -EIO;
-		}
 		bufp += lsize;
 		loffset = 0;
 		remainder -= lsize;
-		node->valid_size = MAX(node->valid_size, uoffset + size - remainder);
-		cluster = exfat_next_cluster(ef, node, cluster);
+		cluster = next;
 	}
+	if (exfat_batch_flush(&batch) != 0)
+		return -EIO;
+	node->valid_size = MAX(node->valid_size, uoffset + size);
 	if (!(node->attrib & EXFAT_ATTRIB_DIR))
 		/* directory's mtime should be updated by the caller only when it
 		   creates or removes something in this directory */
 		exfat_update_mtime(node);
 	return size - remainder;
 }
+
+/*
+ * The buffer is emptied only when its data is written. On error the data
+ * stays buffered, so that the next flush (fsync, close) tries again and
+ * reports the error again.
+ */
+int exfat_flush_writeback(struct exfat* ef, struct exfat_node* node)
+{
+	struct exfat_writeback* wb;
+	time_t mtime;
+	ssize_t rc;
+
+	pthread_mutex_lock(&node->lock);
+	wb = node->writeback;
+	/* writing the data can resize the file, and resizing flushes the
+	   buffer */
+	if (wb == NULL || wb->size == 0 || wb->is_flushing)
+	{
+		pthread_mutex_unlock(&node->lock);
+		return 0;
+	}
+	wb->is_flushing = true;
+	/* mtime was updated when the data was buffered and could have been
+	   set explicitly since then */
+	mtime = node->mtime;
+	rc = generic_pwrite(ef, node, wb->buffer, wb->size, wb->offset,
+			false);
+	node->mtime = mtime;
+	wb->is_flushing = false;
+	if (rc >= 0 && (size_t) rc != wb->size)
+	{
+		exfat_error("failed to write back %zu bytes at %"PRId64, wb->size,
+				wb->offset);
+		rc = -EIO;
+	}
+	if (rc >= 0)
+	{
+		wb->size = 0;
+		rc = 0;
+	}
+	pthread_mutex_unlock(&node->lock);
+	return rc;
+}
+
+void exfat_free_writeback(struct exfat_node* node)
+{
+	if (node->writeback == NULL)
+		return;
+	free(node->writeback->buffer);
+	free(node->writeback);
+	node->writeback = NULL;
+}
+
+/*
+ * Small writes to a regular file are collected in a per-node buffer as long
+ * as they continue or overwrite the buffered range. The buffer goes to the
+ * device as a whole: when a write does not fit into it, when the buffered
+ * range is read, truncated or flushed with the node.
+ */
+static ssize_t buffered_pwrite(struct exfat* ef, struct exfat_node* node,
+		const void* buffer, size_t size, off_t offset)
+{
+	struct exfat_writeback* wb = node->writeback;
+	int rc;
+
+	if (offset < 0)
+		return -EINVAL;
+	if (wb != NULL && wb->size != 0 &&
+			(offset < wb->offset || offset > wb->offset + (off_t) wb->size ||
+			offset + size > wb->offset + ef->writeback))
+	{
+		rc = exfat_flush_writeback(ef, node);
+		if (rc != 0)
+			return rc;
+	}
+	if (size == 0 || size >= ef->writeback)
+		return generic_pwrite(ef, node, buffer, size, offset, false);
+
+	if (wb == NULL)
+	{
+		wb = calloc(1, sizeof(struct exfat_writeback));
+		if (wb == NULL)
+			return generic_pwrite(ef, node, buffer, size, offset, false);
+		wb->buffer = malloc(ef->writeback);
+		if (wb->buffer == NULL)
+		{
+			free(wb);
+			return generic_pwrite(ef, node, buffer, size, offset, false);
+		}
+		node->writeback = wb;
+	}
+
+	/* clusters are allocated right away: this way the file size is always
+	   up to date and running out of space is reported by the write itself;
+	   the data past valid_size is not accessed until the buffer is
+	   written */
+	if (offset + size > node->size)
+	{
+		rc = exfat_truncate(ef, node, offset + size, false);
+		if (rc != 0)
+			return rc;
+	}
+	exfat_invalidate_readahead(node);
+	if (wb->size == 0)
+		wb->offset = offset;
+	memcpy(wb->buffer + (offset - wb->offset), buffer, size);
+	wb->size = MAX(wb->size, offset - wb->offset + size);
+	exfat_update_mtime(node);
+	return size;
+}
+
+ssize_t exfat_generic_pwrite(struct exfat* ef, struct exfat_node* node,
+		const void* buffer, size_t size, off_t offset)
+{
+	ssize_t rc;
+
+	pthread_mutex_lock(&node->lock);
+	if (ef->writeback != 0 && !(node->attrib & EXFAT_ATTRIB_DIR))
+		rc = buffered_pwrite(ef, node, buffer, size, offset);
+	else
+		rc = generic_pwrite(ef, node, buffer, size, offset, false);
+	pthread_mutex_unlock(&node->lock);
+	return rc;
+}
+
+/*
+ * Writes directory data both into the blocks cache and to the device, see
+ * transfer_run().
+ */
+ssize_t exfat_generic_pwrite_through(struct exfat* ef, struct exfat_node* node,
+		const void* buffer, size_t size, off_t offset)
+{
+	ssize_t rc;
+
+	if (!(node->attrib & EXFAT_ATTRIB_DIR))
+		exfat_bug("attempted to write through a file");
+	pthread_mutex_lock(&node->lock);
+	rc = generic_pwrite(ef, node, buffer, size, offset, true);
+	pthread_mutex_unlock(&node->lock);
+	return rc;
+}
@@ -77,6 +77,20 @@ static int compare_name(struct exfat* ef, const le16_t* a, const le16_t* b)
 	return compare_char(ef, le16_to_cpu(*a), le16_to_cpu(*b));
 }
 
+static struct exfat_node* lookup_hashed(struct exfat* ef,
+		const struct exfat_node* dir, const le16_t* name)
+{
+	const uint16_t hash = le16_to_cpu(exfat_calc_name_hash(ef, name,
+			exfat_utf16_length(name)));
+	struct exfat_node* node;
+
+	for (node = dir->hash_table[hash & (dir->hash_buckets - 1)]; node;
+			node = node->hash_next)
+		if (node->name_hash == hash && compare_name(ef, name, node->name) == 0)
+			return exfat_get_node(node);
+	return NULL;
+}
+
 static int lookup_name(struct exfat* ef, struct exfat_node* parent,
 		struct exfat_node** node, const char* name, size_t n)
 {
@@ -90,20 +104,28 @@ static int lookup_name(struct exfat* ef, struct exfat_node* parent,
 	if (rc != 0)
 		return rc;
 
+	if (exfat_dcache_lookup(ef, parent, buffer, node))
+	{
+		exfat_touch_directory(ef, parent);
+		return *node != NULL ? 0 : -ENOENT;
+	}
+
 	rc = exfat_opendir(ef, parent, &it);
 	if (rc != 0)
 		return rc;
-	while ((*node = exfat_readdir(&it)))
-	{
-		if (compare_name(ef, buffer, (*node)->name) == 0)
+	if (parent->hash_table != NULL)
+		*node = lookup_hashed(ef, parent, buffer);
+	else
+		while ((*node = exfat_readdir(&it)))
 		{
-			exfat_closedir(ef, &it);
-			return 0;
+			if (compare_name(ef, buffer, (*node)->name) == 0)
+				break;
+			exfat_put_node(ef, *node);
 		}
-		exfat_put_node(ef, *node);
-	}
+	/* negative results are cached too */
+	exfat_dcache_insert(ef, parent, buffer, *node);
 	exfat_closedir(ef, &it);
-	return -ENOENT;
+	return *node != NULL ? 0 : -ENOENT;
 }
 
 static size_t get_comp(const char* path, const char** comp)
@@ -144,6 +166,14 @@ int exfat_lookup(struct exfat* ef, struct exfat_node** node,
 	return 0;
 }
 
+int exfat_lookup_name(struct exfat* ef, struct exfat_node* parent,
+		struct exfat_node** node, const char* name)
+{
+	if (!(parent->attrib & EXFAT_ATTRIB_DIR))
+		return -ENOTDIR;
+	return lookup_name(ef, parent, node, name, strlen(name));
+}
+
 static bool is_last_comp(const char* comp, size_t length)
 {
 	const char* p = comp + length;
@@ -173,6 +203,26 @@ static bool is_allowed(const char* comp, size_t length)
 	return true;
 }
 
+static int split_name(struct exfat* ef, struct exfat_node* parent,
+		struct exfat_node** node, le16_t* name, const char* comp, size_t n)
+{
+	int rc;
+
+	if (!is_allowed(comp, n))
+	{
+		/* contains characters that are not allowed */
+		return -ENOENT;
+	}
+	rc = exfat_utf8_to_utf16(name, comp, EXFAT_NAME_MAX + 1, n);
+	if (rc != 0)
+		return rc;
+
+	rc = lookup_name(ef, parent, node, comp, n);
+	if (rc != 0 && rc != -ENOENT)
+		return rc;
+	return 0;
+}
+
 int exfat_split(struct exfat* ef, struct exfat_node** parent,
 		struct exfat_node** node, le16_t* name, const char* path)
 {
@@ -188,26 +238,10 @@ int exfat_split(struct exfat* ef, struct exfat_node** parent,
 			continue;
 		if (is_last_comp(p, n))
 		{
-			if (!is_allowed(p, n))
-			{
-				/* contains characters that are not allowed */
-				exfat_put_node(ef, *parent);
-				return -ENOENT;
-			}
-			rc = exfat_utf8_to_utf16(name, p, EXFAT_NAME_MAX + 1, n);
+			rc = split_name(ef, *parent, node, name, p, n);
 			if (rc != 0)
-			{
 				exfat_put_node(ef, *parent);
-				return rc;
-			}
-
-			rc = lookup_name(ef, *parent, node, p, n);
-			if (rc != 0 && rc != -ENOENT)
-			{
-				exfat_put_node(ef, *parent);
-				return rc;
-			}
-			return 0;
+			return rc;
 		}
 		rc = lookup_name(ef, *parent, node, p, n);
 		if (rc != 0)
@@ -220,3 +254,13 @@ int exfat_split(struct exfat* ef, struct exfat_node** parent,
 	}
 	exfat_bug("impossible");
 }
+
+int exfat_split_name(struct exfat* ef, struct exfat_node* dir,
+		struct exfat_node** node, le16_t* name, const char* comp)
+{
+	memset(name, 0, (EXFAT_NAME_MAX + 1) * sizeof(le16_t));
+	*node = NULL;
+	if (!(dir->attrib & EXFAT_ATTRIB_DIR))
+		return -ENOTDIR;
+	return split_name(ef, dir, node, name, comp, strlen(comp));
+}
@@ -0,0 +1,160 @@
+/*
+	mmapdev.c (16.10.26)
+	Block device backend that maps the whole device into memory.
+
+	Free exFAT implementation.
+	Copyright (C) 2010-2023  Andrew Nayenko
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "device.h"
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+struct mmap_dev
+{
+	struct exfat_dev dev;
+	int fd;
+	char* map;
+};
+
+static struct exfat_dev* mmap_open(const char* spec, enum exfat_mode mode)
+{
+	struct mmap_dev* mdev;
+	int prot;
+
+	mdev = malloc(sizeof(struct mmap_dev));
+	if (mdev == NULL)
+	{
+		exfat_error("failed to allocate memory for device structure");
+		return NULL;
+	}
+
+	mdev->fd = exfat_open_fd(spec, &mode, &mdev->dev.size);
+	if (mdev->fd == -1)
+	{
+		free(mdev);
+		return NULL;
+	}
+	mdev->dev.ops = &exfat_mmap_dev_ops;
+	mdev->dev.mode = mode;
+
+	if ((uint64_t) mdev->dev.size > SIZE_MAX)
+	{
+		close(mdev->fd);
+		free(mdev);
+		exfat_error("'%s' is too big to be mapped into memory", spec);
+		return NULL;
+	}
+	prot = PROT_READ;
+	if (mode == EXFAT_MODE_RW)
+		prot |= PROT_WRITE;
+	mdev->map = mmap(NULL, mdev->dev.size, prot, MAP_SHARED, mdev->fd, 0);
+	if (mdev->map == MAP_FAILED)
+	{
+		close(mdev->fd);
+		free(mdev);
+		exfat_error("failed to map '%s': %s", spec, strerror(errno));
+		return NULL;
+	}
+
+	return &mdev->dev;
+}
+
+static int mmap_close(struct exfat_dev* dev)
+{
+	struct mmap_dev* mdev = (struct mmap_dev*) dev;
+	int rc = 0;
+
+	if (munmap(mdev->map, dev->size) != 0)
+	{
+		exfat_error("failed to unmap device: %s", strerror(errno));
+		rc = -EIO;
+	}
+	if (close(mdev->fd) != 0)
+	{
+		exfat_error("failed to close device: %s", strerror(errno));
+		rc = -EIO;
+	}
+	free(mdev);
+	return rc;
+}
+
+static int mmap_fsync(struct exfat_dev* dev)
+{
+	struct mmap_dev* mdev = (struct mmap_dev*) dev;
+
+	if (msync(mdev->map, dev->size, MS_SYNC) != 0)
+	{
+		exfat_error("msync failed: %s", strerror(errno));
+		return -EIO;
+	}
+	if (fsync(mdev->fd) != 0)
+	{
+		exfat_error("fsync failed: %s", strerror(errno));
+		return -EIO;
+	}
+	return 0;
+}
+
+static ssize_t mmap_pread(struct exfat_dev* dev, void* buffer, size_t size,
+		off_t offset)
+{
+	struct mmap_dev* mdev = (struct mmap_dev*) dev;
+
+	if (offset < 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	size = exfat_dev_clip(dev, size, offset);
+	memcpy(buffer, mdev->map + offset, size);
+	return size;
+}
+
+static ssize_t mmap_pwrite(struct exfat_dev* dev, const void* buffer,
+		size_t size, off_t offset)
+{
+	struct mmap_dev* mdev = (struct mmap_dev*) dev;
+
+	if (dev->mode != EXFAT_MODE_RW)
+	{
+		errno = EBADF;
+		return -1;
+	}
+	if (offset < 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	size = exfat_dev_clip(dev, size, offset);
+	memcpy(mdev->map + offset, buffer, size);
+	return size;
+}
+
+const struct exfat_dev_ops exfat_mmap_dev_ops =
+{
+	.name	= "mmap",
+	.open	= mmap_open,
+	.close	= mmap_close,
+	.fsync	= mmap_fsync,
+	.pread	= mmap_pread,
+	.pwrite	= mmap_pwrite,
+};
@@ -28,7 +28,7 @@
 #include <unistd.h>
 #include <sys/types.h>
 
-static uint64_t rootdir_size(const struct exfat* ef)
+static uint64_t rootdir_size(struct exfat* ef)
 {
 	uint32_t clusters = 0;
 	uint32_t clusters_max = le32_to_cpu(ef->sb->cluster_count);
@@ -79,6 +79,16 @@ static int get_int_option(const char* options, const char* option_name,
 	return strtol(p, NULL, base);
 }
 
+static void get_string_option(const char* options, const char* option_name,
+		char* buffer, size_t size, const char* default_value)
+{
+	const char* p = get_option(options, option_name);
+
+	if (p == NULL)
+		p = default_value;
+	snprintf(buffer, size, "%.*s", (int) strcspn(p, ","), p);
+}
+
 static void parse_options(struct exfat* ef, const char* options)
 {
 	int opt_umask;
@@ -91,6 +101,10 @@ static void parse_options(struct exfat* ef, const char* options)
 	ef->gid = get_int_option(options, "gid", 10, getegid());
 
 	ef->noatime = exfat_match_option(options, "noatime");
+	ef->readahead = (size_t) get_int_option(options, "readahead", 10,
+			EXFAT_READAHEAD_SIZE / 1024) * 1024;
+	ef->writeback = (size_t) get_int_option(options, "writeback", 10,
+			EXFAT_WRITEBACK_SIZE / 1024) * 1024;
 
 	switch (get_int_option(options, "repair", 10, 0))
 	{
@@ -168,25 +182,40 @@ static void exfat_free(struct exfat* ef)
 {
 	exfat_close(ef->dev);	/* first of all, close the descriptor */
 	ef->dev = NULL;			/* struct exfat_dev is freed by exfat_close() */
-	free(ef->root);
+	if (ef->root != NULL)
+		exfat_free_node(ef, ef->root);
 	ef->root = NULL;
+	exfat_free_nodes(ef);
 	free(ef->zero_cluster);
 	ef->zero_cluster = NULL;
-	free(ef->cmap.chunk);
-	ef->cmap.chunk = NULL;
+	exfat_free_fat(ef);
+	exfat_free_blkcache(ef);
+	exfat_free_dcache(ef);
+	exfat_free_cmap(ef);
 	free(ef->upcase);
 	ef->upcase = NULL;
 	free(ef->sb);
 	ef->sb = NULL;
+	pthread_mutex_destroy(&ef->nodes.lock);
+	pthread_mutex_destroy(&ef->dentries.lock);
+	pthread_mutex_destroy(&ef->blocks.lock);
+	pthread_mutex_destroy(&ef->fat.lock);
+	pthread_mutex_destroy(&ef->cmap.lock);
 }
 
 int exfat_mount(struct exfat* ef, const char* spec, const char* options)
 {
 	int rc;
 	enum exfat_mode mode;
+	char backend[16];
 
 	exfat_tzset();
 	memset(ef, 0, sizeof(struct exfat));
+	pthread_mutex_init(&ef->cmap.lock, NULL);
+	pthread_mutex_init(&ef->fat.lock, NULL);
+	pthread_mutex_init(&ef->blocks.lock, NULL);
+	pthread_mutex_init(&ef->dentries.lock, NULL);
+	pthread_mutex_init(&ef->nodes.lock, NULL);
 
 	parse_options(ef, options);
 
@@ -196,7 +225,8 @@ int exfat_mount(struct exfat* ef, const char* spec, const char* options)
 		mode = EXFAT_MODE_ANY;
 	else
 		mode = EXFAT_MODE_RW;
-	ef->dev = exfat_open(spec, mode);
+	get_string_option(options, "backend", backend, sizeof(backend), "posix");
+	ef->dev = exfat_open_backend(spec, mode, backend);
 	if (ef->dev == NULL)
 		return -ENODEV;
 	if (exfat_get_mode(ef->dev) == EXFAT_MODE_RO)
@@ -293,14 +323,40 @@ int exfat_mount(struct exfat* ef, const char* spec, const char* options)
 	if (le16_to_cpu(ef->sb->volume_state) & EXFAT_STATE_MOUNTED)
 		exfat_warn("volume was not unmounted cleanly");
 
-	ef->root = malloc(sizeof(struct exfat_node));
+	rc = exfat_init_fat(ef, (size_t) get_int_option(options, "fatcache", 10,
+			EXFAT_FAT_CACHE_SIZE / 1024) * 1024);
+	if (rc != 0)
+	{
+		exfat_free(ef);
+		return rc;
+	}
+	/* the bitmap itself is found in the root directory */
+	ef->cmap.max = (size_t) get_int_option(options, "bitmapcache", 10,
+			EXFAT_CMAP_CACHE_SIZE / 1024) * 1024 / EXFAT_CMAP_PAGE_SIZE;
+	rc = exfat_init_blkcache(ef, (size_t) get_int_option(options, "blkcache",
+			10, EXFAT_BLOCK_CACHE_SIZE / 1024) * 1024);
+	if (rc != 0)
+	{
+		exfat_free(ef);
+		return rc;
+	}
+	ef->nodes.max = (size_t) get_int_option(options, "nodecache", 10,
+			EXFAT_NODE_CACHE_SIZE / 1024) * 1024 / sizeof(struct exfat_node);
+	ef->nodes.threshold = ef->nodes.max;
+	rc = exfat_init_dcache(ef, (size_t) get_int_option(options, "dcache",
+			10, EXFAT_DENTRY_CACHE_SIZE / 1024) * 1024);
+	if (rc != 0)
+	{
+		exfat_free(ef);
+		return rc;
+	}
+
+	ef->root = exfat_allocate_node(ef);
 	if (ef->root == NULL)
 	{
-		exfat_error("failed to allocate root node");
 		exfat_free(ef);
 		return -ENOMEM;
 	}
-	memset(ef->root, 0, sizeof(struct exfat_node));
 	ef->root->attrib = EXFAT_ATTRIB_DIR;
 	ef->root->start_cluster = le32_to_cpu(ef->sb->rootdir_cluster);
 	ef->root->fptr_cluster = ef->root->start_cluster;
@@ -325,7 +381,7 @@ int exfat_mount(struct exfat* ef, const char* spec, const char* options)
 		exfat_error("upcase table is not found");
 		goto error;
 	}
-	if (ef->cmap.chunk == NULL)
+	if (ef->cmap.free == NULL)
 	{
 		exfat_error("clusters bitmap is not found");
 		goto error;
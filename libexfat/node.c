@@ -27,26 +27,231 @@
 
 #define EXFAT_ENTRY_NONE (-1)
 
+/* directory contents are scanned in chunks of this size */
+#define DIR_READ_SIZE (64 * 1024)
+
+struct dir_reader
+{
+	char* buffer;
+	off_t offset;			/* directory offset of the buffer */
+	size_t size;			/* bytes read into the buffer */
+};
+
+/* nodes are allocated from slabs of this many nodes */
+#define SLAB_NODES 256
+
+struct exfat_node_slab
+{
+	struct exfat_node_slab* next;
+	struct exfat_node nodes[SLAB_NODES];
+};
+
+/*
+ * Takes a node from the free list refilling it with a new slab if needed.
+ */
+static struct exfat_node* take_node(struct exfat* ef)
+{
+	struct exfat_node* node;
+
+	pthread_mutex_lock(&ef->nodes.lock);
+	if (ef->nodes.free == NULL)
+	{
+		struct exfat_node_slab* slab = malloc(sizeof(struct exfat_node_slab));
+		int i;
+
+		if (slab == NULL)
+		{
+			pthread_mutex_unlock(&ef->nodes.lock);
+			return NULL;
+		}
+		for (i = 0; i < SLAB_NODES; i++)
+		{
+			slab->nodes[i].next = ef->nodes.free;
+			ef->nodes.free = &slab->nodes[i];
+		}
+		slab->next = ef->nodes.slabs;
+		ef->nodes.slabs = slab;
+	}
+	node = ef->nodes.free;
+	ef->nodes.free = node->next;
+	ef->nodes.count++;
+	pthread_mutex_unlock(&ef->nodes.lock);
+	return node;
+}
+
+/*
+ * Cached directories list helpers, nodes.lock must be held.
+ */
+static bool lru_contains(const struct exfat* ef, const struct exfat_node* dir)
+{
+	return dir->lru_prev != NULL || ef->nodes.head == dir;
+}
+
+static void lru_remove(struct exfat* ef, struct exfat_node* dir)
+{
+	if (dir->lru_prev)
+		dir->lru_prev->lru_next = dir->lru_next;
+	else
+		ef->nodes.head = dir->lru_next;
+	if (dir->lru_next)
+		dir->lru_next->lru_prev = dir->lru_prev;
+	else
+		ef->nodes.tail = dir->lru_prev;
+	dir->lru_prev = dir->lru_next = NULL;
+	ef->nodes.directories--;
+}
+
+static void lru_insert(struct exfat* ef, struct exfat_node* dir)
+{
+	dir->lru_prev = NULL;
+	dir->lru_next = ef->nodes.head;
+	if (ef->nodes.head)
+		ef->nodes.head->lru_prev = dir;
+	else
+		ef->nodes.tail = dir;
+	ef->nodes.head = dir;
+	ef->nodes.directories++;
+}
+
+/*
+ * Moves a cached directory to the head of the list or adds it there.
+ */
+void exfat_touch_directory(struct exfat* ef, struct exfat_node* dir)
+{
+	/* the root directory holds the bitmap and upcase table entries, which
+	   are set up once per mount, so it is never evicted */
+	if (dir == ef->root)
+		return;
+	pthread_mutex_lock(&ef->nodes.lock);
+	if (ef->nodes.head != dir)
+	{
+		if (lru_contains(ef, dir))
+			lru_remove(ef, dir);
+		lru_insert(ef, dir);
+	}
+	pthread_mutex_unlock(&ef->nodes.lock);
+}
+
+static void lru_forget(struct exfat* ef, struct exfat_node* dir)
+{
+	pthread_mutex_lock(&ef->nodes.lock);
+	if (lru_contains(ef, dir))
+		lru_remove(ef, dir);
+	pthread_mutex_unlock(&ef->nodes.lock);
+}
+
+struct exfat_node* exfat_allocate_node(struct exfat* ef)
+{
+	struct exfat_node* node = take_node(ef);
+	pthread_mutexattr_t attr;
+
+	if (node == NULL)
+	{
+		exfat_error("failed to allocate node");
+		return NULL;
+	}
+	memset(node, 0, sizeof(struct exfat_node));
+	node->name = node->inline_name;
+
+	/* node functions call each other, so the lock must be recursive */
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&node->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	return node;
+}
+
+void exfat_free_node(struct exfat* ef, struct exfat_node* node)
+{
+	free(node->hash_table);
+	free(node->slots);
+	if (node->name != node->inline_name)
+		free(node->name);
+	exfat_free_extents(node);
+	exfat_free_readahead(node);
+	exfat_free_writeback(node);
+	pthread_mutex_destroy(&node->lock);
+
+	pthread_mutex_lock(&ef->nodes.lock);
+	if (lru_contains(ef, node))
+		lru_remove(ef, node);
+	node->next = ef->nodes.free;
+	ef->nodes.free = node;
+	ef->nodes.count--;
+	pthread_mutex_unlock(&ef->nodes.lock);
+}
+
+/*
+ * Releases memory of all nodes at once, including the ones that are still
+ * in use (e.g. unlinked but open files on unmount).
+ */
+void exfat_free_nodes(struct exfat* ef)
+{
+	struct exfat_node_slab* slab;
+
+	while ((slab = ef->nodes.slabs) != NULL)
+	{
+		ef->nodes.slabs = slab->next;
+		free(slab);
+	}
+	ef->nodes.free = NULL;
+	ef->nodes.count = 0;
+}
+
+/*
+ * Allocates memory for a name of the specified length unless it fits into
+ * the node itself (then buffer is set to NULL). This is split from
+ * set_name() so that an operation could fail before it changes anything.
+ */
+static int allocate_name(le16_t** buffer, size_t length)
+{
+	*buffer = NULL;
+	if (length <= EXFAT_INLINE_NAME_MAX)
+		return 0;
+	*buffer = malloc((length + 1) * sizeof(le16_t));
+	if (*buffer == NULL)
+	{
+		exfat_error("failed to allocate name of %zu characters", length);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+static void set_name(struct exfat_node* node, le16_t* buffer,
+		const le16_t* name, size_t length)
+{
+	if (node->name != node->inline_name)
+		free(node->name);
+	node->name = buffer != NULL ? buffer : node->inline_name;
+	memcpy(node->name, name, length * sizeof(le16_t));
+	node->name[length] = cpu_to_le16(0);
+}
+
 struct exfat_node* exfat_get_node(struct exfat_node* node)
 {
-	/* if we switch to multi-threaded mode we will need atomic
-	   increment here and atomic decrement in exfat_put_node() */
-	node->references++;
+	ATOMIC_ADD(&node->references, 1);
 	return node;
 }
 
 void exfat_put_node(struct exfat* ef, struct exfat_node* node)
 {
 	char buffer[EXFAT_UTF8_NAME_BUFFER_MAX];
+	int references = ATOMIC_SUB(&node->references, 1);
 
-	--node->references;
-	if (node->references < 0)
+	if (references < 0)
 	{
 		exfat_get_name(node, buffer);
 		exfat_bug("reference counter of '%s' is below zero", buffer);
 	}
-	else if (node->references == 0 && node != ef->root)
+	else if (references == 0 && node != ef->root && !node->is_unlinked)
 	{
+		/* the file is not open anymore, release its buffers; buffered data
+		   makes the node dirty and is kept until the node is flushed */
+		pthread_mutex_lock(&node->lock);
+		exfat_free_readahead(node);
+		if (!node->is_dirty)
+			exfat_free_writeback(node);
+		pthread_mutex_unlock(&node->lock);
 		if (node->is_dirty)
 		{
 			exfat_get_name(node, buffer);
@@ -55,6 +260,42 @@ void exfat_put_node(struct exfat* ef, struct exfat_node* node)
 	}
 }
 
+void exfat_open_node(struct exfat_node* node)
+{
+	ATOMIC_ADD(&node->opens, 1);
+}
+
+/*
+ * A node can stay referenced long after it was closed (e.g. by the kernel
+ * lookup count), but its readahead and write-back buffers are only needed
+ * while it is open.
+ */
+void exfat_close_node(struct exfat* ef, struct exfat_node* node)
+{
+	char buffer[EXFAT_UTF8_NAME_BUFFER_MAX];
+	int opens = ATOMIC_SUB(&node->opens, 1);
+
+	if (opens < 0)
+	{
+		exfat_get_name(node, buffer);
+		exfat_bug("open handles counter of '%s' is below zero", buffer);
+	}
+	else if (opens == 0)
+	{
+		pthread_mutex_lock(&node->lock);
+		if (!node->is_unlinked && exfat_flush_writeback(ef, node) != 0)
+		{
+			/* the data stays buffered, fsync will report the error */
+			exfat_get_name(node, buffer);
+			exfat_error("failed to write buffered data of '%s'", buffer);
+		}
+		else
+			exfat_free_writeback(node);
+		exfat_free_readahead(node);
+		pthread_mutex_unlock(&node->lock);
+	}
+}
+
 /**
  * This function must be called on rmdir and unlink (after the last
  * exfat_put_node()) to free clusters.
@@ -69,10 +310,12 @@ int exfat_cleanup_node(struct exfat* ef, struct exfat_node* node)
 
 	if (node->is_unlinked)
 	{
+		/* buffered data would only be written to the freed clusters */
+		exfat_free_writeback(node);
 		/* free all clusters and node structure itself */
 		rc = exfat_truncate(ef, node, 0, true);
 		/* free the node even in case of error or its memory will be lost */
-		free(node);
+		exfat_free_node(ef, node);
 	}
 	return rc;
 }
@@ -98,16 +341,67 @@ static int read_entries(struct exfat* ef, struct exfat_node* dir,
 	return -EIO;
 }
 
+/*
+ * Returns a pointer to n entries starting at offset. Directory contents are
+ * read in large chunks (whole clusters or cluster runs), so that scanning
+ * a directory takes a few reads instead of one per entry. The pointer is
+ * valid until the next call.
+ */
+static int get_entries(struct exfat* ef, struct exfat_node* dir,
+		struct dir_reader* reader, const struct exfat_entry** entries, int n,
+		off_t offset)
+{
+	const size_t size = sizeof(struct exfat_entry[n]);
+	ssize_t rc;
+
+	if (!(dir->attrib & EXFAT_ATTRIB_DIR))
+		exfat_bug("attempted to read entries from a file");
+
+	if (offset < reader->offset ||
+			offset + size > reader->offset + reader->size)
+	{
+		rc = exfat_generic_pread(ef, dir, reader->buffer, DIR_READ_SIZE,
+				offset);
+		if (rc < 0)
+			return -EIO;
+		reader->offset = offset;
+		reader->size = rc;
+	}
+	if (offset + size > reader->offset + reader->size)
+	{
+		if (reader->size == 0)
+			return -ENOENT;
+		exfat_error("read %zu bytes instead of %zu bytes", reader->size,
+				size);
+		return -EIO;
+	}
+	*entries = (const struct exfat_entry*)
+			(reader->buffer + (offset - reader->offset));
+	return 0;
+}
+
+/*
+ * Entries that are created, erased or stop referring to freed clusters are
+ * written "through": FAT and clusters bitmap changes go to the device right
+ * away, while the blocks cache keeps directory blocks until exfat_flush().
+ * If such entries stayed cached, a crash could leave an old entry pointing
+ * to clusters that are free on the device or already reused by another
+ * file. Other updates of entries (sizes, times) only stay cached.
+ */
 static int write_entries(struct exfat* ef, struct exfat_node* dir,
-		const struct exfat_entry* entries, int n, off_t offset)
+		const struct exfat_entry* entries, int n, off_t offset, bool through)
 {
 	ssize_t size;
 
 	if (!(dir->attrib & EXFAT_ATTRIB_DIR))
 		exfat_bug("attempted to write entries into a file");
 
-	size = exfat_generic_pwrite(ef, dir, entries,
-			sizeof(struct exfat_entry[n]), offset);
+	if (through)
+		size = exfat_generic_pwrite_through(ef, dir, entries,
+				sizeof(struct exfat_entry[n]), offset);
+	else
+		size = exfat_generic_pwrite(ef, dir, entries,
+				sizeof(struct exfat_entry[n]), offset);
 	if (size == (ssize_t) sizeof(struct exfat_entry) * n)
 		return 0; /* success */
 	if (size < 0)
@@ -117,18 +411,6 @@ static int write_entries(struct exfat* ef, struct exfat_node* dir,
 	return -EIO;
 }
 
-static struct exfat_node* allocate_node(void)
-{
-	struct exfat_node* node = malloc(sizeof(struct exfat_node));
-	if (node == NULL)
-	{
-		exfat_error("failed to allocate node");
-		return NULL;
-	}
-	memset(node, 0, sizeof(struct exfat_node));
-	return node;
-}
-
 static void init_node_meta1(struct exfat_node* node,
 		const struct exfat_entry_meta1* meta1)
 {
@@ -149,17 +431,29 @@ static void init_node_meta2(struct exfat_node* node,
 	node->start_cluster = le32_to_cpu(meta2->start_cluster);
 	node->fptr_cluster = node->start_cluster;
 	node->is_contiguous = ((meta2->flags & EXFAT_FLAG_CONTIGUOUS) != 0);
+	node->name_hash = le16_to_cpu(meta2->name_hash);
 }
 
-static void init_node_name(struct exfat_node* node,
+static int init_node_name(struct exfat_node* node,
 		const struct exfat_entry* entries, int n)
 {
+	le16_t name[EXFAT_NAME_MAX + 1];
+	le16_t* buffer;
+	size_t length;
+	int rc;
 	int i;
 
+	memset(name, 0, sizeof(name));
 	for (i = 0; i < n; i++)
-		memcpy(node->name + i * EXFAT_ENAME_MAX,
+		memcpy(name + i * EXFAT_ENAME_MAX,
 				((const struct exfat_entry_name*) &entries[i])->name,
 				EXFAT_ENAME_MAX * sizeof(le16_t));
+	length = exfat_utf16_length(name);
+	rc = allocate_name(&buffer, length);
+	if (rc != 0)
+		return rc;
+	set_name(node, buffer, name, length);
+	return 0;
 }
 
 static bool check_entries(const struct exfat_entry* entry, int n)
@@ -299,6 +593,7 @@ static int parse_file_entries(struct exfat* ef, struct exfat_node* node,
 	const struct exfat_entry_meta1* meta1;
 	const struct exfat_entry_meta2* meta2;
 	int mandatory_entries;
+	int rc;
 
 	if (!check_entries(entries, n))
 		return -EIO;
@@ -325,7 +620,9 @@ static int parse_file_entries(struct exfat* ef, struct exfat_node* node,
 
 	init_node_meta1(node, meta1);
 	init_node_meta2(node, meta2);
-	init_node_name(node, entries + 2, mandatory_entries - 2);
+	rc = init_node_name(node, entries + 2, mandatory_entries - 2);
+	if (rc != 0)
+		return rc;
 
 	if (!check_node(ef, node, exfat_calc_checksum(entries, n), meta1))
 		return -EIO;
@@ -334,17 +631,18 @@ static int parse_file_entries(struct exfat* ef, struct exfat_node* node,
 }
 
 static int parse_file_entry(struct exfat* ef, struct exfat_node* parent,
-		struct exfat_node** node, off_t* offset, int n)
+		struct dir_reader* reader, struct exfat_node** node, off_t* offset,
+		int n)
 {
-	struct exfat_entry entries[n];
+	const struct exfat_entry* entries;
 	int rc;
 
-	rc = read_entries(ef, parent, entries, n, *offset);
+	rc = get_entries(ef, parent, reader, &entries, n, *offset);
 	if (rc != 0)
 		return rc;
 
 	/* a new node has zero references */
-	*node = allocate_node();
+	*node = exfat_allocate_node(ef);
 	if (*node == NULL)
 		return -ENOMEM;
 	(*node)->entry_offset = *offset;
@@ -352,7 +650,7 @@ static int parse_file_entry(struct exfat* ef, struct exfat_node* parent,
 	rc = parse_file_entries(ef, *node, entries, n);
 	if (rc != 0)
 	{
-		free(*node);
+		exfat_free_node(ef, *node);
 		return rc;
 	}
 
@@ -385,10 +683,10 @@ static void decompress_upcase(uint16_t* output, const le16_t* source,
  * structure.
  */
 static int readdir(struct exfat* ef, struct exfat_node* parent,
-		struct exfat_node** node, off_t* offset)
+		struct dir_reader* reader, struct exfat_node** node, off_t* offset)
 {
 	int rc;
-	struct exfat_entry entry;
+	const struct exfat_entry* entry;
 	const struct exfat_entry_meta1* meta1;
 	const struct exfat_entry_upcase* upcase;
 	const struct exfat_entry_bitmap* bitmap;
@@ -399,21 +697,21 @@ static int readdir(struct exfat* ef, struct exfat_node* parent,
 
 	for (;;)
 	{
-		rc = read_entries(ef, parent, &entry, 1, *offset);
+		rc = get_entries(ef, parent, reader, &entry, 1, *offset);
 		if (rc != 0)
 			return rc;
 
-		switch (entry.type)
+		switch (entry->type)
 		{
 		case EXFAT_ENTRY_FILE:
-			meta1 = (const struct exfat_entry_meta1*) &entry;
-			return parse_file_entry(ef, parent, node, offset,
+			meta1 = (const struct exfat_entry_meta1*) entry;
+			return parse_file_entry(ef, parent, reader, node, offset,
 					1 + meta1->continuations);
 
 		case EXFAT_ENTRY_UPCASE:
 			if (ef->upcase != NULL)
 				break;
-			upcase = (const struct exfat_entry_upcase*) &entry;
+			upcase = (const struct exfat_entry_upcase*) entry;
 			if (CLUSTER_INVALID(*ef->sb, le32_to_cpu(upcase->start_cluster)))
 			{
 				exfat_error("invalid cluster 0x%x in upcase table",
@@ -463,46 +761,33 @@ static int readdir(struct exfat* ef, struct exfat_node* parent,
 			break;
 
 		case EXFAT_ENTRY_BITMAP:
-			bitmap = (const struct exfat_entry_bitmap*) &entry;
-			ef->cmap.start_cluster = le32_to_cpu(bitmap->start_cluster);
-			if (CLUSTER_INVALID(*ef->sb, ef->cmap.start_cluster))
+			if (ef->cmap.free != NULL)
+				break;
+			bitmap = (const struct exfat_entry_bitmap*) entry;
+			if (CLUSTER_INVALID(*ef->sb, le32_to_cpu(bitmap->start_cluster)))
 			{
 				exfat_error("invalid cluster 0x%x in clusters bitmap",
-						ef->cmap.start_cluster);
+						le32_to_cpu(bitmap->start_cluster));
 				return -EIO;
 			}
-			ef->cmap.size = le32_to_cpu(ef->sb->cluster_count);
-			if (le64_to_cpu(bitmap->size) < DIV_ROUND_UP(ef->cmap.size, 8))
+			if (le64_to_cpu(bitmap->size) <
+					DIV_ROUND_UP(le32_to_cpu(ef->sb->cluster_count), 8))
 			{
 				exfat_error("invalid clusters bitmap size: %"PRIu64
 						" (expected at least %u)",
 						le64_to_cpu(bitmap->size),
-						DIV_ROUND_UP(ef->cmap.size, 8));
-				return -EIO;
-			}
-			/* FIXME bitmap can be rather big, up to 512 MB */
-			ef->cmap.chunk_size = ef->cmap.size;
-			ef->cmap.chunk = malloc(BMAP_SIZE(ef->cmap.chunk_size));
-			if (ef->cmap.chunk == NULL)
-			{
-				exfat_error("failed to allocate clusters bitmap chunk "
-						"(%"PRIu64" bytes)", le64_to_cpu(bitmap->size));
-				return -ENOMEM;
-			}
-
-			if (exfat_pread(ef->dev, ef->cmap.chunk,
-					BMAP_SIZE(ef->cmap.chunk_size),
-					exfat_c2o(ef, ef->cmap.start_cluster)) < 0)
-			{
-				exfat_error("failed to read clusters bitmap "
-						"(%"PRIu64" bytes starting at cluster %#x)",
-						le64_to_cpu(bitmap->size), ef->cmap.start_cluster);
+						DIV_ROUND_UP(le32_to_cpu(ef->sb->cluster_count), 8));
 				return -EIO;
 			}
+			/* bitmap can be rather big, up to 512 MB, so it is loaded
+			   page by page when needed */
+			rc = exfat_init_cmap(ef, le32_to_cpu(bitmap->start_cluster));
+			if (rc != 0)
+				return rc;
 			break;
 
 		case EXFAT_ENTRY_LABEL:
-			label = (const struct exfat_entry_label*) &entry;
+			label = (const struct exfat_entry_label*) entry;
 			if (label->length > EXFAT_ENAME_MAX)
 			{
 				exfat_error("too long label (%hhu chars)", label->length);
@@ -517,29 +802,220 @@ static int readdir(struct exfat* ef, struct exfat_node* parent,
 			break;
 
 		default:
-			if (!(entry.type & EXFAT_ENTRY_VALID))
+			if (!(entry->type & EXFAT_ENTRY_VALID))
 				break; /* deleted entry, ignore it */
 
-			exfat_error("unknown entry type %#hhx", entry.type);
-			if (!EXFAT_REPAIR(unknown_entry, ef, parent, &entry, *offset))
+			exfat_error("unknown entry type %#hhx", entry->type);
+			if (!EXFAT_REPAIR(unknown_entry, ef, parent, entry, *offset))
 				return -EIO;
 		}
-		*offset += sizeof(entry);
+		*offset += sizeof(struct exfat_entry);
 	}
 	/* we never reach here */
 }
 
-int exfat_cache_directory(struct exfat* ef, struct exfat_node* dir)
+static void hash_insert(struct exfat_node* dir, struct exfat_node* node)
+{
+	struct exfat_node** bucket =
+			&dir->hash_table[node->name_hash & (dir->hash_buckets - 1)];
+
+	node->hash_next = *bucket;
+	*bucket = node;
+}
+
+static void hash_remove(struct exfat_node* dir, struct exfat_node* node)
+{
+	struct exfat_node** p =
+			&dir->hash_table[node->name_hash & (dir->hash_buckets - 1)];
+
+	while (*p != node)
+		p = &(*p)->hash_next;
+	*p = node->hash_next;
+	node->hash_next = NULL;
+}
+
+/*
+ * (Re)builds the name hash index of a directory from the list of its
+ * children. On failure the old index (if any) is kept.
+ */
+static int hash_build(struct exfat_node* dir, uint32_t entries)
+{
+	struct exfat_node** table;
+	struct exfat_node* node;
+	uint32_t buckets = EXFAT_HASH_BUCKETS_MIN;
+
+	/* keep load factor not greater than 1 */
+	while (buckets < entries && buckets < EXFAT_HASH_BUCKETS_MAX)
+		buckets *= 2;
+	table = calloc(buckets, sizeof(struct exfat_node*));
+	if (table == NULL)
+		return -ENOMEM;
+
+	free(dir->hash_table);
+	dir->hash_table = table;
+	dir->hash_buckets = buckets;
+	dir->hash_entries = entries;
+	for (node = dir->child; node; node = node->next)
+		hash_insert(dir, node);
+	return 0;
+}
+
+static void hash_free(struct exfat_node* dir)
+{
+	struct exfat_node* node;
+
+	for (node = dir->child; node; node = node->next)
+		node->hash_next = NULL;
+	free(dir->hash_table);
+	dir->hash_table = NULL;
+	dir->hash_buckets = 0;
+	dir->hash_entries = 0;
+}
+
+static void free_slots(struct exfat_node* dir)
+{
+	free(dir->slots);
+	dir->slots = NULL;
+	dir->slots_count = 0;
+	dir->slots_hint = 0;
+}
+
+/*
+ * Makes the used entries bitmap of the directory large enough for its
+ * current size. New entries are free.
+ */
+static int grow_slots(struct exfat_node* dir)
+{
+	const uint32_t count = dir->size / sizeof(struct exfat_entry);
+	uint32_t new_count = MAX(dir->slots_count, EXFAT_SLOTS_MIN);
+	bitmap_t* slots;
+
+	if (count <= dir->slots_count)
+		return 0;
+	while (new_count < count)
+		new_count *= 2;
+	slots = realloc(dir->slots, BMAP_SIZE(new_count));
+	if (slots == NULL)
+	{
+		exfat_error("failed to allocate directory bitmap (%u)", new_count);
+		return -ENOMEM;
+	}
+	memset((char*) slots + BMAP_SIZE(dir->slots_count), 0,
+			BMAP_SIZE(new_count) - BMAP_SIZE(dir->slots_count));
+	dir->slots = slots;
+	dir->slots_count = new_count;
+	return 0;
+}
+
+/*
+ * Root directory contains entries that don't have any nodes associated
+ * with them (clusters bitmap, upper case table, label). They are found by
+ * reading the directory once.
+ */
+static int mark_root_slots(struct exfat* ef, struct exfat_node* dir)
+{
+	const uint32_t count = dir->size / sizeof(struct exfat_entry);
+	struct exfat_entry entries[64];
+	uint32_t i, j;
+	int rc;
+
+	for (i = 0; i < count; i += j)
+	{
+		const int n = MIN(64, count - i);
+
+		rc = read_entries(ef, dir, entries, n,
+				(off_t) i * sizeof(struct exfat_entry));
+		if (rc != 0)
+			return rc;
+		for (j = 0; j < (uint32_t) n; j++)
+			if (entries[j].type & EXFAT_ENTRY_VALID)
+				BMAP_SET(dir->slots, i + j);
+	}
+	return 0;
+}
+
+/*
+ * Builds the used entries bitmap of the directory unless it is built
+ * already.
+ */
+static int get_slots(struct exfat* ef, struct exfat_node* dir)
+{
+	const struct exfat_node* p;
+	int rc;
+	int i;
+
+	if (dir->slots != NULL)
+		return grow_slots(dir);
+
+	rc = grow_slots(dir);
+	if (rc != 0)
+		return rc;
+	for (p = dir->child; p != NULL; p = p->next)
+		for (i = 0; i < 1 + p->continuations; i++)
+			BMAP_SET(dir->slots,
+					p->entry_offset / sizeof(struct exfat_entry) + i);
+	if (dir == ef->root)
+	{
+		rc = mark_root_slots(ef, dir);
+		if (rc != 0)
+		{
+			free_slots(dir);
+			return rc;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Marks n entries starting at offset as used or free in the bitmap if it is
+ * built. If the bitmap cannot be grown it is dropped and built again later.
+ */
+static void mark_slots(struct exfat_node* dir, off_t offset, int n, bool used)
+{
+	const uint32_t start = offset / sizeof(struct exfat_entry);
+	uint32_t i;
+
+	if (dir->slots == NULL)
+		return;
+	if (grow_slots(dir) != 0)
+	{
+		free_slots(dir);
+		return;
+	}
+	for (i = start; i < start + n; i++)
+		if (used)
+			BMAP_SET(dir->slots, i);
+		else
+			BMAP_CLR(dir->slots, i);
+	if (!used && start < dir->slots_hint)
+		dir->slots_hint = start;
+}
+
+static int cache_directory(struct exfat* ef, struct exfat_node* dir)
 {
+	struct dir_reader reader;
+	uint32_t entries = 0;
 	off_t offset = 0;
 	int rc;
 	struct exfat_node* node;
 	struct exfat_node* current = NULL;
 
 	if (dir->is_cached)
+	{
+		exfat_touch_directory(ef, dir);
 		return 0; /* already cached */
+	}
+
+	reader.buffer = malloc(DIR_READ_SIZE);
+	if (reader.buffer == NULL)
+	{
+		exfat_error("failed to allocate directory buffer");
+		return -ENOMEM;
+	}
+	reader.offset = 0;
+	reader.size = 0;
 
-	while ((rc = readdir(ef, dir, &node, &offset)) == 0)
+	while ((rc = readdir(ef, dir, &reader, &node, &offset)) == 0)
 	{
 		node->parent = dir;
 		if (current != NULL)
@@ -551,7 +1027,9 @@ int exfat_cache_directory(struct exfat* ef, struct exfat_node* dir)
 			dir->child = node;
 
 		current = node;
+		entries++;
 	}
+	free(reader.buffer);
 
 	if (rc != -ENOENT)
 	{
@@ -559,16 +1037,32 @@ int exfat_cache_directory(struct exfat* ef, struct exfat_node* dir)
 		for (current = dir->child; current; current = node)
 		{
 			node = current->next;
-			free(current);
+			exfat_free_node(ef, current);
 		}
 		dir->child = NULL;
 		return rc;
 	}
 
+	/* without the index lookups are just slower */
+	if (hash_build(dir, entries) != 0)
+		exfat_warn("failed to allocate hash index for %u entries", entries);
 	dir->is_cached = true;
+	exfat_touch_directory(ef, dir);
+	/* entries made while the directory was cached before are stale */
+	exfat_dcache_invalidate(ef, dir);
 	return 0;
 }
 
+int exfat_cache_directory(struct exfat* ef, struct exfat_node* dir)
+{
+	int rc;
+
+	pthread_mutex_lock(&dir->lock);
+	rc = cache_directory(ef, dir);
+	pthread_mutex_unlock(&dir->lock);
+	return rc;
+}
+
 static void tree_attach(struct exfat_node* dir, struct exfat_node* node)
 {
 	node->parent = dir;
@@ -578,10 +1072,24 @@ static void tree_attach(struct exfat_node* dir, struct exfat_node* node)
 		node->next = dir->child;
 	}
 	dir->child = node;
+
+	if (dir->hash_table == NULL)
+		return;
+	if (dir->hash_entries >= dir->hash_buckets &&
+			dir->hash_buckets < EXFAT_HASH_BUCKETS_MAX &&
+			hash_build(dir, dir->hash_entries + 1) == 0)
+		return; /* the new node is indexed along with the others */
+	hash_insert(dir, node);
+	dir->hash_entries++;
 }
 
 static void tree_detach(struct exfat_node* node)
 {
+	if (node->parent->hash_table != NULL)
+	{
+		hash_remove(node->parent, node);
+		node->parent->hash_entries--;
+	}
 	if (node->prev)
 		node->prev->next = node->next;
 	else /* this is the first node in the list */
@@ -597,13 +1105,16 @@ static void reset_cache(struct exfat* ef, struct exfat_node* node)
 {
 	char buffer[EXFAT_UTF8_NAME_BUFFER_MAX];
 
+	hash_free(node);
+	free_slots(node);
 	while (node->child)
 	{
 		struct exfat_node* p = node->child;
 		reset_cache(ef, p);
 		tree_detach(p);
-		free(p);
+		exfat_free_node(ef, p);
 	}
+	lru_forget(ef, node);
 	node->is_cached = false;
 	if (node->references != 0)
 	{
@@ -623,29 +1134,103 @@ static void reset_cache(struct exfat* ef, struct exfat_node* node)
 void exfat_reset_cache(struct exfat* ef)
 {
 	reset_cache(ef, ef->root);
+	exfat_dcache_reset(ef);
 }
 
-int exfat_flush_node(struct exfat* ef, struct exfat_node* node)
+/*
+ * A directory can be evicted if nobody uses its subtree and nothing there
+ * needs to be written.
+ */
+static bool is_evictable(const struct exfat_node* dir)
 {
-	struct exfat_entry entries[1 + node->continuations];
-	struct exfat_entry_meta1* meta1 = (struct exfat_entry_meta1*) &entries[0];
-	struct exfat_entry_meta2* meta2 = (struct exfat_entry_meta2*) &entries[1];
-	int rc;
-	le16_t edate, etime;
-
-	if (!node->is_dirty)
-		return 0; /* no need to flush */
+	const struct exfat_node* node;
 
-	if (ef->ro)
-		exfat_bug("unable to flush node to read-only FS");
+	for (node = dir->child; node; node = node->next)
+		if (node->references != 0 || node->is_dirty ||
+				(node->is_cached && !is_evictable(node)))
+			return false;
+	return true;
+}
 
-	if (node->parent == NULL)
-		return 0; /* do not flush unlinked node */
+/*
+ * Frees the subtree of the directory. The directory itself stays in the
+ * tree and will be read again when needed.
+ */
+static void evict_directory(struct exfat* ef, struct exfat_node* dir)
+{
+	exfat_dcache_invalidate(ef, dir);
+	hash_free(dir);
+	free_slots(dir);
+	while (dir->child)
+	{
+		struct exfat_node* node = dir->child;
+
+		if (node->is_cached)
+			evict_directory(ef, node);
+		tree_detach(node);
+		exfat_free_node(ef, node);
+	}
+	lru_forget(ef, dir);
+	dir->is_cached = false;
+}
+
+bool exfat_need_eviction(struct exfat* ef)
+{
+	bool need;
+
+	pthread_mutex_lock(&ef->nodes.lock);
+	need = ef->nodes.max != 0 && ef->nodes.count > ef->nodes.threshold;
+	pthread_mutex_unlock(&ef->nodes.lock);
+	return need;
+}
+
+/*
+ * Evicts least recently used directories until nodes fit into the limit
+ * with some room to spare. Directories that cannot be evicted are moved to
+ * the head of the list to be checked again later.
+ */
+void exfat_evict_nodes(struct exfat* ef)
+{
+	const uint32_t target = ef->nodes.max - ef->nodes.max / 8;
+	struct exfat_node* dir;
+	uint32_t n;
+
+	pthread_mutex_lock(&ef->nodes.lock);
+	for (n = ef->nodes.directories; n > 0 && ef->nodes.tail != NULL &&
+			ef->nodes.count > target; n--)
+	{
+		dir = ef->nodes.tail;
+		if (is_evictable(dir))
+		{
+			pthread_mutex_unlock(&ef->nodes.lock);
+			evict_directory(ef, dir);
+			pthread_mutex_lock(&ef->nodes.lock);
+			ef->nodes.evictions++;
+		}
+		else
+		{
+			lru_remove(ef, dir);
+			lru_insert(ef, dir);
+		}
+	}
+	/* if too much is in use, do not try again until more is cached */
+	if (ef->nodes.count > ef->nodes.max)
+		ef->nodes.threshold = ef->nodes.count + SLAB_NODES;
+	else
+		ef->nodes.threshold = ef->nodes.max;
+	pthread_mutex_unlock(&ef->nodes.lock);
+}
+
+/*
+ * Puts node fields into its entry set read from the directory.
+ */
+static int update_entries(const struct exfat_node* node,
+		struct exfat_entry* entries)
+{
+	struct exfat_entry_meta1* meta1 = (struct exfat_entry_meta1*) &entries[0];
+	struct exfat_entry_meta2* meta2 = (struct exfat_entry_meta2*) &entries[1];
+	le16_t edate, etime;
 
-	rc = read_entries(ef, node->parent, entries, 1 + node->continuations,
-			node->entry_offset);
-	if (rc != 0)
-		return rc;
 	if (!check_entries(entries, 1 + node->continuations))
 		return -EIO;
 
@@ -668,13 +1253,221 @@ int exfat_flush_node(struct exfat* ef, struct exfat_node* node)
 	/* name hash remains unchanged, no need to recalculate it */
 
 	meta1->checksum = exfat_calc_checksum(entries, 1 + node->continuations);
-	rc = write_entries(ef, node->parent, entries, 1 + node->continuations,
+	return 0;
+}
+
+static int flush_node(struct exfat* ef, struct exfat_node* node)
+{
+	struct exfat_entry entries[1 + node->continuations];
+	int rc;
+
+	if (!node->is_dirty)
+		return 0; /* no need to flush */
+
+	if (ef->ro)
+		exfat_bug("unable to flush node to read-only FS");
+
+	if (node->parent == NULL)
+		return 0; /* do not flush unlinked node */
+
+	rc = read_entries(ef, node->parent, entries, 1 + node->continuations,
 			node->entry_offset);
 	if (rc != 0)
 		return rc;
+	rc = update_entries(node, entries);
+	if (rc != 0)
+		return rc;
+	rc = write_entries(ef, node->parent, entries, 1 + node->continuations,
+			node->entry_offset, node->is_shrunk);
+	if (rc != 0)
+		return rc;
 
 	node->is_dirty = false;
-	return exfat_flush(ef);
+	node->is_shrunk = false;
+	return exfat_flush_clusters(ef);
+}
+
+int exfat_flush_node(struct exfat* ef, struct exfat_node* node)
+{
+	struct exfat_node* parent;
+	int rc;
+
+	pthread_mutex_lock(&node->lock);
+	/* buffered data changes size and valid_size */
+	rc = exfat_flush_writeback(ef, node);
+	if (rc != 0)
+	{
+		pthread_mutex_unlock(&node->lock);
+		return rc;
+	}
+	/* entry set is read and written back, keep the directory locked for
+	   the whole sequence; the parent cannot change as renaming is
+	   serialized against flushing by the caller */
+	parent = node->parent;
+	if (parent != NULL)
+		pthread_mutex_lock(&parent->lock);
+	rc = flush_node(ef, node);
+	if (parent != NULL)
+		pthread_mutex_unlock(&parent->lock);
+	pthread_mutex_unlock(&node->lock);
+	return rc;
+}
+
+static int compare_entry_offsets(const void* a, const void* b)
+{
+	const struct exfat_node* x = *(const struct exfat_node* const*) a;
+	const struct exfat_node* y = *(const struct exfat_node* const*) b;
+
+	return (x->entry_offset > y->entry_offset) -
+			(x->entry_offset < y->entry_offset);
+}
+
+/*
+ * Updates entry sets of the nodes (sorted by offset) with a single read and
+ * write of the directory range that covers them all.
+ */
+static int flush_group(struct exfat* ef, struct exfat_node* dir,
+		struct exfat_node** nodes, size_t n)
+{
+	const off_t start = nodes[0]->entry_offset;
+	off_t end = start;
+	char* buffer;
+	ssize_t size;
+	size_t i;
+	int rc = 0;
+
+	for (i = 0; i < n; i++)
+		end = MAX(end, nodes[i]->entry_offset +
+				(off_t) sizeof(struct exfat_entry[1 + nodes[i]->continuations]));
+	buffer = malloc(end - start);
+	if (buffer == NULL)
+	{
+		/* flush them one by one then */
+		for (i = 0; i < n && rc == 0; i++)
+			rc = flush_node(ef, nodes[i]);
+		return rc;
+	}
+
+	size = exfat_generic_pread(ef, dir, buffer, end - start, start);
+	if (size != end - start)
+	{
+		exfat_error("failed to read %"PRId64" bytes of entries at %"PRId64,
+				end - start, start);
+		free(buffer);
+		return -EIO;
+	}
+	for (i = 0; i < n && rc == 0; i++)
+		rc = update_entries(nodes[i], (struct exfat_entry*)
+				(buffer + (nodes[i]->entry_offset - start)));
+	if (rc == 0)
+	{
+		for (i = 0; i < n && !nodes[i]->is_shrunk; i++);
+		if (i < n)
+			size = exfat_generic_pwrite_through(ef, dir, buffer, end - start,
+					start);
+		else
+			size = exfat_generic_pwrite(ef, dir, buffer, end - start, start);
+		if (size != end - start)
+		{
+			exfat_error("failed to write %"PRId64" bytes of entries at %"PRId64,
+					end - start, start);
+			rc = -EIO;
+		}
+	}
+	if (rc == 0)
+		for (i = 0; i < n; i++)
+		{
+			nodes[i]->is_dirty = false;
+			nodes[i]->is_shrunk = false;
+		}
+	free(buffer);
+	return rc;
+}
+
+/*
+ * Writes all dirty children of the directory. Entry sets that start in the
+ * same cluster are updated together.
+ */
+static int flush_children(struct exfat* ef, struct exfat_node* dir)
+{
+	const off_t cluster_size = CLUSTER_SIZE(*ef->sb);
+	struct exfat_node** nodes;
+	struct exfat_node* p;
+	size_t n = 0;
+	size_t i, j;
+	int rc = 0;
+
+	/* buffered data changes size and valid_size */
+	for (p = dir->child; p != NULL; p = p->next)
+		if (p->writeback != NULL)
+		{
+			rc = exfat_flush_writeback(ef, p);
+			if (rc != 0)
+				return rc;
+		}
+
+	for (p = dir->child; p != NULL; p = p->next)
+		if (p->is_dirty)
+			n++;
+	if (n == 0)
+		return 0;
+	if (ef->ro)
+		exfat_bug("unable to flush node to read-only FS");
+
+	nodes = malloc(n * sizeof(struct exfat_node*));
+	if (nodes == NULL)
+	{
+		for (p = dir->child; p != NULL && rc == 0; p = p->next)
+			rc = exfat_flush_node(ef, p);
+		return rc;
+	}
+	for (n = 0, p = dir->child; p != NULL; p = p->next)
+		if (p->is_dirty)
+			nodes[n++] = p;
+	qsort(nodes, n, sizeof(struct exfat_node*), compare_entry_offsets);
+
+	pthread_mutex_lock(&dir->lock);
+	for (i = 0; i < n && rc == 0; i = j)
+	{
+		const off_t cluster_end =
+				(nodes[i]->entry_offset / cluster_size + 1) * cluster_size;
+
+		for (j = i + 1; j < n && nodes[j]->entry_offset < cluster_end; j++);
+		rc = flush_group(ef, dir, nodes + i, j - i);
+	}
+	pthread_mutex_unlock(&dir->lock);
+	free(nodes);
+	return rc;
+}
+
+static int flush_nodes(struct exfat* ef, struct exfat_node* dir)
+{
+	struct exfat_node* p;
+	int rc;
+
+	/* subdirectories first: writing their entries makes them dirty */
+	for (p = dir->child; p != NULL; p = p->next)
+		if (p->child != NULL)
+		{
+			rc = flush_nodes(ef, p);
+			if (rc != 0)
+				return rc;
+		}
+	return flush_children(ef, dir);
+}
+
+/*
+ * Writes all dirty nodes. FAT and clusters bitmap are written once at the
+ * end rather than after every node.
+ */
+int exfat_flush_nodes(struct exfat* ef)
+{
+	int rc;
+
+	rc = flush_nodes(ef, ef->root);
+	if (rc != 0)
+		return rc;
+	return exfat_flush_clusters(ef);
 }
 
 static int erase_entries(struct exfat* ef, struct exfat_node* dir, int n,
@@ -689,7 +1482,7 @@ static int erase_entries(struct exfat* ef, struct exfat_node* dir, int n,
 		return rc;
 	for (i = 0; i < n; i++)
 		entries[i].type &= ~EXFAT_ENTRY_VALID;
-	return write_entries(ef, dir, entries, n, offset);
+	return write_entries(ef, dir, entries, n, offset, true);
 }
 
 static int erase_node(struct exfat* ef, struct exfat_node* node)
@@ -704,49 +1497,50 @@ static int erase_node(struct exfat* ef, struct exfat_node* node)
 		exfat_put_node(ef, node->parent);
 		return rc;
 	}
+	mark_slots(node->parent, node->entry_offset, 1 + node->continuations,
+			false);
 	rc = exfat_flush_node(ef, node->parent);
 	exfat_put_node(ef, node->parent);
 	return rc;
 }
 
-static int shrink_directory(struct exfat* ef, struct exfat_node* dir,
-		off_t deleted_offset)
+/*
+ * Returns the number of entries up to the last used one. Free entries at
+ * the end take less than a cluster (see shrink_directory()), so this does
+ * not depend on the directory size.
+ */
+static uint32_t count_used_slots(const struct exfat_node* dir)
+{
+	const uint32_t bits = sizeof(bitmap_t) * 8;
+	uint32_t i = MIN(dir->slots_count, dir->size / sizeof(struct exfat_entry));
+
+	while (i > 0)
+	{
+		if (i % bits == 0 && dir->slots[i / bits - 1] == 0)
+			i -= bits;
+		else if (BMAP_GET(dir->slots, i - 1) == 0)
+			i--;
+		else
+			break;
+	}
+	return i;
+}
+
+static int shrink_directory(struct exfat* ef, struct exfat_node* dir)
 {
-	const struct exfat_node* node;
-	const struct exfat_node* last_node;
-	uint64_t entries = 0;
 	uint64_t new_size;
+	int rc;
 
 	if (!(dir->attrib & EXFAT_ATTRIB_DIR))
 		exfat_bug("attempted to shrink a file");
 	if (!dir->is_cached)
 		exfat_bug("attempted to shrink uncached directory");
 
-	for (last_node = node = dir->child; node; node = node->next)
-	{
-		if (deleted_offset < node->entry_offset)
-		{
-			/* there are other entries after the removed one, no way to shrink
-			   this directory */
-			return 0;
-		}
-		if (last_node->entry_offset < node->entry_offset)
-			last_node = node;
-	}
-
-	if (last_node)
-	{
-		/* offset of the last entry */
-		entries += last_node->entry_offset / sizeof(struct exfat_entry);
-		/* two subentries with meta info */
-		entries += 2;
-		/* subentries with file name */
-		entries += DIV_ROUND_UP(exfat_utf16_length(last_node->name),
-				EXFAT_ENAME_MAX);
-	}
-
-	new_size = DIV_ROUND_UP(entries * sizeof(struct exfat_entry),
-				 CLUSTER_SIZE(*ef->sb)) * CLUSTER_SIZE(*ef->sb);
+	rc = get_slots(ef, dir);
+	if (rc != 0)
+		return rc;
+	new_size = ROUND_UP((uint64_t) count_used_slots(dir) *
+			sizeof(struct exfat_entry), CLUSTER_SIZE(*ef->sb));
 	if (new_size == 0) /* directory always has at least 1 cluster */
 		new_size = CLUSTER_SIZE(*ef->sb);
 	if (new_size == dir->size)
@@ -757,7 +1551,6 @@ static int shrink_directory(struct exfat* ef, struct exfat_node* dir,
 static int delete(struct exfat* ef, struct exfat_node* node)
 {
 	struct exfat_node* parent = node->parent;
-	off_t deleted_offset = node->entry_offset;
 	int rc;
 
 	exfat_get_node(parent);
@@ -767,8 +1560,9 @@ static int delete(struct exfat* ef, struct exfat_node* node)
 		exfat_put_node(ef, parent);
 		return rc;
 	}
+	exfat_dcache_invalidate(ef, parent);
 	tree_detach(node);
-	rc = shrink_directory(ef, parent, deleted_offset);
+	rc = shrink_directory(ef, parent);
 	node->is_unlinked = true;
 	if (rc != 0)
 	{
@@ -804,83 +1598,42 @@ int exfat_rmdir(struct exfat* ef, struct exfat_node* node)
 	return delete(ef, node);
 }
 
-static int check_slot(struct exfat* ef, struct exfat_node* dir, off_t offset,
-		int n)
-{
-	struct exfat_entry entries[n];
-	int rc;
-	int i;
-
-	/* Root directory contains entries, that don't have any nodes associated
-	   with them (clusters bitmap, upper case table, label). We need to be
-	   careful not to overwrite them. */
-	if (dir != ef->root)
-		return 0;
-
-	rc = read_entries(ef, dir, entries, n, offset);
-	if (rc != 0)
-		return rc;
-	for (i = 0; i < n; i++)
-		if (entries[i].type & EXFAT_ENTRY_VALID)
-			return -EINVAL;
-	return 0;
-}
-
 static int find_slot(struct exfat* ef, struct exfat_node* dir,
 		off_t* offset, int n)
 {
-	bitmap_t* dmap;
-	struct exfat_node* p;
-	size_t i;
+	const uint32_t count = dir->size / sizeof(struct exfat_entry);
+	uint32_t start, end;
 	int contiguous = 0;
+	int rc;
 
 	if (!dir->is_cached)
 		exfat_bug("directory is not cached");
 
-	/* build a bitmap of valid entries in the directory */
-	dmap = calloc(BMAP_SIZE(dir->size / sizeof(struct exfat_entry)),
-			sizeof(bitmap_t));
-	if (dmap == NULL)
-	{
-		exfat_error("failed to allocate directory bitmap (%"PRIu64")",
-				dir->size / sizeof(struct exfat_entry));
-		return -ENOMEM;
-	}
-	for (p = dir->child; p != NULL; p = p->next)
-		for (i = 0; i < 1u + p->continuations; i++)
-			BMAP_SET(dmap, p->entry_offset / sizeof(struct exfat_entry) + i);
+	rc = get_slots(ef, dir);
+	if (rc != 0)
+		return rc;
 
-	/* find a slot in the directory entries bitmap */
-	for (i = 0; i < dir->size / sizeof(struct exfat_entry); i++)
+	/* find n free entries in a row */
+	dir->slots_hint = exfat_bmap_find_zero(dir->slots,
+			MIN(dir->slots_hint, count), count);
+	for (start = dir->slots_hint; start < count; start = end)
 	{
-		if (BMAP_GET(dmap, i) == 0)
+		start = exfat_bmap_find_zero(dir->slots, start, count);
+		if (start == count)
+			break;
+		end = exfat_bmap_find_one(dir->slots, start, MIN(count, start + n));
+		if (end - start == (uint32_t) n)
 		{
-			if (contiguous++ == 0)
-				*offset = (off_t) i * sizeof(struct exfat_entry);
-			if (contiguous == n)
-			{
-				int rc;
-
-				/* suitable slot is found, check that it's not occupied */
-				rc = check_slot(ef, dir, *offset, n);
-				if (rc == -EINVAL)
-				{
-					/* slot at (i-n) is occupied, go back and check (i-n+1) */
-					i -= contiguous - 1;
-					contiguous = 0;
-				}
-				else
-				{
-					/* slot is free or an error occurred */
-					free(dmap);
-					return rc;
-				}
-			}
+			*offset = (off_t) start * sizeof(struct exfat_entry);
+			return 0;
+		}
+		if (end == count)
+		{
+			/* free entries at the end are used along with new ones */
+			contiguous = end - start;
+			*offset = (off_t) start * sizeof(struct exfat_entry);
 		}
-		else
-			contiguous = 0;
 	}
-	free(dmap);
 
 	/* no suitable slots found, extend the directory */
 	if (contiguous == 0)
@@ -892,14 +1645,15 @@ static int find_slot(struct exfat* ef, struct exfat_node* dir,
 }
 
 static int commit_entry(struct exfat* ef, struct exfat_node* dir,
-		const le16_t* name, off_t offset, uint16_t attrib)
+		const le16_t* name, off_t offset, uint16_t attrib,
+		struct exfat_node** node)
 {
-	struct exfat_node* node;
 	const size_t name_length = exfat_utf16_length(name);
 	const int name_entries = DIV_ROUND_UP(name_length, EXFAT_ENAME_MAX);
 	struct exfat_entry entries[2 + name_entries];
 	struct exfat_entry_meta1* meta1 = (struct exfat_entry_meta1*) &entries[0];
 	struct exfat_entry_meta2* meta2 = (struct exfat_entry_meta2*) &entries[1];
+	le16_t* buffer;
 	int i;
 	int rc;
 	le16_t edate, etime;
@@ -934,27 +1688,60 @@ static int commit_entry(struct exfat* ef, struct exfat_node* dir,
 	}
 
 	meta1->checksum = exfat_calc_checksum(entries, 2 + name_entries);
-	rc = write_entries(ef, dir, entries, 2 + name_entries, offset);
+	rc = write_entries(ef, dir, entries, 2 + name_entries, offset, true);
 	if (rc != 0)
 		return rc;
+	mark_slots(dir, offset, 2 + name_entries, true);
 
-	node = allocate_node();
-	if (node == NULL)
+	*node = exfat_allocate_node(ef);
+	if (*node == NULL)
 		return -ENOMEM;
-	node->entry_offset = offset;
-	memcpy(node->name, name, name_length * sizeof(le16_t));
-	init_node_meta1(node, meta1);
-	init_node_meta2(node, meta2);
+	rc = allocate_name(&buffer, name_length);
+	if (rc != 0)
+	{
+		exfat_free_node(ef, *node);
+		return rc;
+	}
+	(*node)->entry_offset = offset;
+	set_name(*node, buffer, name, name_length);
+	init_node_meta1(*node, meta1);
+	init_node_meta2(*node, meta2);
 
-	tree_attach(dir, node);
+	tree_attach(dir, *node);
 	return 0;
 }
 
-static int create(struct exfat* ef, const char* path, uint16_t attrib)
+/*
+ * Creates a new entry in the directory. The new node is returned with
+ * a reference.
+ */
+static int create(struct exfat* ef, struct exfat_node* dir,
+		const le16_t* name, uint16_t attrib, struct exfat_node** node)
+{
+	off_t offset = -1;
+	int rc;
+
+	rc = find_slot(ef, dir, &offset,
+			2 + DIV_ROUND_UP(exfat_utf16_length(name), EXFAT_ENAME_MAX));
+	if (rc != 0)
+		return rc;
+	rc = commit_entry(ef, dir, name, offset, attrib, node);
+	if (rc != 0)
+		return rc;
+	exfat_dcache_invalidate(ef, dir);
+	exfat_get_node(*node);
+	exfat_update_mtime(dir);
+	rc = exfat_flush_node(ef, dir);
+	if (rc != 0)
+		exfat_put_node(ef, *node);
+	return rc;
+}
+
+static int create_path(struct exfat* ef, const char* path, uint16_t attrib,
+		struct exfat_node** node)
 {
 	struct exfat_node* dir;
 	struct exfat_node* existing;
-	off_t offset = -1;
 	le16_t name[EXFAT_NAME_MAX + 1];
 	int rc;
 
@@ -967,42 +1754,37 @@ static int create(struct exfat* ef, const char* path, uint16_t attrib)
 		exfat_put_node(ef, dir);
 		return -EEXIST;
 	}
-
-	rc = find_slot(ef, dir, &offset,
-			2 + DIV_ROUND_UP(exfat_utf16_length(name), EXFAT_ENAME_MAX));
-	if (rc != 0)
-	{
-		exfat_put_node(ef, dir);
-		return rc;
-	}
-	rc = commit_entry(ef, dir, name, offset, attrib);
-	if (rc != 0)
-	{
-		exfat_put_node(ef, dir);
-		return rc;
-	}
-	exfat_update_mtime(dir);
-	rc = exfat_flush_node(ef, dir);
+	rc = create(ef, dir, name, attrib, node);
 	exfat_put_node(ef, dir);
 	return rc;
 }
 
-int exfat_mknod(struct exfat* ef, const char* path)
+static int create_at(struct exfat* ef, struct exfat_node* dir,
+		const char* comp, uint16_t attrib, struct exfat_node** node)
 {
-	return create(ef, path, EXFAT_ATTRIB_ARCH);
+	struct exfat_node* existing;
+	le16_t name[EXFAT_NAME_MAX + 1];
+	int rc;
+
+	rc = exfat_split_name(ef, dir, &existing, name, comp);
+	if (rc != 0)
+		return rc;
+	if (existing != NULL)
+	{
+		exfat_put_node(ef, existing);
+		return -EEXIST;
+	}
+	return create(ef, dir, name, attrib, node);
 }
 
-int exfat_mkdir(struct exfat* ef, const char* path)
+/*
+ * Gives a newly created directory its first cluster. The node is removed
+ * on failure, the reference is always dropped.
+ */
+static int init_directory(struct exfat* ef, struct exfat_node* node)
 {
 	int rc;
-	struct exfat_node* node;
 
-	rc = create(ef, path, EXFAT_ATTRIB_DIR);
-	if (rc != 0)
-		return rc;
-	rc = exfat_lookup(ef, &node, path);
-	if (rc != 0)
-		return 0;
 	/* directories always have at least one cluster */
 	rc = exfat_truncate(ef, node, CLUSTER_SIZE(*ef->sb), true);
 	if (rc != 0)
@@ -1022,6 +1804,50 @@ int exfat_mkdir(struct exfat* ef, const char* path)
 	return 0;
 }
 
+int exfat_mknod(struct exfat* ef, const char* path)
+{
+	struct exfat_node* node;
+	int rc;
+
+	rc = create_path(ef, path, EXFAT_ATTRIB_ARCH, &node);
+	if (rc != 0)
+		return rc;
+	exfat_put_node(ef, node);
+	return 0;
+}
+
+int exfat_mkdir(struct exfat* ef, const char* path)
+{
+	struct exfat_node* node;
+	int rc;
+
+	rc = create_path(ef, path, EXFAT_ATTRIB_DIR, &node);
+	if (rc != 0)
+		return rc;
+	return init_directory(ef, node);
+}
+
+int exfat_mknodat(struct exfat* ef, struct exfat_node* dir, const char* name,
+		struct exfat_node** node)
+{
+	return create_at(ef, dir, name, EXFAT_ATTRIB_ARCH, node);
+}
+
+int exfat_mkdirat(struct exfat* ef, struct exfat_node* dir, const char* name,
+		struct exfat_node** node)
+{
+	int rc;
+
+	rc = create_at(ef, dir, name, EXFAT_ATTRIB_DIR, node);
+	if (rc != 0)
+		return rc;
+	exfat_get_node(*node);
+	rc = init_directory(ef, *node);
+	if (rc != 0)
+		exfat_put_node(ef, *node);
+	return rc;
+}
+
 static int rename_entry(struct exfat* ef, struct exfat_node* dir,
 		struct exfat_node* node, const le16_t* name, off_t new_offset)
 {
@@ -1030,10 +1856,15 @@ static int rename_entry(struct exfat* ef, struct exfat_node* dir,
 	struct exfat_entry entries[2 + name_entries];
 	struct exfat_entry_meta1* meta1 = (struct exfat_entry_meta1*) &entries[0];
 	struct exfat_entry_meta2* meta2 = (struct exfat_entry_meta2*) &entries[1];
+	le16_t* buffer;
 	int rc;
 	int i;
 
 	rc = read_entries(ef, node->parent, entries, 2, node->entry_offset);
+	if (rc != 0)
+		return rc;
+	/* nothing is changed on the device if there is no memory */
+	rc = allocate_name(&buffer, name_length);
 	if (rc != 0)
 		return rc;
 
@@ -1043,7 +1874,10 @@ static int rename_entry(struct exfat* ef, struct exfat_node* dir,
 
 	rc = erase_node(ef, node);
 	if (rc != 0)
+	{
+		free(buffer);
 		return rc;
+	}
 
 	node->entry_offset = new_offset;
 	node->continuations = 1 + name_entries;
@@ -1060,35 +1894,71 @@ static int rename_entry(struct exfat* ef, struct exfat_node* dir,
 	}
 
 	meta1->checksum = exfat_calc_checksum(entries, 2 + name_entries);
-	rc = write_entries(ef, dir, entries, 2 + name_entries, new_offset);
+	rc = write_entries(ef, dir, entries, 2 + name_entries, new_offset,
+			true);
 	if (rc != 0)
+	{
+		free(buffer);
 		return rc;
+	}
+	mark_slots(dir, new_offset, 2 + name_entries, true);
 
-	memcpy(node->name, name, (EXFAT_NAME_MAX + 1) * sizeof(le16_t));
+	exfat_dcache_invalidate(ef, node->parent);
+	exfat_dcache_invalidate(ef, dir);
 	tree_detach(node);
+	set_name(node, buffer, name, name_length);
+	node->name_hash = le16_to_cpu(meta2->name_hash);
 	tree_attach(dir, node);
 	return 0;
 }
 
-int exfat_rename(struct exfat* ef, const char* old_path, const char* new_path)
+/*
+ * Removes the node that is going to be replaced by rename. Its clusters are
+ * freed right away unless somebody else still references the node; then
+ * this is the job of whoever drops the last reference.
+ */
+static int replace_node(struct exfat* ef, struct exfat_node* node,
+		struct exfat_node* existing)
 {
-	struct exfat_node* node;
-	struct exfat_node* existing;
-	struct exfat_node* dir;
-	off_t offset = -1;
-	le16_t name[EXFAT_NAME_MAX + 1];
 	int rc;
 
-	rc = exfat_lookup(ef, &node, old_path);
-	if (rc != 0)
+	if (existing->attrib & EXFAT_ATTRIB_DIR)
+	{
+		if (node->attrib & EXFAT_ATTRIB_DIR)
+			rc = exfat_rmdir(ef, existing);
+		else
+			rc = -ENOTDIR;
+	}
+	else
+	{
+		if (!(node->attrib & EXFAT_ATTRIB_DIR))
+			rc = exfat_unlink(ef, existing);
+		else
+			rc = -EISDIR;
+	}
+	exfat_put_node(ef, existing);
+	if (existing->references != 0)
 		return rc;
-
-	rc = exfat_split(ef, &dir, &existing, name, new_path);
 	if (rc != 0)
 	{
-		exfat_put_node(ef, node);
+		/* free clusters even if something went wrong; otherwise they
+		   will be just lost */
+		exfat_cleanup_node(ef, existing);
 		return rc;
 	}
+	return exfat_cleanup_node(ef, existing);
+}
+
+/*
+ * Moves the node to the directory under the new name. The existing node
+ * with that name is passed with a reference which is dropped.
+ */
+static int rename_node(struct exfat* ef, struct exfat_node* node,
+		struct exfat_node* dir, struct exfat_node* existing,
+		const le16_t* name)
+{
+	off_t offset = -1;
+	int rc;
 
 	/* check that target is not a subdirectory of the source */
 	if (node->attrib & EXFAT_ATTRIB_DIR)
@@ -1100,8 +1970,6 @@ int exfat_rename(struct exfat* ef, const char* old_path, const char* new_path)
 			{
 				if (existing != NULL)
 					exfat_put_node(ef, existing);
-				exfat_put_node(ef, dir);
-				exfat_put_node(ef, node);
 				return -EINVAL;
 			}
 	}
@@ -1111,37 +1979,9 @@ int exfat_rename(struct exfat* ef, const char* old_path, const char* new_path)
 		/* remove target if it's not the same node as source */
 		if (existing != node)
 		{
-			if (existing->attrib & EXFAT_ATTRIB_DIR)
-			{
-				if (node->attrib & EXFAT_ATTRIB_DIR)
-					rc = exfat_rmdir(ef, existing);
-				else
-					rc = -ENOTDIR;
-			}
-			else
-			{
-				if (!(node->attrib & EXFAT_ATTRIB_DIR))
-					rc = exfat_unlink(ef, existing);
-				else
-					rc = -EISDIR;
-			}
-			exfat_put_node(ef, existing);
+			rc = replace_node(ef, node, existing);
 			if (rc != 0)
-			{
-				/* free clusters even if something went wrong; otherwise they
-				   will be just lost */
-				exfat_cleanup_node(ef, existing);
-				exfat_put_node(ef, dir);
-				exfat_put_node(ef, node);
-				return rc;
-			}
-			rc = exfat_cleanup_node(ef, existing);
-			if (rc != 0)
-			{
-				exfat_put_node(ef, dir);
-				exfat_put_node(ef, node);
 				return rc;
-			}
 		}
 		else
 			exfat_put_node(ef, existing);
@@ -1150,42 +1990,75 @@ int exfat_rename(struct exfat* ef, const char* old_path, const char* new_path)
 	rc = find_slot(ef, dir, &offset,
 			2 + DIV_ROUND_UP(exfat_utf16_length(name), EXFAT_ENAME_MAX));
 	if (rc != 0)
-	{
-		exfat_put_node(ef, dir);
-		exfat_put_node(ef, node);
 		return rc;
-	}
 	rc = rename_entry(ef, dir, node, name, offset);
+	if (rc != 0)
+		return rc;
+	/* node itself is not marked as dirty, no need to flush it */
+	return exfat_flush_node(ef, dir);
+}
+
+int exfat_rename(struct exfat* ef, const char* old_path, const char* new_path)
+{
+	struct exfat_node* node;
+	struct exfat_node* existing;
+	struct exfat_node* dir;
+	le16_t name[EXFAT_NAME_MAX + 1];
+	int rc;
+
+	rc = exfat_lookup(ef, &node, old_path);
+	if (rc != 0)
+		return rc;
+
+	rc = exfat_split(ef, &dir, &existing, name, new_path);
 	if (rc != 0)
 	{
-		exfat_put_node(ef, dir);
 		exfat_put_node(ef, node);
 		return rc;
 	}
-	rc = exfat_flush_node(ef, dir);
+
+	rc = rename_node(ef, node, dir, existing, name);
 	exfat_put_node(ef, dir);
 	exfat_put_node(ef, node);
-	/* node itself is not marked as dirty, no need to flush it */
 	return rc;
 }
 
+int exfat_renameat(struct exfat* ef, struct exfat_node* node,
+		struct exfat_node* dir, const char* comp)
+{
+	struct exfat_node* existing;
+	le16_t name[EXFAT_NAME_MAX + 1];
+	int rc;
+
+	rc = exfat_split_name(ef, dir, &existing, name, comp);
+	if (rc != 0)
+		return rc;
+	return rename_node(ef, node, dir, existing, name);
+}
+
 void exfat_utimes(struct exfat_node* node, const struct timespec tv[2])
 {
+	pthread_mutex_lock(&node->lock);
 	node->atime = tv[0].tv_sec;
 	node->mtime = tv[1].tv_sec;
 	node->is_dirty = true;
+	pthread_mutex_unlock(&node->lock);
 }
 
 void exfat_update_atime(struct exfat_node* node)
 {
+	pthread_mutex_lock(&node->lock);
 	node->atime = time(NULL);
 	node->is_dirty = true;
+	pthread_mutex_unlock(&node->lock);
 }
 
 void exfat_update_mtime(struct exfat_node* node)
 {
+	pthread_mutex_lock(&node->lock);
 	node->mtime = time(NULL);
 	node->is_dirty = true;
+	pthread_mutex_unlock(&node->lock);
 }
 
 const char* exfat_get_label(struct exfat* ef)
@@ -1234,9 +2107,11 @@ int exfat_set_label(struct exfat* ef, const char* label)
 	if (entry.length == 0)
 		entry.type ^= EXFAT_ENTRY_VALID;
 
-	rc = write_entries(ef, ef->root, (struct exfat_entry*) &entry, 1, offset);
+	rc = write_entries(ef, ef->root, (struct exfat_entry*) &entry, 1, offset,
+			false);
 	if (rc != 0)
 		return rc;
+	mark_slots(ef->root, offset, 1, entry.type & EXFAT_ENTRY_VALID);
 
 	strcpy(ef->label, label);
 	return 0;
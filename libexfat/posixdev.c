@@ -0,0 +1,356 @@
+/*
+	posixdev.c (16.10.26)
+	Block device backend based on POSIX pread() and pwrite().
+
+	Free exFAT implementation.
+	Copyright (C) 2010-2023  Andrew Nayenko
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "device.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#if defined(__APPLE__)
+#include <sys/disk.h>
+#elif defined(__OpenBSD__)
+#include <sys/param.h>
+#include <sys/disklabel.h>
+#include <sys/dkio.h>
+#include <sys/ioctl.h>
+#elif defined(__NetBSD__)
+#include <sys/ioctl.h>
+#elif __linux__
+#include <sys/mount.h>
+#endif
+#ifdef USE_UBLIO
+#include <sys/uio.h>
+#include <ublio.h>
+#endif
+
+struct posix_dev
+{
+	struct exfat_dev dev;
+	int fd;
+#ifdef USE_UBLIO
+	ublio_filehandle_t ufh;
+	pthread_mutex_t lock;			/* ublio is not thread-safe */
+#endif
+};
+
+static int open_ro(const char* spec)
+{
+	return open(spec, O_RDONLY);
+}
+
+static int open_rw(const char* spec)
+{
+	int fd = open(spec, O_RDWR);
+#ifdef __linux__
+	int ro = 0;
+
+	/*
+	   This ioctl is needed because after "blockdev --setro" kernel still
+	   allows to open the device in read-write mode but fails writes.
+	*/
+	if (fd != -1 && ioctl(fd, BLKROGET, &ro) == 0 && ro)
+	{
+		close(fd);
+		errno = EROFS;
+		return -1;
+	}
+#endif
+	return fd;
+}
+
+static off_t get_size(int fd, const char* spec,
+		UNUSED const struct stat* stbuf)
+{
+#if defined(__APPLE__)
+	if (!S_ISREG(stbuf->st_mode))
+	{
+		uint32_t block_size = 0;
+		uint64_t blocks = 0;
+
+		if (ioctl(fd, DKIOCGETBLOCKSIZE, &block_size) != 0)
+		{
+			exfat_error("failed to get block size");
+			return -1;
+		}
+		if (ioctl(fd, DKIOCGETBLOCKCOUNT, &blocks) != 0)
+		{
+			exfat_error("failed to get blocks count");
+			return -1;
+		}
+		return blocks * block_size;
+	}
+#elif defined(__OpenBSD__)
+	if (!S_ISREG(stbuf->st_mode))
+	{
+		struct disklabel lab;
+		struct partition* pp;
+		char* partition;
+
+		if (ioctl(fd, DIOCGDINFO, &lab) == -1)
+		{
+			exfat_error("failed to get disklabel");
+			return -1;
+		}
+
+		/* Don't need to check that partition letter is valid as we won't get
+		   this far otherwise. */
+		partition = strchr(spec, '\0') - 1;
+		pp = &(lab.d_partitions[*partition - 'a']);
+
+		if (pp->p_fstype != FS_NTFS)
+			exfat_warn("partition type is not 0x07 (NTFS/exFAT); "
+					"you can fix this with fdisk(8)");
+		return DL_GETPSIZE(pp) * lab.d_secsize;
+	}
+#elif defined(__NetBSD__)
+	if (!S_ISREG(stbuf->st_mode))
+	{
+		off_t size;
+
+		if (ioctl(fd, DIOCGMEDIASIZE, &size) == -1)
+		{
+			exfat_error("failed to get media size");
+			return -1;
+		}
+		return size;
+	}
+#endif
+	{
+		/* works for Linux, FreeBSD, Solaris */
+		off_t size = lseek(fd, 0, SEEK_END);
+
+		if (size <= 0)
+		{
+			exfat_error("failed to get size of '%s'", spec);
+			return -1;
+		}
+		if (lseek(fd, 0, SEEK_SET) == -1)
+		{
+			exfat_error("failed to seek to the beginning of '%s'", spec);
+			return -1;
+		}
+		return size;
+	}
+}
+
+/*
+   Opens a device or an image file. Resolves EXFAT_MODE_ANY into the mode the
+   file was actually opened in.
+*/
+int exfat_open_fd(const char* spec, enum exfat_mode* mode, off_t* size)
+{
+	struct stat stbuf;
+	int fd = -1;
+
+	switch (*mode)
+	{
+	case EXFAT_MODE_RO:
+		fd = open_ro(spec);
+		if (fd == -1)
+		{
+			exfat_error("failed to open '%s' in read-only mode: %s", spec,
+					strerror(errno));
+			return -1;
+		}
+		break;
+	case EXFAT_MODE_RW:
+		fd = open_rw(spec);
+		if (fd == -1)
+		{
+			exfat_error("failed to open '%s' in read-write mode: %s", spec,
+					strerror(errno));
+			return -1;
+		}
+		break;
+	case EXFAT_MODE_ANY:
+		fd = open_rw(spec);
+		if (fd != -1)
+		{
+			*mode = EXFAT_MODE_RW;
+			break;
+		}
+		fd = open_ro(spec);
+		if (fd != -1)
+		{
+			*mode = EXFAT_MODE_RO;
+			exfat_warn("'%s' is write-protected, mounting read-only", spec);
+			break;
+		}
+		exfat_error("failed to open '%s': %s", spec, strerror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, &stbuf) != 0)
+	{
+		close(fd);
+		exfat_error("failed to fstat '%s'", spec);
+		return -1;
+	}
+	if (!S_ISBLK(stbuf.st_mode) &&
+		!S_ISCHR(stbuf.st_mode) &&
+		!S_ISREG(stbuf.st_mode))
+	{
+		close(fd);
+		exfat_error("'%s' is neither a device, nor a regular file", spec);
+		return -1;
+	}
+
+	*size = get_size(fd, spec, &stbuf);
+	if (*size == -1)
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static struct exfat_dev* posix_open(const char* spec, enum exfat_mode mode)
+{
+	struct posix_dev* pdev;
+#ifdef USE_UBLIO
+	struct ublio_param up;
+#endif
+
+	pdev = malloc(sizeof(struct posix_dev));
+	if (pdev == NULL)
+	{
+		exfat_error("failed to allocate memory for device structure");
+		return NULL;
+	}
+
+	pdev->fd = exfat_open_fd(spec, &mode, &pdev->dev.size);
+	if (pdev->fd == -1)
+	{
+		free(pdev);
+		return NULL;
+	}
+	pdev->dev.ops = &exfat_posix_dev_ops;
+	pdev->dev.mode = mode;
+
+#ifdef USE_UBLIO
+	memset(&up, 0, sizeof(struct ublio_param));
+	up.up_blocksize = 256 * 1024;
+	up.up_items = 64;
+	up.up_grace = 32;
+	up.up_priv = &pdev->fd;
+
+	pdev->ufh = ublio_open(&up);
+	if (pdev->ufh == NULL)
+	{
+		close(pdev->fd);
+		free(pdev);
+		exfat_error("failed to initialize ublio");
+		return NULL;
+	}
+	pthread_mutex_init(&pdev->lock, NULL);
+#endif
+
+	return &pdev->dev;
+}
+
+static int posix_close(struct exfat_dev* dev)
+{
+	struct posix_dev* pdev = (struct posix_dev*) dev;
+	int rc = 0;
+
+#ifdef USE_UBLIO
+	if (ublio_close(pdev->ufh) != 0)
+	{
+		exfat_error("failed to close ublio");
+		rc = -EIO;
+	}
+	pthread_mutex_destroy(&pdev->lock);
+#endif
+	if (close(pdev->fd) != 0)
+	{
+		exfat_error("failed to close device: %s", strerror(errno));
+		rc = -EIO;
+	}
+	free(pdev);
+	return rc;
+}
+
+static int posix_fsync(struct exfat_dev* dev)
+{
+	struct posix_dev* pdev = (struct posix_dev*) dev;
+	int rc = 0;
+
+#ifdef USE_UBLIO
+	pthread_mutex_lock(&pdev->lock);
+	if (ublio_fsync(pdev->ufh) != 0)
+	{
+		exfat_error("ublio fsync failed");
+		rc = -EIO;
+	}
+	pthread_mutex_unlock(&pdev->lock);
+#endif
+	if (fsync(pdev->fd) != 0)
+	{
+		exfat_error("fsync failed: %s", strerror(errno));
+		rc = -EIO;
+	}
+	return rc;
+}
+
+static ssize_t posix_pread(struct exfat_dev* dev, void* buffer, size_t size,
+		off_t offset)
+{
+	struct posix_dev* pdev = (struct posix_dev*) dev;
+#ifdef USE_UBLIO
+	ssize_t result;
+
+	pthread_mutex_lock(&pdev->lock);
+	result = ublio_pread(pdev->ufh, buffer, size, offset);
+	pthread_mutex_unlock(&pdev->lock);
+	return result;
+#else
+	return pread(pdev->fd, buffer, size, offset);
+#endif
+}
+
+static ssize_t posix_pwrite(struct exfat_dev* dev, const void* buffer,
+		size_t size, off_t offset)
+{
+	struct posix_dev* pdev = (struct posix_dev*) dev;
+#ifdef USE_UBLIO
+	ssize_t result;
+
+	pthread_mutex_lock(&pdev->lock);
+	result = ublio_pwrite(pdev->ufh, (void*) buffer, size, offset);
+	pthread_mutex_unlock(&pdev->lock);
+	return result;
+#else
+	return pwrite(pdev->fd, buffer, size, offset);
+#endif
+}
+
+const struct exfat_dev_ops exfat_posix_dev_ops =
+{
+	.name	= "posix",
+	.open	= posix_open,
+	.close	= posix_close,
+	.fsync	= posix_fsync,
+	.pread	= posix_pread,
+	.pwrite	= posix_pwrite,
+};
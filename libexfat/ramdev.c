@@ -0,0 +1,148 @@
+/*
+	ramdev.c (16.10.26)
+	Block device backend that keeps a copy of the whole device in memory.
+
+	Free exFAT implementation.
+	Copyright (C) 2010-2023  Andrew Nayenko
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "device.h"
+#include <inttypes.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+/*
+   The device is read into memory on open and all changes stay there, the
+   original device is never written. Mostly useful for benchmarks and tests.
+*/
+struct ram_dev
+{
+	struct exfat_dev dev;
+	char* data;
+};
+
+static struct exfat_dev* ram_open(const char* spec, enum exfat_mode mode)
+{
+	struct ram_dev* rdev;
+	enum exfat_mode fd_mode = EXFAT_MODE_RO;
+	off_t offset;
+	ssize_t bytes;
+	int fd;
+
+	rdev = malloc(sizeof(struct ram_dev));
+	if (rdev == NULL)
+	{
+		exfat_error("failed to allocate memory for device structure");
+		return NULL;
+	}
+
+	fd = exfat_open_fd(spec, &fd_mode, &rdev->dev.size);
+	if (fd == -1)
+	{
+		free(rdev);
+		return NULL;
+	}
+	/* writes never reach the device, so it can be read-only */
+	rdev->dev.ops = &exfat_ram_dev_ops;
+	rdev->dev.mode = (mode == EXFAT_MODE_RO ? EXFAT_MODE_RO : EXFAT_MODE_RW);
+
+	if ((uint64_t) rdev->dev.size > SIZE_MAX ||
+			(rdev->data = malloc(rdev->dev.size)) == NULL)
+	{
+		exfat_error("failed to allocate %"PRId64" bytes for '%s'",
+				(int64_t) rdev->dev.size, spec);
+		close(fd);
+		free(rdev);
+		return NULL;
+	}
+	for (offset = 0; offset < rdev->dev.size; offset += bytes)
+	{
+		bytes = pread(fd, rdev->data + offset, rdev->dev.size - offset,
+				offset);
+		if (bytes <= 0)
+		{
+			close(fd);
+			free(rdev->data);
+			free(rdev);
+			exfat_error("failed to read '%s' into memory", spec);
+			return NULL;
+		}
+	}
+	close(fd);
+
+	return &rdev->dev;
+}
+
+static int ram_close(struct exfat_dev* dev)
+{
+	struct ram_dev* rdev = (struct ram_dev*) dev;
+
+	free(rdev->data);
+	free(rdev);
+	return 0;
+}
+
+static int ram_fsync(UNUSED struct exfat_dev* dev)
+{
+	return 0;
+}
+
+static ssize_t ram_pread(struct exfat_dev* dev, void* buffer, size_t size,
+		off_t offset)
+{
+	struct ram_dev* rdev = (struct ram_dev*) dev;
+
+	if (offset < 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	size = exfat_dev_clip(dev, size, offset);
+	memcpy(buffer, rdev->data + offset, size);
+	return size;
+}
+
+static ssize_t ram_pwrite(struct exfat_dev* dev, const void* buffer,
+		size_t size, off_t offset)
+{
+	struct ram_dev* rdev = (struct ram_dev*) dev;
+
+	if (dev->mode != EXFAT_MODE_RW)
+	{
+		errno = EBADF;
+		return -1;
+	}
+	if (offset < 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	size = exfat_dev_clip(dev, size, offset);
+	memcpy(rdev->data + offset, buffer, size);
+	return size;
+}
+
+const struct exfat_dev_ops exfat_ram_dev_ops =
+{
+	.name	= "ram",
+	.open	= ram_open,
+	.close	= ram_close,
+	.fsync	= ram_fsync,
+	.pread	= ram_pread,
+	.pwrite	= ram_pwrite,
+};
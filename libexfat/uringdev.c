@@ -0,0 +1,347 @@
+/*
+	uringdev.c (16.10.26)
+	Block device backend that submits batches of transfers via io_uring.
+
+	Free exFAT implementation.
+	Copyright (C) 2010-2023  Andrew Nayenko
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "device.h"
+
+#ifdef USE_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+/* enough for one full batch */
+#define URING_ENTRIES EXFAT_BATCH_SIZE
+
+/*
+   Single transfers go straight to pread() and pwrite(): a ring round trip
+   is not cheaper than one system call. Only batches use the ring, which is
+   serialized by the lock. The ring is set up without liburing, only the
+   kernel interface is used.
+*/
+struct uring_dev
+{
+	struct exfat_dev dev;
+	int fd;
+	int ring_fd;
+	pthread_mutex_t lock;
+	struct io_uring_sqe* sqes;
+	size_t sqes_size;
+	void* sq_ring;
+	size_t sq_ring_size;
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned* sq_mask;
+	unsigned* sq_array;
+	void* cq_ring;
+	size_t cq_ring_size;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned* cq_mask;
+	struct io_uring_cqe* cqes;
+};
+
+static int uring_setup(unsigned entries, struct io_uring_params* params)
+{
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete,
+		unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+			flags, NULL, 0);
+}
+
+static void* map_ring(int ring_fd, size_t size, off_t offset)
+{
+	return mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ring_fd, offset);
+}
+
+static void unmap_rings(struct uring_dev* udev)
+{
+	if (udev->sqes != MAP_FAILED)
+		munmap(udev->sqes, udev->sqes_size);
+	if (udev->cq_ring != MAP_FAILED && udev->cq_ring != udev->sq_ring)
+		munmap(udev->cq_ring, udev->cq_ring_size);
+	if (udev->sq_ring != MAP_FAILED)
+		munmap(udev->sq_ring, udev->sq_ring_size);
+}
+
+static bool init_ring(struct uring_dev* udev)
+{
+	struct io_uring_params params;
+
+	memset(&params, 0, sizeof(params));
+	udev->sqes = udev->sq_ring = udev->cq_ring = MAP_FAILED;
+	udev->ring_fd = uring_setup(URING_ENTRIES, &params);
+	if (udev->ring_fd == -1)
+		return false;
+
+	udev->sq_ring_size = params.sq_off.array +
+			params.sq_entries * sizeof(unsigned);
+	udev->cq_ring_size = params.cq_off.cqes +
+			params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		udev->sq_ring_size = udev->cq_ring_size =
+				MAX(udev->sq_ring_size, udev->cq_ring_size);
+	udev->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	udev->sq_ring = map_ring(udev->ring_fd, udev->sq_ring_size,
+			IORING_OFF_SQ_RING);
+	if (udev->sq_ring == MAP_FAILED)
+		goto error;
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		udev->cq_ring = udev->sq_ring;
+	else
+		udev->cq_ring = map_ring(udev->ring_fd, udev->cq_ring_size,
+				IORING_OFF_CQ_RING);
+	if (udev->cq_ring == MAP_FAILED)
+		goto error;
+	udev->sqes = map_ring(udev->ring_fd, udev->sqes_size, IORING_OFF_SQES);
+	if (udev->sqes == MAP_FAILED)
+		goto error;
+
+	udev->sq_head = (unsigned*) ((char*) udev->sq_ring + params.sq_off.head);
+	udev->sq_tail = (unsigned*) ((char*) udev->sq_ring + params.sq_off.tail);
+	udev->sq_mask = (unsigned*) ((char*) udev->sq_ring +
+			params.sq_off.ring_mask);
+	udev->sq_array = (unsigned*) ((char*) udev->sq_ring + params.sq_off.array);
+	udev->cq_head = (unsigned*) ((char*) udev->cq_ring + params.cq_off.head);
+	udev->cq_tail = (unsigned*) ((char*) udev->cq_ring + params.cq_off.tail);
+	udev->cq_mask = (unsigned*) ((char*) udev->cq_ring +
+			params.cq_off.ring_mask);
+	udev->cqes = (struct io_uring_cqe*) ((char*) udev->cq_ring +
+			params.cq_off.cqes);
+	return true;
+
+error:
+	unmap_rings(udev);
+	close(udev->ring_fd);
+	return false;
+}
+
+static struct exfat_dev* uring_open(const char* spec, enum exfat_mode mode)
+{
+	struct uring_dev* udev;
+
+	udev = malloc(sizeof(struct uring_dev));
+	if (udev == NULL)
+	{
+		exfat_error("failed to allocate memory for device structure");
+		return NULL;
+	}
+
+	if (!init_ring(udev))
+	{
+		free(udev);
+		exfat_warn("io_uring is not available (%s), using posix backend",
+				strerror(errno));
+		return exfat_posix_dev_ops.open(spec, mode);
+	}
+
+	udev->fd = exfat_open_fd(spec, &mode, &udev->dev.size);
+	if (udev->fd == -1)
+	{
+		unmap_rings(udev);
+		close(udev->ring_fd);
+		free(udev);
+		return NULL;
+	}
+	udev->dev.ops = &exfat_uring_dev_ops;
+	udev->dev.mode = mode;
+	pthread_mutex_init(&udev->lock, NULL);
+	return &udev->dev;
+}
+
+static int uring_close(struct exfat_dev* dev)
+{
+	struct uring_dev* udev = (struct uring_dev*) dev;
+	int rc = 0;
+
+	unmap_rings(udev);
+	close(udev->ring_fd);
+	pthread_mutex_destroy(&udev->lock);
+	if (close(udev->fd) != 0)
+	{
+		exfat_error("failed to close device: %s", strerror(errno));
+		rc = -EIO;
+	}
+	free(udev);
+	return rc;
+}
+
+static int uring_fsync(struct exfat_dev* dev)
+{
+	struct uring_dev* udev = (struct uring_dev*) dev;
+
+	if (fsync(udev->fd) != 0)
+	{
+		exfat_error("fsync failed: %s", strerror(errno));
+		return -EIO;
+	}
+	return 0;
+}
+
+static ssize_t uring_pread(struct exfat_dev* dev, void* buffer, size_t size,
+		off_t offset)
+{
+	return pread(((struct uring_dev*) dev)->fd, buffer, size, offset);
+}
+
+static ssize_t uring_pwrite(struct exfat_dev* dev, const void* buffer,
+		size_t size, off_t offset)
+{
+	return pwrite(((struct uring_dev*) dev)->fd, buffer, size, offset);
+}
+
+/* finishes a transfer the ring failed or did only partially */
+static int complete_sync(struct uring_dev* udev, const struct exfat_io* io,
+		size_t done, bool write)
+{
+	ssize_t result;
+
+	while (done < io->size)
+	{
+		if (write)
+			result = pwrite(udev->fd, (const char*) io->buffer + done,
+					io->size - done, io->offset + done);
+		else
+			result = pread(udev->fd, (char*) io->buffer + done,
+					io->size - done, io->offset + done);
+		if (result < 0)
+			return -errno;
+		if (result == 0)
+			return -EIO;
+		done += result;
+	}
+	return 0;
+}
+
+/* returns the number of transfers the kernel has accepted */
+static size_t submit(struct uring_dev* udev, const struct exfat_io* ios,
+		size_t count, bool write)
+{
+	unsigned tail = *udev->sq_tail;
+	unsigned pending;
+	size_t i;
+
+	for (i = 0; i < count; i++)
+	{
+		const unsigned index = tail & *udev->sq_mask;
+		struct io_uring_sqe* sqe = &udev->sqes[index];
+
+		memset(sqe, 0, sizeof(struct io_uring_sqe));
+		sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+		sqe->fd = udev->fd;
+		sqe->addr = (uintptr_t) ios[i].buffer;
+		sqe->len = ios[i].size;
+		sqe->off = ios[i].offset;
+		sqe->user_data = i;
+		udev->sq_array[index] = index;
+		tail++;
+	}
+	__atomic_store_n(udev->sq_tail, tail, __ATOMIC_RELEASE);
+
+	while ((pending = tail - __atomic_load_n(udev->sq_head,
+			__ATOMIC_ACQUIRE)) != 0)
+		if (uring_enter(udev->ring_fd, pending, 0, 0) == -1 &&
+				errno != EINTR && errno != EAGAIN && errno != EBUSY)
+		{
+			/* the kernel has not seen the rest, take it back */
+			__atomic_store_n(udev->sq_tail, tail - pending,
+					__ATOMIC_RELEASE);
+			return count - pending;
+		}
+	return count;
+}
+
+/* waits for one completion and finishes its transfer if needed */
+static int reap(struct uring_dev* udev, const struct exfat_io* ios,
+		bool write)
+{
+	const unsigned head = *udev->cq_head;
+	const struct io_uring_cqe* cqe;
+	const struct exfat_io* io;
+	int rc = 0;
+
+	while (head == __atomic_load_n(udev->cq_tail, __ATOMIC_ACQUIRE))
+		/* buffers are still in use by the kernel, so there is no way to
+		   give up waiting */
+		if (uring_enter(udev->ring_fd, 0, 1, IORING_ENTER_GETEVENTS) == -1 &&
+				errno != EINTR)
+			exfat_bug("failed to wait for io_uring: %s", strerror(errno));
+
+	cqe = &udev->cqes[head & *udev->cq_mask];
+	io = &ios[cqe->user_data];
+	if (cqe->res < 0)
+		/* e.g. the kernel does not support the operation */
+		rc = complete_sync(udev, io, 0, write);
+	else if ((size_t) cqe->res < io->size)
+		rc = complete_sync(udev, io, cqe->res, write);
+	__atomic_store_n(udev->cq_head, head + 1, __ATOMIC_RELEASE);
+	return rc;
+}
+
+static int uring_transfer(struct exfat_dev* dev, const struct exfat_io* ios,
+		size_t count, bool write)
+{
+	struct uring_dev* udev = (struct uring_dev*) dev;
+	size_t n, submitted, i;
+	int rc = 0;
+	int err;
+
+	pthread_mutex_lock(&udev->lock);
+	for (; count != 0; ios += n, count -= n)
+	{
+		/* sqe->len is 32-bit, longer transfers are done synchronously */
+		for (n = 0; n < MIN(count, URING_ENTRIES) &&
+				ios[n].size <= UINT32_MAX; n++);
+		submitted = (n != 0 ? submit(udev, ios, n, write) : 0);
+		for (i = 0; i < submitted; i++)
+			if ((err = reap(udev, ios, write)) != 0)
+				rc = err;
+		if (n == 0)
+			n = 1;
+		for (i = submitted; i < n; i++)
+			if ((err = complete_sync(udev, &ios[i], 0, write)) != 0)
+				rc = err;
+	}
+	pthread_mutex_unlock(&udev->lock);
+	return rc;
+}
+
+const struct exfat_dev_ops exfat_uring_dev_ops =
+{
+	.name		= "uring",
+	.open		= uring_open,
+	.close		= uring_close,
+	.fsync		= uring_fsync,
+	.pread		= uring_pread,
+	.pwrite		= uring_pwrite,
+	.transfer	= uring_transfer,
+};
+
+#endif /* ifdef USE_IO_URING */